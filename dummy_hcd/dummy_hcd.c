@@ -38,12 +38,17 @@
 #include <linux/usb/gadget.h>
 #include <linux/usb/hcd.h>
 #include <linux/scatterlist.h>
+#include <linux/smp.h>
+#include <linux/workqueue.h>
 
 #include <asm/byteorder.h>
 #include <linux/io.h>
 #include <asm/irq.h>
 #include <asm/unaligned.h>
 
+#define CREATE_TRACE_POINTS
+#include "dummy_hcd_trace.h"
+
 #define DRIVER_DESC	"USB Host+Gadget Emulator"
 #define DRIVER_VERSION	"02 May 2005"
 
@@ -51,6 +56,10 @@
 #define POWER_BUDGET_3	900	/* in mA */
 
 #define DUMMY_TIMER_INT_NSECS	125000 /* 1 microframe */
+#define DUMMY_TIMER_INT_NSECS_MIN	1000
+#define DUMMY_BANDWIDTH_SCALE_MAX	1000
+#define DUMMY_FIFO_SIZE_MAX	512	/* like a real UDC's FIFO */
+#define DUMMY_FIFO_SIZE_EP	64	/* for IN endpoints other than ep0 */
 
 static const char	driver_name[] = "dummy_hcd";
 static const char	driver_desc[] = "USB Host+Gadget Emulator";
@@ -65,12 +74,22 @@ struct dummy_hcd_module_parameters {
 	bool is_super_speed;
 	bool is_high_speed;
 	unsigned int num;
+	unsigned int timer_interval_ns;
+	unsigned int bandwidth_scale;
+	bool kick_immediately;
+	bool pin_timers;
+	unsigned int fifo_size;
+	bool worker;
 };
 
 static struct dummy_hcd_module_parameters mod_data = {
 	.is_super_speed = false,
 	.is_high_speed = true,
 	.num = 1,
+	.timer_interval_ns = DUMMY_TIMER_INT_NSECS,
+	.bandwidth_scale = 1,
+	.kick_immediately = false,
+	.fifo_size = 64,
 };
 module_param_named(is_super_speed, mod_data.is_super_speed, bool, S_IRUGO);
 MODULE_PARM_DESC(is_super_speed, "true to simulate SuperSpeed connection");
@@ -78,6 +97,57 @@ module_param_named(is_high_speed, mod_data.is_high_speed, bool, S_IRUGO);
 MODULE_PARM_DESC(is_high_speed, "true to simulate HighSpeed connection");
 module_param_named(num, mod_data.num, uint, S_IRUGO);
 MODULE_PARM_DESC(num, "number of emulated controllers");
+
+static int timer_interval_ns_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, DUMMY_TIMER_INT_NSECS_MIN,
+					NSEC_PER_SEC);
+}
+
+static const struct kernel_param_ops timer_interval_ns_ops = {
+	.set = timer_interval_ns_set,
+	.get = param_get_uint,
+};
+module_param_cb(timer_interval_ns, &timer_interval_ns_ops,
+		&mod_data.timer_interval_ns, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(timer_interval_ns, "interval between frames in nanoseconds");
+
+static int bandwidth_scale_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, 0, DUMMY_BANDWIDTH_SCALE_MAX);
+}
+
+static const struct kernel_param_ops bandwidth_scale_ops = {
+	.set = bandwidth_scale_set,
+	.get = param_get_uint,
+};
+module_param_cb(bandwidth_scale, &bandwidth_scale_ops,
+		&mod_data.bandwidth_scale, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bandwidth_scale,
+	"multiplier for the bandwidth of a frame, 0 for unlimited bandwidth");
+module_param_named(kick_immediately, mod_data.kick_immediately, bool,
+		S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(kick_immediately,
+	"true to process new URBs and requests without waiting for next frame");
+module_param_named(pin_timers, mod_data.pin_timers, bool, S_IRUGO);
+MODULE_PARM_DESC(pin_timers,
+	"true to run each controller's transfers on its own CPU");
+
+static int fifo_size_set(const char *val, const struct kernel_param *kp)
+{
+	return param_set_uint_minmax(val, kp, 0, DUMMY_FIFO_SIZE_MAX);
+}
+
+static const struct kernel_param_ops fifo_size_ops = {
+	.set = fifo_size_set,
+	.get = param_get_uint,
+};
+module_param_cb(fifo_size, &fifo_size_ops, &mod_data.fifo_size, S_IRUGO);
+MODULE_PARM_DESC(fifo_size,
+	"size of the emulated IN FIFO in bytes, up to 512 for ep0 and 64 for other endpoints, 0 to disable it");
+module_param_named(worker, mod_data.worker, bool, S_IRUGO);
+MODULE_PARM_DESC(worker,
+	"true to run transfers in a workqueue instead of the timer interrupt");
 /*-------------------------------------------------------------------------*/
 
 /* gadget side driver data structres */
@@ -97,6 +167,7 @@ struct dummy_ep {
 struct dummy_request {
 	struct list_head		queue;		/* ep's requests */
 	struct usb_request		req;
+	struct dummy_ep			*done_ep;	/* while batched */
 };
 
 static inline struct dummy_ep *usb_ep_to_dummy_ep(struct usb_ep *_ep)
@@ -221,15 +292,57 @@ static const struct {
 
 #define DUMMY_ENDPOINTS	ARRAY_SIZE(ep_info)
 
-/*-------------------------------------------------------------------------*/
+/* one slot per endpoint address; ep0 IN and OUT share slot 0 */
+#define DUMMY_ADDR_SLOTS	32
 
-#define FIFO_SIZE		64
+/*-------------------------------------------------------------------------*/
 
 struct urbp {
 	struct urb		*urb;
 	struct list_head	urbp_list;
+	struct list_head	urbq_list;
 	struct sg_mapping_iter	miter;
 	u32			miter_started;
+	u32			seq;
+	int			status;		/* while batched */
+};
+
+/* Requests and URBs completed by dummy_work(), given back in one go */
+struct dummy_done {
+	struct list_head	*reqs;		/* dum_hcd->done_reqs */
+	struct list_head	urbps;
+};
+
+/* URBs queued to one endpoint address, in submission order */
+struct urbq {
+	struct list_head	urbp_list;
+	struct list_head	ready;
+	bool			dirty;
+
+	/* for the stats attribute */
+	u64			urbs;
+	u64			bytes;
+	u64			deferred;
+};
+
+/*
+ * Run times of dummy_timer() are counted in buckets of [2^N, 2^(N + 1))
+ * nanoseconds, the last bucket counts the rest.
+ */
+#define DUMMY_TIMER_BUCKETS	24
+
+/* Scheduling statistics shown by the stats attribute */
+struct dummy_hcd_stats {
+	u64			timer_runs;
+	u64			frames;
+	u64			budget_bytes;	/* granted at frame starts */
+	u64			used_bytes;
+	u64			exhausted;	/* runs that used up a frame */
+	u64			deferred;	/* URBs skipped for bandwidth */
+	u64			periodic_limited;
+	u64			timer_ns;
+	u64			timer_ns_max;
+	u64			timer_hist[DUMMY_TIMER_BUCKETS];
 };
 
 
@@ -243,13 +356,26 @@ struct dummy_hcd {
 	struct dummy			*dum;
 	enum dummy_rh_state		rh_state;
 	struct hrtimer			timer;
+	struct work_struct		work;
+	int				cpu;
+	call_single_data_t		kick_csd;
+	/* when the kicks on their way to cpu fire the timer */
+	ktime_t				kick_expires;
+	unsigned int			kick_pending;
 	u32				port_status;
 	u32				old_status;
 	unsigned long			re_timeout;
 
 	struct usb_device		*udev;
 	struct list_head		urbp_list;
-	struct urbp			*next_frame_urbp;
+	struct urbq			urbq[DUMMY_ADDR_SLOTS];
+	struct list_head		ready_list;
+	/* requests batched by dummy_work(), protected by dum->lock */
+	struct list_head		done_reqs;
+	u32				run_seq;
+	ktime_t				frame_end;
+	int				frame_budget;
+	struct dummy_hcd_stats		stats;
 
 	u32				stream_en_ep;
 	u8				num_stream[30 / 2];
@@ -266,22 +392,25 @@ struct dummy {
 	 * DEVICE/GADGET side support
 	 */
 	struct dummy_ep			ep[DUMMY_ENDPOINTS];
+	struct dummy_ep			*ep_by_addr[DUMMY_ADDR_SLOTS];
 	int				address;
 	int				callback_usage;
 	struct usb_gadget		gadget;
 	struct usb_gadget_driver	*driver;
 	struct dummy_request		fifo_req;
-	u8				fifo_buf[FIFO_SIZE];
 	u16				devstatus;
 	unsigned			ints_enabled:1;
 	unsigned			udc_suspended:1;
 	unsigned			pullup:1;
+	unsigned			ep0_data_in:1;
 
 	/*
 	 * HOST side support
 	 */
 	struct dummy_hcd		*hs_hcd;
 	struct dummy_hcd		*ss_hcd;
+
+	u8				fifo_buf[];	/* fifo_size */
 };
 
 static inline struct dummy_hcd *hcd_to_dummy_hcd(struct usb_hcd *hcd)
@@ -323,16 +452,149 @@ static inline struct dummy *gadget_dev_to_dummy(struct device *dev)
 	return container_of(dev, struct dummy, gadget.dev);
 }
 
+/*
+ * Schedules dummy_timer() for the start of the next frame, or right away if
+ * now is set.  Early runs share the bandwidth of the current frame.
+ * Caller must own dum->lock.
+ */
+static void dummy_kick(struct dummy_hcd *dum_hcd, bool now)
+{
+	ktime_t delay = 0;
+
+	if (!now) {
+		delay = ktime_sub(dum_hcd->frame_end, ktime_get());
+		if (delay <= 0)
+			delay = READ_ONCE(mod_data.timer_interval_ns);
+	}
+	if (dum_hcd->cpu < 0) {
+		hrtimer_start(&dum_hcd->timer, delay, HRTIMER_MODE_REL);
+		return;
+	}
+
+	/*
+	 * A pinned timer would follow us to this CPU, so ask the right one
+	 * to run it, at the earliest time asked for by the kicks on their
+	 * way.
+	 */
+	if (dum_hcd->cpu != smp_processor_id()) {
+		ktime_t expires = ktime_add(ktime_get(), delay);
+
+		if (!dum_hcd->kick_pending ||
+				ktime_before(expires, dum_hcd->kick_expires))
+			dum_hcd->kick_expires = expires;
+		if (!smp_call_function_single_async(dum_hcd->cpu,
+					&dum_hcd->kick_csd)) {
+			dum_hcd->kick_pending++;
+			return;
+		}
+		/*
+		 * Either the CPU is offline, or kick_csd is still queued;
+		 * arm the timer here rather than count on it.
+		 */
+	}
+	hrtimer_start(&dum_hcd->timer, delay, HRTIMER_MODE_REL_PINNED);
+}
+
+/* runs on dum_hcd->cpu, in hardirq context */
+static void dummy_kick_on_cpu(void *data)
+{
+	struct dummy_hcd	*dum_hcd = data;
+
+	spin_lock(&dum_hcd->dum->lock);
+	dum_hcd->kick_pending--;
+	if (dum_hcd->udev)
+		hrtimer_start(&dum_hcd->timer, dum_hcd->kick_expires,
+				HRTIMER_MODE_ABS_PINNED);
+	spin_unlock(&dum_hcd->dum->lock);
+}
+
+static u8 dummy_urb_address(struct urb *urb)
+{
+	u8 address = usb_pipeendpoint(urb->pipe);
+
+	if (usb_urb_dir_in(urb))
+		address |= USB_DIR_IN;
+	return address;
+}
+
+static unsigned int dummy_addr_slot(u8 address)
+{
+	if ((address & USB_ENDPOINT_NUMBER_MASK) == 0)
+		return 0;
+	return (address & USB_ENDPOINT_NUMBER_MASK) |
+			((address & USB_DIR_IN) ? 16 : 0);
+}
+
+static unsigned int dummy_ep_slot(struct dummy_ep *ep)
+{
+	return ep->desc ? dummy_addr_slot(ep->desc->bEndpointAddress) : 0;
+}
+
+/*
+ * Puts an endpoint address with queued URBs on the list that dummy_timer()
+ * works through.  Addresses get dropped from that list while the gadget is
+ * NAKing them, so anything that might change the outcome of a transfer
+ * (a new request, an unlink, a halt, a port status change) must call this.
+ * Caller must own dum->lock.
+ */
+static void dummy_urbq_ready(struct dummy_hcd *dum_hcd, unsigned int slot)
+{
+	struct urbq	*urbq;
+
+	if (!dum_hcd || !dum_hcd->udev)
+		return;
+	urbq = &dum_hcd->urbq[slot];
+	if (list_empty(&urbq->urbp_list))
+		return;
+	/* dummy_timer() may be looking at it with the lock dropped */
+	urbq->dirty = true;
+	if (list_empty(&urbq->ready))
+		list_add_tail(&urbq->ready, &dum_hcd->ready_list);
+}
+
+static void dummy_hcd_ready_all(struct dummy_hcd *dum_hcd)
+{
+	unsigned int	slot;
+
+	for (slot = 0; slot < DUMMY_ADDR_SLOTS; slot++)
+		dummy_urbq_ready(dum_hcd, slot);
+}
+
+static void dummy_ep_ready(struct dummy *dum, struct dummy_ep *ep)
+{
+	dummy_urbq_ready(dum->hs_hcd, dummy_ep_slot(ep));
+	dummy_urbq_ready(dum->ss_hcd, dummy_ep_slot(ep));
+}
+
 /*-------------------------------------------------------------------------*/
 
 /* DEVICE/GADGET SIDE UTILITY ROUTINES */
 
+/* finds a request of ep that a worker batch holds; caller must own lock */
+static struct dummy_request *dummy_find_batched(struct dummy *dum,
+		struct dummy_ep *ep)
+{
+	struct dummy_hcd	*hcds[] = { dum->hs_hcd, dum->ss_hcd };
+	struct dummy_request	*req;
+	int			i;
+
+	for (i = 0; i < ARRAY_SIZE(hcds); i++) {
+		if (!hcds[i])
+			continue;
+		list_for_each_entry(req, &hcds[i]->done_reqs, queue) {
+			if (req->done_ep == ep)
+				return req;
+		}
+	}
+	return NULL;
+}
+
 /* called with spinlock held */
 static void nuke(struct dummy *dum, struct dummy_ep *ep)
 {
-	while (!list_empty(&ep->queue)) {
-		struct dummy_request	*req;
+	struct dummy_request	*req;
 
+	while (!list_empty(&ep->queue)) {
 		req = list_entry(ep->queue.next, struct dummy_request, queue);
 		list_del_init(&req->queue);
 		req->req.status = -ESHUTDOWN;
@@ -341,6 +603,17 @@ static void nuke(struct dummy *dum, struct dummy_ep *ep)
 		usb_gadget_giveback_request(&ep->ep, &req->req);
 		spin_lock(&dum->lock);
 	}
+
+	/* completed requests still waiting in a batch can't outlive ep */
+	while ((req = dummy_find_batched(dum, ep)) != NULL) {
+		list_del_init(&req->queue);
+		req->req.status = -ESHUTDOWN;
+		--dum->callback_usage;
+
+		spin_unlock(&dum->lock);
+		usb_gadget_giveback_request(&ep->ep, &req->req);
+		spin_lock(&dum->lock);
+	}
 }
 
 /* caller must hold lock */
@@ -484,6 +757,7 @@ static void set_link_state(struct dummy_hcd *dum_hcd)
 
 	dum_hcd->old_status = dum_hcd->port_status;
 	dum_hcd->old_active = dum_hcd->active;
+	dummy_hcd_ready_all(dum_hcd);
 }
 
 /*-------------------------------------------------------------------------*/
@@ -617,6 +891,7 @@ static int dummy_enable(struct usb_ep *_ep,
 		}
 		ep->stream_en = 1;
 	}
+	dum->ep_by_addr[dummy_addr_slot(desc->bEndpointAddress)] = ep;
 	ep->desc = desc;
 
 	dev_dbg(udc_dev(dum), "enabled %s (ep%d%s-%s) maxpacket %d stream %s\n",
@@ -647,6 +922,10 @@ static int dummy_disable(struct usb_ep *_ep)
 	dum = ep_to_dummy(ep);
 
 	spin_lock_irqsave(&dum->lock, flags);
+	if (dum->ep_by_addr[dummy_ep_slot(ep)] == ep)
+		dum->ep_by_addr[dummy_ep_slot(ep)] = NULL;
+	/* pending URBs will now fail */
+	dummy_ep_ready(dum, ep);
 	ep->desc = NULL;
 	ep->stream_en = 0;
 	nuke(dum, ep);
@@ -696,6 +975,7 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 	struct dummy_request	*req;
 	struct dummy		*dum;
 	struct dummy_hcd	*dum_hcd;
+	struct urbq		*urbq;
 	unsigned long		flags;
 
 	req = usb_request_to_dummy_request(_req);
@@ -719,11 +999,16 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 	_req->actual = 0;
 	spin_lock_irqsave(&dum->lock, flags);
 
-	/* implement an emulated single-request FIFO */
-	if (ep->desc && (ep->desc->bEndpointAddress & USB_DIR_IN) &&
+	/* implement an emulated single-request FIFO, shared by all IN
+	 * endpoints and the data stage of control reads; only small control
+	 * replies can use more than the upstream 64 bytes of it
+	 */
+	if ((ep->desc ? (ep->desc->bEndpointAddress & USB_DIR_IN) :
+				dum->ep0_data_in) &&
 			list_empty(&dum->fifo_req.queue) &&
-			list_empty(&ep->queue) &&
-			_req->length <= FIFO_SIZE) {
+			list_empty(&ep->queue) && mod_data.fifo_size &&
+			_req->length <= mod_data.fifo_size &&
+			(!ep->desc || _req->length <= DUMMY_FIFO_SIZE_EP)) {
 		req = &dum->fifo_req;
 		req->req = *_req;
 		req->req.buf = dum->fifo_buf;
@@ -739,11 +1024,18 @@ static int dummy_queue(struct usb_ep *_ep, struct usb_request *_req,
 		spin_lock(&dum->lock);
 	}  else
 		list_add_tail(&req->queue, &ep->queue);
-	spin_unlock_irqrestore(&dum->lock, flags);
 
 	/* real hardware would likely enable transfers here, in case
-	 * it'd been left NAKing.
+	 * it'd been left NAKing.  Do the same if the host side is already
+	 * waiting, rather than letting the transfer sit until the next frame.
 	 */
+	urbq = &dum_hcd->urbq[dummy_ep_slot(ep)];
+	dummy_urbq_ready(dum_hcd, dummy_ep_slot(ep));
+	if (dum_hcd->udev && dum_hcd->rh_state == DUMMY_RH_RUNNING &&
+			(READ_ONCE(mod_data.kick_immediately) ||
+			 !list_empty(&urbq->urbp_list)))
+		dummy_kick(dum_hcd, true);
+	spin_unlock_irqrestore(&dum->lock, flags);
 	return 0;
 }
 
@@ -791,6 +1083,7 @@ dummy_set_halt_and_wedge(struct usb_ep *_ep, int value, int wedged)
 {
 	struct dummy_ep		*ep;
 	struct dummy		*dum;
+	unsigned long		flags;
 
 	if (!_ep)
 		return -EINVAL;
@@ -807,6 +1100,9 @@ dummy_set_halt_and_wedge(struct usb_ep *_ep, int value, int wedged)
 		ep->halted = 1;
 		if (wedged)
 			ep->wedged = 1;
+		spin_lock_irqsave(&dum->lock, flags);
+		dummy_ep_ready(dum, ep);
+		spin_unlock_irqrestore(&dum->lock, flags);
 	}
 	/* FIXME clear emulated data toggle too */
 	return 0;
@@ -943,6 +1239,8 @@ static void dummy_udc_async_callbacks(struct usb_gadget *_gadget, bool enable)
 
 	spin_lock_irq(&dum->lock);
 	dum->ints_enabled = enable;
+	dummy_hcd_ready_all(dum->hs_hcd);
+	dummy_hcd_ready_all(dum->ss_hcd);
 	spin_unlock_irq(&dum->lock);
 }
 
@@ -1258,13 +1556,17 @@ static int dummy_validate_stream(struct dummy_hcd *dum_hcd, struct urb *urb)
 	return 0;
 }
 
+static struct dummy_ep *find_endpoint(struct dummy *dum, u8 address);
+
 static int dummy_urb_enqueue(
 	struct usb_hcd			*hcd,
 	struct urb			*urb,
 	gfp_t				mem_flags
 ) {
 	struct dummy_hcd *dum_hcd;
+	struct dummy_ep	*ep;
 	struct urbp	*urbp;
+	unsigned int	slot;
 	unsigned long	flags;
 	int		rc;
 
@@ -1296,15 +1598,26 @@ static int dummy_urb_enqueue(
 		dev_err(dummy_dev(dum_hcd), "usb_device address has changed!\n");
 
 	list_add_tail(&urbp->urbp_list, &dum_hcd->urbp_list);
+	slot = dummy_addr_slot(dummy_urb_address(urb));
+	list_add_tail(&urbp->urbq_list, &dum_hcd->urbq[slot].urbp_list);
+	urbp->seq = dum_hcd->run_seq;
 	urb->hcpriv = urbp;
-	if (!dum_hcd->next_frame_urbp)
-		dum_hcd->next_frame_urbp = urbp;
+	dummy_urbq_ready(dum_hcd, slot);
+	trace_dummy_hcd_urb_enqueue(hcd, urb);
 	if (usb_pipetype(urb->pipe) == PIPE_CONTROL)
 		urb->error_count = 1;		/* mark as a new urb */
 
-	/* kick the scheduler, it'll do the rest */
-	if (!hrtimer_active(&dum_hcd->timer))
-		hrtimer_start(&dum_hcd->timer, ns_to_ktime(DUMMY_TIMER_INT_NSECS), HRTIMER_MODE_REL);
+	/* kick the scheduler, it'll do the rest; don't wait for the next
+	 * frame if the gadget side has a request (or, for ep0, a setup
+	 * handler) ready
+	 */
+	ep = find_endpoint(dum_hcd->dum, dummy_urb_address(urb));
+	if (READ_ONCE(mod_data.kick_immediately) ||
+			(ep && dum_hcd->rh_state == DUMMY_RH_RUNNING &&
+			 (!ep->desc || !list_empty(&ep->queue))))
+		dummy_kick(dum_hcd, true);
+	else if (!hrtimer_active(&dum_hcd->timer))
+		dummy_kick(dum_hcd, false);
 
  done:
 	spin_unlock_irqrestore(&dum_hcd->dum->lock, flags);
@@ -1323,9 +1636,14 @@ static int dummy_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	spin_lock_irqsave(&dum_hcd->dum->lock, flags);
 
 	rc = usb_hcd_check_unlink_urb(hcd, urb, status);
+	if (!rc) {
+		trace_dummy_hcd_urb_dequeue(hcd, urb);
+		dummy_urbq_ready(dum_hcd,
+				dummy_addr_slot(dummy_urb_address(urb)));
+	}
 	if (!rc && dum_hcd->rh_state != DUMMY_RH_RUNNING &&
 			!list_empty(&dum_hcd->urbp_list))
-		hrtimer_start(&dum_hcd->timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+		dummy_kick(dum_hcd, true);
 
 	spin_unlock_irqrestore(&dum_hcd->dum->lock, flags);
 	return rc;
@@ -1397,9 +1715,92 @@ static int dummy_perform_transfer(struct urb *urb, struct dummy_request *req,
 	return trans;
 }
 
+/*
+ * Gives back a completed request, or adds it to the batch if there is one.
+ * Caller must own dum->lock.
+ */
+static void dummy_giveback_req(struct dummy *dum, struct dummy_ep *ep,
+		struct dummy_request *req, struct dummy_done *done)
+{
+	if (done) {
+		req->done_ep = ep;
+		list_add_tail(&req->queue, done->reqs);
+		/* unbinding waits for the batch like for other callbacks */
+		++dum->callback_usage;
+		return;
+	}
+	spin_unlock(&dum->lock);
+	usb_gadget_giveback_request(&ep->ep, &req->req);
+	spin_lock(&dum->lock);
+}
+
+/*
+ * Drop and retake dum->lock around callbacks.  The worker runs in process
+ * context, so it enables IRQs meanwhile but keeps bottom halves disabled,
+ * as the callbacks expect.
+ */
+static void dummy_unlock_cb(struct dummy *dum, struct dummy_done *done)
+{
+	if (!done) {
+		spin_unlock(&dum->lock);
+		return;
+	}
+	spin_unlock_irq(&dum->lock);
+	local_bh_disable();
+}
+
+static void dummy_lock_cb(struct dummy *dum, struct dummy_done *done)
+{
+	if (!done) {
+		spin_lock(&dum->lock);
+		return;
+	}
+	local_bh_enable();
+	spin_lock_irq(&dum->lock);
+}
+
+/*
+ * Gives back the batched requests, then the batched URBs.  Caller must not
+ * own dum->lock.  The requests stay on dum_hcd->done_reqs until they are
+ * given back, so that nuke() can find them when their endpoint goes away.
+ */
+static void dummy_giveback_done(struct dummy_hcd *dum_hcd,
+		struct dummy_done *done)
+{
+	struct dummy		*dum = dum_hcd->dum;
+	struct dummy_request	*req;
+	struct dummy_ep		*ep;
+	struct urbp		*urbp, *urbp_tmp;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&dum->lock, flags);
+	while (!list_empty(done->reqs)) {
+		req = list_first_entry(done->reqs, struct dummy_request, queue);
+		list_del_init(&req->queue);
+		ep = req->done_ep;
+		spin_unlock_irqrestore(&dum->lock, flags);
+		usb_gadget_giveback_request(&ep->ep, &req->req);
+		spin_lock_irqsave(&dum->lock, flags);
+		--dum->callback_usage;
+	}
+	spin_unlock_irqrestore(&dum->lock, flags);
+
+	list_for_each_entry_safe(urbp, urbp_tmp, &done->urbps, urbp_list) {
+		struct urb	*urb = urbp->urb;
+		int		status = urbp->status;
+
+		list_del(&urbp->urbp_list);
+		kfree(urbp);
+		trace_dummy_hcd_giveback(dummy_hcd_to_hcd(dum_hcd), urb,
+				status);
+		usb_hcd_giveback_urb(dummy_hcd_to_hcd(dum_hcd), urb, status);
+	}
+}
+
 /* transfer up to a frame's worth; caller must own lock */
 static int transfer(struct dummy_hcd *dum_hcd, struct urb *urb,
-		struct dummy_ep *ep, int limit, int *status)
+		struct dummy_ep *ep, int limit, int *status,
+		struct dummy_done *done)
 {
 	struct dummy		*dum = dum_hcd->dum;
 	struct dummy_request	*req;
@@ -1441,8 +1842,14 @@ top:
 			if (len == 0)
 				break;
 
+			/* if the rest of one side fits, copy it in one go; a
+			 * trailing partial packet makes it short either way
+			 */
+			if (len == min(host_len, dev_len)) {
+				is_short = (len % ep->ep.maxpacket) != 0;
+
 			/* send multiple of maxpacket first, then remainder */
-			if (len >= ep->ep.maxpacket) {
+			} else if (len >= ep->ep.maxpacket) {
 				is_short = 0;
 				if (len % ep->ep.maxpacket)
 					rescan = 1;
@@ -1462,6 +1869,8 @@ top:
 				urb->actual_length += len;
 				req->req.actual += len;
 			}
+			trace_dummy_hcd_transfer(dummy_hcd_to_hcd(dum_hcd),
+					urb, &req->req, len);
 		}
 
 		/* short packets terminate, maybe with overflow/underflow.
@@ -1512,10 +1921,7 @@ top:
 		/* device side completion --> continuable */
 		if (req->req.status != -EINPROGRESS) {
 			list_del_init(&req->queue);
-
-			spin_unlock(&dum->lock);
-			usb_gadget_giveback_request(&ep->ep, &req->req);
-			spin_lock(&dum->lock);
+			dummy_giveback_req(dum, ep, req, done);
 
 			/* requests might have been unlinked... */
 			rescan = 1;
@@ -1569,7 +1975,7 @@ static int periodic_bytes(struct dummy *dum, struct dummy_ep *ep)
 
 static struct dummy_ep *find_endpoint(struct dummy *dum, u8 address)
 {
-	int		i;
+	struct dummy_ep	*ep;
 
 	if (!is_active((dum->gadget.speed == USB_SPEED_SUPER ?
 			dum->ss_hcd : dum->hs_hcd)))
@@ -1578,14 +1984,9 @@ static struct dummy_ep *find_endpoint(struct dummy *dum, u8 address)
 		return NULL;
 	if ((address & ~USB_DIR_IN) == 0)
 		return &dum->ep[0];
-	for (i = 1; i < DUMMY_ENDPOINTS; i++) {
-		struct dummy_ep	*ep = &dum->ep[i];
-
-		if (!ep->desc)
-			continue;
-		if (ep->desc->bEndpointAddress == address)
-			return ep;
-	}
+	ep = dum->ep_by_addr[dummy_addr_slot(address)];
+	if (ep && ep->desc && ep->desc->bEndpointAddress == address)
+		return ep;
 	return NULL;
 }
 
@@ -1684,6 +2085,7 @@ static int handle_control_request(struct dummy_hcd *dum_hcd, struct urb *urb,
 				break;
 			}
 			ep2->halted = 1;
+			dummy_ep_ready(dum, ep2);
 			ret_val = 0;
 			*status = 0;
 		}
@@ -1774,21 +2176,13 @@ static int handle_control_request(struct dummy_hcd *dum_hcd, struct urb *urb,
 	return ret_val;
 }
 
-/*
- * Drive both sides of the transfers; looks like irq handlers to both
- * drivers except that the callbacks are invoked from soft interrupt
- * context.
- */
-static enum hrtimer_restart dummy_timer(struct hrtimer *t)
+/* simplistic model for one frame's bandwidth */
+static int dummy_frame_bytes(struct dummy_hcd *dum_hcd)
 {
-	struct dummy_hcd	*dum_hcd = from_timer(dum_hcd, t, timer);
 	struct dummy		*dum = dum_hcd->dum;
-	struct urbp		*urbp, *tmp;
-	unsigned long		flags;
-	int			limit, total;
-	int			i;
+	unsigned int		scale;
+	int			total;
 
-	/* simplistic model for one frame's bandwidth */
 	/* FIXME: account for transaction and packet overhead */
 	switch (dum->gadget.speed) {
 	case USB_SPEED_LOW:
@@ -1809,34 +2203,38 @@ static enum hrtimer_restart dummy_timer(struct hrtimer *t)
 		total = 0;
 		break;
 	}
+	scale = READ_ONCE(mod_data.bandwidth_scale);
+	if (total && !scale)
+		return INT_MAX;
+	return total * scale;
+}
 
-	/* look at each urb queued by the host side driver */
-	spin_lock_irqsave(&dum->lock, flags);
-
-	if (!dum_hcd->udev) {
-		dev_err(dummy_dev(dum_hcd),
-				"timer fired with no URBs pending?\n");
-		spin_unlock_irqrestore(&dum->lock, flags);
-		return HRTIMER_NORESTART;
-	}
-	dum_hcd->next_frame_urbp = NULL;
-
-	for (i = 0; i < DUMMY_ENDPOINTS; i++) {
-		if (!ep_info[i].name)
-			break;
-		dum->ep[i].already_seen = 0;
-	}
+/*
+ * Runs the URBs queued to one endpoint address, until the first one that
+ * can't complete yet.  Completions are batched into done unless it's NULL.
+ * Caller must own dum->lock.
+ */
+static void dummy_timer_urbq(struct dummy_hcd *dum_hcd, struct urbq *urbq,
+		u32 seq, int *total, struct dummy_done *done)
+{
+	struct dummy		*dum = dum_hcd->dum;
+	struct urbp		*urbp, *tmp;
+	int			limit;
+	bool			nak;
 
+	urbq->dirty = false;
 restart:
-	list_for_each_entry_safe(urbp, tmp, &dum_hcd->urbp_list, urbp_list) {
+	nak = false;
+	list_for_each_entry_safe(urbp, tmp, &urbq->urbp_list, urbq_list) {
 		struct urb		*urb;
 		struct dummy_request	*req;
 		u8			address;
 		struct dummy_ep		*ep = NULL;
 		int			status = -EINPROGRESS;
+		int			periodic = 0, sent;
 
 		/* stop when we reach URBs queued after the timer interrupt */
-		if (urbp == dum_hcd->next_frame_urbp)
+		if (urbp->seq == seq)
 			break;
 
 		urb = urbp->urb;
@@ -1846,13 +2244,14 @@ restart:
 			continue;
 
 		/* Used up this frame's bandwidth? */
-		if (total <= 0)
+		if (*total <= 0) {
+			urbq->deferred++;
+			dum_hcd->stats.deferred++;
 			continue;
+		}
 
 		/* find the gadget's ep for this request (if configured) */
-		address = usb_pipeendpoint (urb->pipe);
-		if (usb_urb_dir_in(urb))
-			address |= USB_DIR_IN;
+		address = dummy_urb_address(urb);
 		ep = find_endpoint(dum, address);
 		if (!ep) {
 			/* set_configuration() disagreement */
@@ -1885,16 +2284,15 @@ restart:
 			int				value;
 
 			setup = *(struct usb_ctrlrequest *) urb->setup_packet;
+			dum->ep0_data_in = (setup.bRequestType & USB_DIR_IN) &&
+					le16_to_cpu(setup.wLength);
 			/* paranoia, in case of stale queued data */
 			list_for_each_entry(req, &ep->queue, queue) {
 				list_del_init(&req->queue);
 				req->req.status = -EOVERFLOW;
 				dev_dbg(udc_dev(dum), "stale req = %p\n",
 						req);
-
-				spin_unlock(&dum->lock);
-				usb_gadget_giveback_request(&ep->ep, &req->req);
-				spin_lock(&dum->lock);
+				dummy_giveback_req(dum, ep, req, done);
 				ep->already_seen = 0;
 				goto restart;
 			}
@@ -1915,10 +2313,13 @@ restart:
 			 */
 			if (value > 0) {
 				++dum->callback_usage;
-				spin_unlock(&dum->lock);
+				dummy_unlock_cb(dum, done);
+				/* give back earlier completions first */
+				if (done)
+					dummy_giveback_done(dum_hcd, done);
 				value = dum->driver->setup(&dum->gadget,
 						&setup);
-				spin_lock(&dum->lock);
+				dummy_lock_cb(dum, done);
 				--dum->callback_usage;
 
 				if (value >= 0) {
@@ -1942,7 +2343,7 @@ restart:
 		}
 
 		/* non-control requests */
-		limit = total;
+		limit = *total;
 		switch (usb_pipetype(urb->pipe)) {
 		case PIPE_ISOCHRONOUS:
 			/*
@@ -1962,44 +2363,181 @@ restart:
 			/* FIXME is it urb->interval since the last xfer?
 			 * this almost certainly polls too fast.
 			 */
-			limit = max(limit, periodic_bytes(dum, ep));
+			periodic = periodic_bytes(dum, ep);
+			limit = max(limit, periodic);
 			fallthrough;
 
 		default:
 treat_control_like_bulk:
 			ep->last_io = jiffies;
-			total -= transfer(dum_hcd, urb, ep, limit, &status);
+			sent = transfer(dum_hcd, urb, ep, limit, &status, done);
+			*total -= sent;
+			/* the rest has to wait for the next frame */
+			if (status == -EINPROGRESS && limit == periodic &&
+					sent >= limit)
+				dum_hcd->stats.periodic_limited++;
 			break;
 		}
 
 		/* incomplete transfer? */
-		if (status == -EINPROGRESS)
+		if (status == -EINPROGRESS) {
+			if (list_empty(&ep->queue))
+				nak = true;
 			continue;
+		}
 
 return_urb:
+		urbq->urbs++;
+		urbq->bytes += urb->actual_length;
 		list_del(&urbp->urbp_list);
-		kfree(urbp);
+		list_del(&urbp->urbq_list);
 		if (ep)
 			ep->already_seen = ep->setup_stage = 0;
 
 		usb_hcd_unlink_urb_from_ep(dummy_hcd_to_hcd(dum_hcd), urb);
+		if (done) {
+			urbp->status = status;
+			list_add_tail(&urbp->urbp_list, &done->urbps);
+			goto restart;
+		}
+		kfree(urbp);
 		spin_unlock(&dum->lock);
+		trace_dummy_hcd_giveback(dummy_hcd_to_hcd(dum_hcd), urb,
+				status);
 		usb_hcd_giveback_urb(dummy_hcd_to_hcd(dum_hcd), urb, status);
 		spin_lock(&dum->lock);
 
 		goto restart;
 	}
 
+	/* NAKing: wait until dummy_queue() or an unlink makes us ready */
+	if ((nak && !urbq->dirty) || list_empty(&urbq->urbp_list))
+		list_del_init(&urbq->ready);
+}
+
+/* Caller must own dum->lock */
+static void dummy_timer_account(struct dummy_hcd *dum_hcd, ktime_t start,
+		s64 used, bool exhausted)
+{
+	struct dummy_hcd_stats	*stats = &dum_hcd->stats;
+	u64			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	stats->timer_runs++;
+	stats->used_bytes += used;
+	if (exhausted)
+		stats->exhausted++;
+	stats->timer_ns += ns;
+	stats->timer_ns_max = max(stats->timer_ns_max, ns);
+	stats->timer_hist[min_t(u32, ilog2(ns | 1),
+			DUMMY_TIMER_BUCKETS - 1)]++;
+}
+
+/*
+ * Drive both sides of the transfers; looks like irq handlers to both
+ * drivers except that the callbacks are invoked from soft interrupt
+ * context.  With done set, the caller is dummy_work(): completions are
+ * batched into it and given back after each endpoint, and IRQs are only
+ * disabled while dum->lock is held.
+ */
+static void dummy_run(struct dummy_hcd *dum_hcd, struct dummy_done *done)
+{
+	struct dummy		*dum = dum_hcd->dum;
+	struct urbq		*urbq;
+	unsigned long		flags;
+	int			total;
+	ktime_t			now = ktime_get();
+	LIST_HEAD(visited);
+	u32			seq;
+	int			i;
+
+	/* look at each urb queued by the host side driver */
+	spin_lock_irqsave(&dum->lock, flags);
+
+	if (!dum_hcd->udev) {
+		/* a queued work item may outlive the last URB */
+		if (!done)
+			dev_err(dummy_dev(dum_hcd),
+					"timer fired with no URBs pending?\n");
+		spin_unlock_irqrestore(&dum->lock, flags);
+		return;
+	}
+	seq = ++dum_hcd->run_seq;
+
+	/* runs kicked before the end of a frame use up what's left of it */
+	if (!ktime_before(now, dum_hcd->frame_end)) {
+		dum_hcd->frame_budget = dummy_frame_bytes(dum_hcd);
+		dum_hcd->frame_end = ktime_add_ns(now,
+				READ_ONCE(mod_data.timer_interval_ns));
+		dum_hcd->stats.frames++;
+		dum_hcd->stats.budget_bytes += dum_hcd->frame_budget;
+	}
+	total = dum_hcd->frame_budget;
+
+	for (i = 0; i < DUMMY_ENDPOINTS; i++) {
+		if (!ep_info[i].name)
+			break;
+		dum->ep[i].already_seen = 0;
+	}
+
+	/* only look at endpoints that have something to do */
+	while (!list_empty(&dum_hcd->ready_list)) {
+		urbq = list_first_entry(&dum_hcd->ready_list, struct urbq,
+				ready);
+		list_move_tail(&urbq->ready, &visited);
+		dummy_timer_urbq(dum_hcd, urbq, seq, &total, done);
+		/*
+		 * Visited queues stay off ready_list, so they aren't run
+		 * twice, while others can be added to it meanwhile.
+		 */
+		if (done) {
+			dummy_unlock_cb(dum, done);
+			dummy_giveback_done(dum_hcd, done);
+			dummy_lock_cb(dum, done);
+		}
+	}
+	list_splice_tail(&visited, &dum_hcd->ready_list);
+	dummy_timer_account(dum_hcd, now, (s64)dum_hcd->frame_budget - total,
+			total <= 0);
+	dum_hcd->frame_budget = total;
+
+	/* dummy_stop() might have cleared udev while the lock was dropped */
 	if (list_empty(&dum_hcd->urbp_list)) {
 		usb_put_dev(dum_hcd->udev);
 		dum_hcd->udev = NULL;
-	} else if (dum_hcd->rh_state == DUMMY_RH_RUNNING) {
-		/* want a 1 msec delay here */
-		hrtimer_start(&dum_hcd->timer, ns_to_ktime(DUMMY_TIMER_INT_NSECS), HRTIMER_MODE_REL);
+	} else if (dum_hcd->udev && dum_hcd->rh_state == DUMMY_RH_RUNNING &&
+			!hrtimer_is_queued(&dum_hcd->timer)) {
+		/* unless kicked meanwhile, wait for the next frame */
+		dummy_kick(dum_hcd, false);
 	}
 
 	spin_unlock_irqrestore(&dum->lock, flags);
+}
+
+/*
+ * With the worker parameter, transfers run in process context and their
+ * completions are given back in batches after dropping dum->lock.  The
+ * gadget and host side callbacks still see bottom halves disabled.
+ */
+static void dummy_work(struct work_struct *work)
+{
+	struct dummy_hcd	*dum_hcd = container_of(work, struct dummy_hcd,
+						work);
+	struct dummy_done	done;
+
+	done.reqs = &dum_hcd->done_reqs;
+	INIT_LIST_HEAD(&done.urbps);
+	dummy_run(dum_hcd, &done);
+}
 
+static enum hrtimer_restart dummy_timer(struct hrtimer *t)
+{
+	struct dummy_hcd	*dum_hcd = from_timer(dum_hcd, t, timer);
+
+	/* the work item runs on this CPU, so pinned timers still apply */
+	if (mod_data.worker)
+		queue_work(system_highpri_wq, &dum_hcd->work);
+	else
+		dummy_run(dum_hcd, NULL);
 	return HRTIMER_NORESTART;
 }
 
@@ -2389,7 +2927,7 @@ static int dummy_bus_resume(struct usb_hcd *hcd)
 		dum_hcd->rh_state = DUMMY_RH_RUNNING;
 		set_link_state(dum_hcd);
 		if (!list_empty(&dum_hcd->urbp_list))
-			hrtimer_start(&dum_hcd->timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+			dummy_kick(dum_hcd, true);
 		hcd->state = HC_STATE_RUNNING;
 	}
 	spin_unlock_irq(&dum_hcd->dum->lock);
@@ -2465,13 +3003,139 @@ static ssize_t urbs_show(struct device *dev, struct device_attribute *attr,
 }
 static DEVICE_ATTR_RO(urbs);
 
-static int dummy_start_ss(struct dummy_hcd *dum_hcd)
+static int show_hcd_stats(char *buf, int size, const char *name,
+		struct dummy_hcd *dum_hcd)
+{
+	struct dummy_hcd_stats	*stats = &dum_hcd->stats;
+	struct urbq		*urbq;
+	unsigned int		slot;
+	int			i;
+
+	size += sysfs_emit_at(buf, size,
+			"%s: timer_runs %llu timer_ns %llu timer_ns_max %llu\n",
+			name, stats->timer_runs, stats->timer_ns,
+			stats->timer_ns_max);
+	size += sysfs_emit_at(buf, size,
+			"  frames %llu budget_bytes %llu used_bytes %llu\n",
+			stats->frames, stats->budget_bytes, stats->used_bytes);
+	size += sysfs_emit_at(buf, size,
+		"  exhausted %llu deferred %llu periodic_limited %llu\n",
+			stats->exhausted, stats->deferred,
+			stats->periodic_limited);
+	size += sysfs_emit_at(buf, size, "  timer_ns:");
+	for (i = 0; i < DUMMY_TIMER_BUCKETS; i++) {
+		if (stats->timer_hist[i])
+			size += sysfs_emit_at(buf, size, " %llu:%llu",
+					1ULL << i, stats->timer_hist[i]);
+	}
+	size += sysfs_emit_at(buf, size, "\n");
+
+	/* slots are numbered as in dummy_addr_slot() */
+	for (slot = 0; slot < DUMMY_ADDR_SLOTS; slot++) {
+		urbq = &dum_hcd->urbq[slot];
+		if (!urbq->urbs && !urbq->deferred)
+			continue;
+		if (slot == 0)
+			size += sysfs_emit_at(buf, size, "  ep0:");
+		else
+			size += sysfs_emit_at(buf, size, "  ep%u%s:",
+					slot % 16, slot >= 16 ? "in" : "out");
+		size += sysfs_emit_at(buf, size,
+				" urbs %llu bytes %llu deferred %llu\n",
+				urbq->urbs, urbq->bytes, urbq->deferred);
+	}
+	return size;
+}
+
+/*
+ * Scheduling statistics of both root hubs, to tell whether throughput is
+ * limited by the emulated bandwidth or by the drivers on either side.
+ * Writing anything resets them.
+ */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct usb_hcd		*hcd = dev_get_drvdata(dev);
+	struct dummy		*dum = hcd_to_dummy_hcd(hcd)->dum;
+	int			size = 0;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&dum->lock, flags);
+	if (dum->hs_hcd)
+		size = show_hcd_stats(buf, size, "hs", dum->hs_hcd);
+	if (dum->ss_hcd)
+		size = show_hcd_stats(buf, size, "ss", dum->ss_hcd);
+	spin_unlock_irqrestore(&dum->lock, flags);
+
+	return size;
+}
+
+static void dummy_reset_stats(struct dummy_hcd *dum_hcd)
+{
+	unsigned int	slot;
+
+	memset(&dum_hcd->stats, 0, sizeof(dum_hcd->stats));
+	for (slot = 0; slot < DUMMY_ADDR_SLOTS; slot++) {
+		dum_hcd->urbq[slot].urbs = 0;
+		dum_hcd->urbq[slot].bytes = 0;
+		dum_hcd->urbq[slot].deferred = 0;
+	}
+}
+
+static ssize_t stats_store(struct device *dev, struct device_attribute *attr,
+		const char *buf, size_t count)
+{
+	struct usb_hcd		*hcd = dev_get_drvdata(dev);
+	struct dummy		*dum = hcd_to_dummy_hcd(hcd)->dum;
+	unsigned long		flags;
+
+	spin_lock_irqsave(&dum->lock, flags);
+	if (dum->hs_hcd)
+		dummy_reset_stats(dum->hs_hcd);
+	if (dum->ss_hcd)
+		dummy_reset_stats(dum->ss_hcd);
+	spin_unlock_irqrestore(&dum->lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(stats);
+
+static void dummy_init_urbqs(struct dummy_hcd *dum_hcd)
+{
+	int	i;
+
+	INIT_LIST_HEAD(&dum_hcd->urbp_list);
+	INIT_LIST_HEAD(&dum_hcd->ready_list);
+	INIT_LIST_HEAD(&dum_hcd->done_reqs);
+	for (i = 0; i < DUMMY_ADDR_SLOTS; i++) {
+		INIT_LIST_HEAD(&dum_hcd->urbq[i].urbp_list);
+		INIT_LIST_HEAD(&dum_hcd->urbq[i].ready);
+	}
+	dummy_reset_stats(dum_hcd);
+}
+
+static void dummy_init_timer(struct dummy_hcd *dum_hcd)
 {
+	struct platform_device	*pdev = to_platform_device(dummy_dev(dum_hcd));
+
 	hrtimer_init(&dum_hcd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	dum_hcd->timer.function = dummy_timer;
+	INIT_WORK(&dum_hcd->work, dummy_work);
+
+	/* both roothubs of one controller share its lock, and its CPU */
+	dum_hcd->cpu = -1;
+	if (mod_data.pin_timers) {
+		dum_hcd->cpu = cpumask_local_spread(pdev->id, NUMA_NO_NODE);
+		INIT_CSD(&dum_hcd->kick_csd, dummy_kick_on_cpu, dum_hcd);
+	}
+}
+
+static int dummy_start_ss(struct dummy_hcd *dum_hcd)
+{
+	dummy_init_timer(dum_hcd);
 	dum_hcd->rh_state = DUMMY_RH_RUNNING;
 	dum_hcd->stream_en_ep = 0;
-	INIT_LIST_HEAD(&dum_hcd->urbp_list);
+	dummy_init_urbqs(dum_hcd);
 	dummy_hcd_to_hcd(dum_hcd)->power_budget = POWER_BUDGET_3;
 	dummy_hcd_to_hcd(dum_hcd)->state = HC_STATE_RUNNING;
 	dummy_hcd_to_hcd(dum_hcd)->uses_new_polling = 1;
@@ -2487,6 +3151,7 @@ static int dummy_start_ss(struct dummy_hcd *dum_hcd)
 static int dummy_start(struct usb_hcd *hcd)
 {
 	struct dummy_hcd	*dum_hcd = hcd_to_dummy_hcd(hcd);
+	int			retval;
 
 	/*
 	 * HOST side init ... we emulate a root hub that'll only ever
@@ -2497,11 +3162,10 @@ static int dummy_start(struct usb_hcd *hcd)
 		return dummy_start_ss(dum_hcd);
 
 	spin_lock_init(&dum_hcd->dum->lock);
-	hrtimer_init(&dum_hcd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	dum_hcd->timer.function = dummy_timer;
+	dummy_init_timer(dum_hcd);
 	dum_hcd->rh_state = DUMMY_RH_RUNNING;
 
-	INIT_LIST_HEAD(&dum_hcd->urbp_list);
+	dummy_init_urbqs(dum_hcd);
 
 	hcd->power_budget = POWER_BUDGET;
 	hcd->state = HC_STATE_RUNNING;
@@ -2511,16 +3175,41 @@ static int dummy_start(struct usb_hcd *hcd)
 	hcd->self.otg_port = 1;
 #endif
 
+	/* sharing the controller, both root hubs show up in 'stats' */
+	retval = device_create_file(dummy_dev(dum_hcd), &dev_attr_stats);
+	if (retval)
+		return retval;
+
 	/* FIXME 'urbs' should be a per-device thing, maybe in usbcore */
-	return device_create_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	retval = device_create_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	if (retval)
+		device_remove_file(dummy_dev(dum_hcd), &dev_attr_stats);
+	return retval;
 }
 
 static void dummy_stop(struct usb_hcd *hcd)
 {
 	struct dummy_hcd	*dum_hcd = hcd_to_dummy_hcd(hcd);
 
+	/*
+	 * No URBs are left.  Without udev, neither dummy_queue(), a pending
+	 * kick, nor a run of the work item re-arms the timer, so once it is
+	 * cancelled, nothing queues the work item again either.
+	 */
+	spin_lock_irq(&dum_hcd->dum->lock);
+	usb_put_dev(dum_hcd->udev);
+	dum_hcd->udev = NULL;
+	/* kick_csd lives in dum_hcd, let the kicks on their way land */
+	while (dum_hcd->kick_pending) {
+		spin_unlock_irq(&dum_hcd->dum->lock);
+		cpu_relax();
+		spin_lock_irq(&dum_hcd->dum->lock);
+	}
+	spin_unlock_irq(&dum_hcd->dum->lock);
 	hrtimer_cancel(&dum_hcd->timer);
+	cancel_work_sync(&dum_hcd->work);
 	device_remove_file(dummy_dev(dum_hcd), &dev_attr_urbs);
+	device_remove_file(dummy_dev(dum_hcd), &dev_attr_stats);
 	dev_info(dummy_dev(dum_hcd), "stopped\n");
 }
 
@@ -2766,15 +3455,21 @@ static struct platform_driver dummy_hcd_driver = {
 };
 
 /*-------------------------------------------------------------------------*/
-#define MAX_NUM_UDC	32
-static struct platform_device *the_udc_pdev[MAX_NUM_UDC];
-static struct platform_device *the_hcd_pdev[MAX_NUM_UDC];
+static struct platform_device **the_udc_pdev;
+static struct platform_device **the_hcd_pdev;
+
+static void dummy_free_pdev_arrays(void)
+{
+	kfree(the_udc_pdev);
+	kfree(the_hcd_pdev);
+	the_udc_pdev = the_hcd_pdev = NULL;
+}
 
 static int __init dummy_hcd_init(void)
 {
 	int	retval = -ENOMEM;
 	int	i;
-	struct	dummy *dum[MAX_NUM_UDC] = {};
+	struct	dummy **dum;
 
 	if (usb_disabled())
 		return -ENODEV;
@@ -2782,19 +3477,25 @@ static int __init dummy_hcd_init(void)
 	if (!mod_data.is_high_speed && mod_data.is_super_speed)
 		return -EINVAL;
 
-	if (mod_data.num < 1 || mod_data.num > MAX_NUM_UDC) {
-		pr_err("Number of emulated UDC must be in range of 1...%d\n",
-				MAX_NUM_UDC);
+	if (mod_data.num < 1) {
+		pr_err("Number of emulated UDC must be at least 1\n");
 		return -EINVAL;
 	}
 
+	/* each controller takes one or two of the bus numbers usbcore has */
+	the_hcd_pdev = kcalloc(mod_data.num, sizeof(*the_hcd_pdev), GFP_KERNEL);
+	the_udc_pdev = kcalloc(mod_data.num, sizeof(*the_udc_pdev), GFP_KERNEL);
+	dum = kcalloc(mod_data.num, sizeof(*dum), GFP_KERNEL);
+	if (!the_hcd_pdev || !the_udc_pdev || !dum)
+		goto err_alloc_arrays;
+
 	for (i = 0; i < mod_data.num; i++) {
 		the_hcd_pdev[i] = platform_device_alloc(driver_name, i);
 		if (!the_hcd_pdev[i]) {
 			i--;
 			while (i >= 0)
 				platform_device_put(the_hcd_pdev[i--]);
-			return retval;
+			goto err_alloc_arrays;
 		}
 	}
 	for (i = 0; i < mod_data.num; i++) {
@@ -2807,7 +3508,8 @@ static int __init dummy_hcd_init(void)
 		}
 	}
 	for (i = 0; i < mod_data.num; i++) {
-		dum[i] = kzalloc(sizeof(struct dummy), GFP_KERNEL);
+		dum[i] = kzalloc(struct_size(dum[i], fifo_buf,
+				mod_data.fifo_size), GFP_KERNEL);
 		if (!dum[i]) {
 			retval = -ENOMEM;
 			goto err_add_pdata;
@@ -2870,6 +3572,7 @@ static int __init dummy_hcd_init(void)
 			goto err_probe_udc;
 		}
 	}
+	kfree(dum);
 	return retval;
 
 err_probe_udc:
@@ -2890,6 +3593,9 @@ err_add_pdata:
 err_alloc_udc:
 	for (i = 0; i < mod_data.num; i++)
 		platform_device_put(the_hcd_pdev[i]);
+err_alloc_arrays:
+	kfree(dum);
+	dummy_free_pdev_arrays();
 	return retval;
 }
 module_init(dummy_hcd_init);
@@ -2909,5 +3615,6 @@ static void __exit dummy_hcd_cleanup(void)
 	}
 	platform_driver_unregister(&dummy_udc_driver);
 	platform_driver_unregister(&dummy_hcd_driver);
+	dummy_free_pdev_arrays();
 }
 module_exit(dummy_hcd_cleanup);
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * Tracepoints for the Dummy HCD/UDC driver.
+ *
+ * Host controllers are identified by their bus numbers. The usb_request
+ * pointers match the ones reported by the gadget side (e.g. Raw Gadget)
+ * tracepoints, so a transfer can be followed from the gadget request to
+ * the URB it completes.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dummy_hcd
+
+#if !defined(__DUMMY_HCD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __DUMMY_HCD_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+#include <linux/usb/gadget.h>
+#include <linux/usb/hcd.h>
+
+DECLARE_EVENT_CLASS(dummy_hcd_urb,
+	TP_PROTO(struct usb_hcd *hcd, struct urb *urb),
+	TP_ARGS(hcd, urb),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(const void *, urb)
+		__field(u8, address)
+		__field(unsigned int, type)
+		__field(u32, length)
+		__field(u32, actual)
+		__field(unsigned int, stream_id)
+	),
+	TP_fast_assign(
+		__entry->busnum = hcd->self.busnum;
+		__entry->urb = urb;
+		__entry->address = usb_pipeendpoint(urb->pipe) |
+			(usb_pipein(urb->pipe) ? USB_DIR_IN : 0);
+		__entry->type = usb_pipetype(urb->pipe);
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual = urb->actual_length;
+		__entry->stream_id = urb->stream_id;
+	),
+	TP_printk("bus %d ep %02x type %u: urb %p length %u/%u stream %u",
+		__entry->busnum, __entry->address, __entry->type,
+		__entry->urb, __entry->actual, __entry->length,
+		__entry->stream_id)
+);
+
+DEFINE_EVENT(dummy_hcd_urb, dummy_hcd_urb_enqueue,
+	TP_PROTO(struct usb_hcd *hcd, struct urb *urb),
+	TP_ARGS(hcd, urb)
+);
+
+DEFINE_EVENT(dummy_hcd_urb, dummy_hcd_urb_dequeue,
+	TP_PROTO(struct usb_hcd *hcd, struct urb *urb),
+	TP_ARGS(hcd, urb)
+);
+
+/* One chunk copied between an URB and a gadget request. */
+TRACE_EVENT(dummy_hcd_transfer,
+	TP_PROTO(struct usb_hcd *hcd, struct urb *urb,
+		struct usb_request *req, int len),
+	TP_ARGS(hcd, urb, req, len),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(const void *, urb)
+		__field(const void *, req)
+		__field(int, len)
+		__field(u32, urb_actual)
+		__field(unsigned int, req_actual)
+	),
+	TP_fast_assign(
+		__entry->busnum = hcd->self.busnum;
+		__entry->urb = urb;
+		__entry->req = req;
+		__entry->len = len;
+		__entry->urb_actual = urb->actual_length;
+		__entry->req_actual = req->actual;
+	),
+	TP_printk("bus %d: urb %p req %p len %d urb actual %u req actual %u",
+		__entry->busnum, __entry->urb, __entry->req, __entry->len,
+		__entry->urb_actual, __entry->req_actual)
+);
+
+TRACE_EVENT(dummy_hcd_giveback,
+	TP_PROTO(struct usb_hcd *hcd, struct urb *urb, int status),
+	TP_ARGS(hcd, urb, status),
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(const void *, urb)
+		__field(u32, actual)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->busnum = hcd->self.busnum;
+		__entry->urb = urb;
+		__entry->actual = urb->actual_length;
+		__entry->status = status;
+	),
+	TP_printk("bus %d: urb %p actual %u status %d",
+		__entry->busnum, __entry->urb, __entry->actual,
+		__entry->status)
+);
+
+#endif /* __DUMMY_HCD_TRACE_H */
+
+/* The module is built out of tree, so the header is looked up locally. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dummy_hcd_trace
+
+#include <trace/define_trace.h>
@@ -1,137 +1,25 @@
 // SPDX-License-Identifier: Apache-2.0
 //
-// This example emulates a USB printer. The code handles enumeration and
-// allows a Linux host to recognize a printer device (enabling it to read
-// from and write to /dev/usb/lp0 if the usblp kernel module is loaded)
+// Wrappers for the Raw Gadget ioctls shared by the examples. Unlike the
+// libraw_gadget functions they call, these print an error and exit on
+// failure, which keeps the examples short.
 //
 // Part of the USB Raw Gadget examples.
 // See https://github.com/xairy/raw-gadget for details.
-//
-// Wei Ming Chen <wmchen.aristo@gmail.com>
 
-#include <assert.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <stdbool.h>
-#include <stddef.h>
+#ifndef RAW_GADGET_EXAMPLES_COMMON_H
+#define RAW_GADGET_EXAMPLES_COMMON_H
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <string.h>
-#include <unistd.h>
-#include <errno.h>
-
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-
-#include <linux/types.h>
-#include <linux/hid.h>
-#include <linux/usb/ch9.h>
-
-/*----------------------------------------------------------------------*/
-
-struct hid_class_descriptor {
-	__u8  bDescriptorType;
-	__le16 wDescriptorLength;
-} __attribute__ ((packed));
-
-struct hid_descriptor {
-	__u8  bLength;
-	__u8  bDescriptorType;
-	__le16 bcdHID;
-	__u8  bCountryCode;
-	__u8  bNumDescriptors;
-
-	struct hid_class_descriptor desc[1];
-} __attribute__ ((packed));
-
-/*----------------------------------------------------------------------*/
-
-
-#define UDC_NAME_LENGTH_MAX 128
-
-struct usb_raw_init {
-	__u8 driver_name[UDC_NAME_LENGTH_MAX];
-	__u8 device_name[UDC_NAME_LENGTH_MAX];
-	__u8 speed;
-};
-
-enum usb_raw_event_type {
-	USB_RAW_EVENT_INVALID = 0,
-	USB_RAW_EVENT_CONNECT = 1,
-	USB_RAW_EVENT_CONTROL = 2,
-	USB_RAW_EVENT_SUSPEND = 3,
-	USB_RAW_EVENT_RESUME = 4,
-	USB_RAW_EVENT_RESET = 5,
-	USB_RAW_EVENT_DISCONNECT = 6,
-};
-
-struct usb_raw_event {
-	__u32		type;
-	__u32		length;
-	__u8		data[];
-};
-
-struct usb_raw_ep_io {
-	__u16		ep;
-	__u16		flags;
-	__u32		length;
-	__u8		data[];
-};
-
-#define USB_RAW_EPS_NUM_MAX	30
-#define USB_RAW_EP_NAME_MAX	16
-#define USB_RAW_EP_ADDR_ANY	0xff
-
-struct usb_raw_ep_caps {
-	__u32	type_control	: 1;
-	__u32	type_iso	: 1;
-	__u32	type_bulk	: 1;
-	__u32	type_int	: 1;
-	__u32	dir_in		: 1;
-	__u32	dir_out		: 1;
-};
-
-struct usb_raw_ep_limits {
-	__u16	maxpacket_limit;
-	__u16	max_streams;
-	__u32	reserved;
-};
 
-struct usb_raw_ep_info {
-	__u8				name[USB_RAW_EP_NAME_MAX];
-	__u32				addr;
-	struct usb_raw_ep_caps		caps;
-	struct usb_raw_ep_limits	limits;
-};
-
-struct usb_raw_eps_info {
-	struct usb_raw_ep_info	eps[USB_RAW_EPS_NUM_MAX];
-};
-
-#define USB_RAW_IOCTL_INIT		_IOW('U', 0, struct usb_raw_init)
-#define USB_RAW_IOCTL_RUN		_IO('U', 1)
-#define USB_RAW_IOCTL_EVENT_FETCH	_IOR('U', 2, struct usb_raw_event)
-#define USB_RAW_IOCTL_EP0_WRITE		_IOW('U', 3, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP0_READ		_IOWR('U', 4, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP_ENABLE		_IOW('U', 5, struct usb_endpoint_descriptor)
-#define USB_RAW_IOCTL_EP_DISABLE	_IOW('U', 6, __u32)
-#define USB_RAW_IOCTL_EP_WRITE		_IOW('U', 7, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP_READ		_IOWR('U', 8, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_CONFIGURE		_IO('U', 9)
-#define USB_RAW_IOCTL_VBUS_DRAW		_IOW('U', 10, __u32)
-#define USB_RAW_IOCTL_EPS_INFO		_IOR('U', 11, struct usb_raw_eps_info)
-#define USB_RAW_IOCTL_EP0_STALL		_IO('U', 12)
-#define USB_RAW_IOCTL_EP_SET_HALT	_IOW('U', 13, __u32)
-#define USB_RAW_IOCTL_EP_CLEAR_HALT	_IOW('U', 14, __u32)
-#define USB_RAW_IOCTL_EP_SET_WEDGE	_IOW('U', 15, __u32)
+#include "../lib/libraw_gadget.h"
 
 /*----------------------------------------------------------------------*/
 
 int usb_raw_open() {
-	int fd = open("/dev/raw-gadget", O_RDWR);
+	int fd = raw_gadget_open();
 	if (fd < 0) {
 		perror("open()");
 		exit(EXIT_FAILURE);
@@ -141,11 +29,7 @@ int usb_raw_open() {
 
 void usb_raw_init(int fd, enum usb_device_speed speed,
 			const char *driver, const char *device) {
-	struct usb_raw_init arg;
-	strcpy((char *)&arg.driver_name[0], driver);
-	strcpy((char *)&arg.device_name[0], device);
-	arg.speed = speed;
-	int rv = ioctl(fd, USB_RAW_IOCTL_INIT, &arg);
+	int rv = raw_gadget_init(fd, speed, driver, device);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_INIT)");
 		exit(EXIT_FAILURE);
@@ -153,7 +37,7 @@ void usb_raw_init(int fd, enum usb_device_speed speed,
 }
 
 void usb_raw_run(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_RUN, 0);
+	int rv = raw_gadget_run(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_RUN)");
 		exit(EXIT_FAILURE);
@@ -161,7 +45,7 @@ void usb_raw_run(int fd) {
 }
 
 void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, event);
+	int rv = raw_gadget_event_fetch(fd, event);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
 		exit(EXIT_FAILURE);
@@ -169,7 +53,7 @@ void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
 }
 
 int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_READ, io);
+	int rv = raw_gadget_ep0_read(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_READ)");
 		exit(EXIT_FAILURE);
@@ -178,7 +62,7 @@ int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep0_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, io);
+	int rv = raw_gadget_ep0_write(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
 		exit(EXIT_FAILURE);
@@ -187,7 +71,7 @@ int usb_raw_ep0_write(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_enable(int fd, struct usb_endpoint_descriptor *desc) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+	int rv = raw_gadget_ep_enable(fd, desc);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
 		exit(EXIT_FAILURE);
@@ -196,7 +80,7 @@ int usb_raw_ep_enable(int fd, struct usb_endpoint_descriptor *desc) {
 }
 
 int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
+	int rv = raw_gadget_ep_read(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_READ)");
 		exit(EXIT_FAILURE);
@@ -205,7 +89,7 @@ int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_disable(int fd, int ep) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_DISABLE, ep);
+	int rv = raw_gadget_ep_disable(fd, ep);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_DISABLE)");
 		exit(EXIT_FAILURE);
@@ -213,12 +97,21 @@ int usb_raw_ep_disable(int fd, int ep) {
 	return rv;
 }
 
+int usb_raw_ep_open(int fd, int ep) {
+	int rv = raw_gadget_ep_open(fd, ep);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_OPEN)");
+		exit(EXIT_FAILURE);
+	}
+	return rv;
+}
+
 int usb_raw_ep_write_may_fail(int fd, struct usb_raw_ep_io *io) {
-	return ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	return raw_gadget_ep_write(fd, io);
 }
 
 int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	int rv = raw_gadget_ep_write(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_WRITE)");
 		exit(EXIT_FAILURE);
@@ -227,7 +120,7 @@ int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
 }
 
 void usb_raw_configure(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+	int rv = raw_gadget_configure(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_CONFIGURED)");
 		exit(EXIT_FAILURE);
@@ -235,7 +128,7 @@ void usb_raw_configure(int fd) {
 }
 
 void usb_raw_vbus_draw(int fd, uint32_t power) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, power);
+	int rv = raw_gadget_vbus_draw(fd, power);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_VBUS_DRAW)");
 		exit(EXIT_FAILURE);
@@ -243,7 +136,7 @@ void usb_raw_vbus_draw(int fd, uint32_t power) {
 }
 
 int usb_raw_eps_info(int fd, struct usb_raw_eps_info *info) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EPS_INFO, info);
+	int rv = raw_gadget_eps_info(fd, info);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EPS_INFO)");
 		exit(EXIT_FAILURE);
@@ -252,7 +145,7 @@ int usb_raw_eps_info(int fd, struct usb_raw_eps_info *info) {
 }
 
 void usb_raw_ep0_stall(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+	int rv = raw_gadget_ep0_stall(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_STALL)");
 		exit(EXIT_FAILURE);
@@ -260,209 +153,11 @@ void usb_raw_ep0_stall(int fd) {
 }
 
 void usb_raw_ep_set_halt(int fd, int ep) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_SET_HALT, ep);
+	int rv = raw_gadget_ep_set_halt(fd, ep);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_SET_HALT)");
 		exit(EXIT_FAILURE);
 	}
 }
 
-/*----------------------------------------------------------------------*/
-
-#define GET_DEVICE_ID		0
-#define GET_PORT_STATUS		1
-#define SOFT_RESET		2
-
-void log_control_request(struct usb_ctrlrequest *ctrl) {
-	printf("  bRequestType: 0x%x (%s), bRequest: 0x%x, wValue: 0x%x,"
-		" wIndex: 0x%x, wLength: %d\n", ctrl->bRequestType,
-		(ctrl->bRequestType & USB_DIR_IN) ? "IN" : "OUT",
-		ctrl->bRequest, ctrl->wValue, ctrl->wIndex, ctrl->wLength);
-
-	switch (ctrl->bRequestType & USB_TYPE_MASK) {
-	case USB_TYPE_STANDARD:
-		printf("  type = USB_TYPE_STANDARD\n");
-		break;
-	case USB_TYPE_CLASS:
-		printf("  type = USB_TYPE_CLASS\n");
-		break;
-	case USB_TYPE_VENDOR:
-		printf("  type = USB_TYPE_VENDOR\n");
-		break;
-	default:
-		printf("  type = unknown = %d\n", (int)ctrl->bRequestType);
-		break;
-	}
-
-	switch (ctrl->bRequestType & USB_TYPE_MASK) {
-	case USB_TYPE_STANDARD:
-		switch (ctrl->bRequest) {
-		case USB_REQ_GET_DESCRIPTOR:
-			printf("  req = USB_REQ_GET_DESCRIPTOR\n");
-			switch (ctrl->wValue >> 8) {
-			case USB_DT_DEVICE:
-				printf("  desc = USB_DT_DEVICE\n");
-				break;
-			case USB_DT_CONFIG:
-				printf("  desc = USB_DT_CONFIG\n");
-				break;
-			case USB_DT_STRING:
-				printf("  desc = USB_DT_STRING\n");
-				break;
-			case USB_DT_INTERFACE:
-				printf("  desc = USB_DT_INTERFACE\n");
-				break;
-			case USB_DT_ENDPOINT:
-				printf("  desc = USB_DT_ENDPOINT\n");
-				break;
-			case USB_DT_DEVICE_QUALIFIER:
-				printf("  desc = USB_DT_DEVICE_QUALIFIER\n");
-				break;
-			case USB_DT_OTHER_SPEED_CONFIG:
-				printf("  desc = USB_DT_OTHER_SPEED_CONFIG\n");
-				break;
-			case USB_DT_INTERFACE_POWER:
-				printf("  desc = USB_DT_INTERFACE_POWER\n");
-				break;
-			case USB_DT_OTG:
-				printf("  desc = USB_DT_OTG\n");
-				break;
-			case USB_DT_DEBUG:
-				printf("  desc = USB_DT_DEBUG\n");
-				break;
-			case USB_DT_INTERFACE_ASSOCIATION:
-				printf("  desc = USB_DT_INTERFACE_ASSOCIATION\n");
-				break;
-			case USB_DT_SECURITY:
-				printf("  desc = USB_DT_SECURITY\n");
-				break;
-			case USB_DT_KEY:
-				printf("  desc = USB_DT_KEY\n");
-				break;
-			case USB_DT_ENCRYPTION_TYPE:
-				printf("  desc = USB_DT_ENCRYPTION_TYPE\n");
-				break;
-			case USB_DT_BOS:
-				printf("  desc = USB_DT_BOS\n");
-				break;
-			case USB_DT_DEVICE_CAPABILITY:
-				printf("  desc = USB_DT_DEVICE_CAPABILITY\n");
-				break;
-			case USB_DT_WIRELESS_ENDPOINT_COMP:
-				printf("  desc = USB_DT_WIRELESS_ENDPOINT_COMP\n");
-				break;
-			case USB_DT_PIPE_USAGE:
-				printf("  desc = USB_DT_PIPE_USAGE\n");
-				break;
-			case USB_DT_SS_ENDPOINT_COMP:
-				printf("  desc = USB_DT_SS_ENDPOINT_COMP\n");
-				break;
-            case HID_DT_HID:
-				printf("  descriptor = HID_DT_HID\n");
-				return;
-			case HID_DT_REPORT:
-				printf("  descriptor = HID_DT_REPORT\n");
-				return;
-			case HID_DT_PHYSICAL:
-				printf("  descriptor = HID_DT_PHYSICAL\n");
-				return;
-			default:
-				printf("  desc = unknown = 0x%x\n",
-							ctrl->wValue >> 8);
-				break;
-			}
-			break;
-		case USB_REQ_SET_CONFIGURATION:
-			printf("  req = USB_REQ_SET_CONFIGURATION\n");
-			break;
-		case USB_REQ_GET_CONFIGURATION:
-			printf("  req = USB_REQ_GET_CONFIGURATION\n");
-			break;
-		case USB_REQ_SET_INTERFACE:
-			printf("  req = USB_REQ_SET_INTERFACE\n");
-			break;
-		case USB_REQ_GET_INTERFACE:
-			printf("  req = USB_REQ_GET_INTERFACE\n");
-			break;
-		case USB_REQ_GET_STATUS:
-			printf("  req = USB_REQ_GET_STATUS\n");
-			break;
-		case USB_REQ_CLEAR_FEATURE:
-			printf("  req = USB_REQ_CLEAR_FEATURE\n");
-			break;
-		case USB_REQ_SET_FEATURE:
-			printf("  req = USB_REQ_SET_FEATURE\n");
-			break;
-		default:
-			printf("  req = unknown = 0x%x\n", ctrl->bRequest);
-			break;
-		}
-		break;
-	case USB_TYPE_CLASS:
-		switch (ctrl->bRequest) {
-		case GET_DEVICE_ID:
-			printf("  req = GET_DEVICE_ID\n");
-			break;
-		case GET_PORT_STATUS:
-			printf("  req = GET_PORT_STATUS\n");
-			break;
-		case SOFT_RESET:
-			printf("  req = SOFT_RESET\n");
-			break;
-        case HID_REQ_GET_REPORT:
-			printf("  req = HID_REQ_GET_REPORT\n");
-			break;
-		case HID_REQ_GET_IDLE:
-			printf("  req = HID_REQ_GET_IDLE\n");
-			break;
-		case HID_REQ_GET_PROTOCOL:
-			printf("  req = HID_REQ_GET_PROTOCOL\n");
-			break;
-		case HID_REQ_SET_REPORT:
-			printf("  req = HID_REQ_SET_REPORT\n");
-			break;
-		case HID_REQ_SET_IDLE:
-			printf("  req = HID_REQ_SET_IDLE\n");
-			break;
-		case HID_REQ_SET_PROTOCOL:
-			printf("  req = HID_REQ_SET_PROTOCOL\n");
-			break;
-		default:
-		default:
-			printf("  req = unknown = 0x%x\n", ctrl->bRequest);
-			break;
-		}
-		break;
-	default:
-		printf("  req = unknown = 0x%x\n", ctrl->bRequest);
-		break;
-	}
-}
-
-void log_event(struct usb_raw_event *event) {
-	switch (event->type) {
-	case USB_RAW_EVENT_CONNECT:
-		printf("event: connect, length: %u\n", event->length);
-		break;
-	case USB_RAW_EVENT_CONTROL:
-		printf("event: control, length: %u\n", event->length);
-		log_control_request((struct usb_ctrlrequest *)&event->data[0]);
-		break;
-	case USB_RAW_EVENT_SUSPEND:
-		printf("event: suspend");
-		break;
-	case USB_RAW_EVENT_RESUME:
-		printf("event: resume");
-		break;
-	case USB_RAW_EVENT_RESET:
-		printf("event: reset");
-		break;
-	case USB_RAW_EVENT_DISCONNECT:
-		printf("event: disconnect");
-		break;
-	default:
-		printf("event: %d (unknown), length: %u\n", event->type, event->length);
-	}
-}
-
-/*----------------------------------------------------------------------*/
\ No newline at end of file
+#endif // RAW_GADGET_EXAMPLES_COMMON_H
@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: Apache-2.0
+//
+// libraw_gadget: userspace library for USB Raw Gadget.
+//
+// Part of the USB Raw Gadget library.
+// See https://github.com/xairy/raw-gadget for details.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libraw_gadget.h"
+
+// Number of events fetched with a single USB_RAW_IOCTL_EVENTS_FETCH.
+#define EVENTS_BATCH	16
+
+static int raw_ioctl(int fd, unsigned long request, unsigned long arg) {
+	int rv = ioctl(fd, request, arg);
+	return rv < 0 ? -errno : rv;
+}
+
+static int raw_ioctl_ptr(int fd, unsigned long request, void *arg) {
+	return raw_ioctl(fd, request, (unsigned long)arg);
+}
+
+/*----------------------------------------------------------------------*/
+
+int raw_gadget_open(void) {
+	int fd = open("/dev/raw-gadget", O_RDWR | O_CLOEXEC);
+	return fd < 0 ? -errno : fd;
+}
+
+static int copy_udc_names(__u8 *driver_name, __u8 *device_name,
+			const char *driver, const char *device) {
+	if (strlen(driver) >= UDC_NAME_LENGTH_MAX ||
+			strlen(device) >= UDC_NAME_LENGTH_MAX)
+		return -EINVAL;
+	strcpy((char *)driver_name, driver);
+	strcpy((char *)device_name, device);
+	return 0;
+}
+
+int raw_gadget_init(int fd, enum usb_device_speed speed,
+			const char *driver, const char *device) {
+	struct usb_raw_init arg;
+	int rv;
+
+	memset(&arg, 0, sizeof(arg));
+	rv = copy_udc_names(arg.driver_name, arg.device_name, driver, device);
+	if (rv < 0)
+		return rv;
+	arg.speed = speed;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_INIT, &arg);
+}
+
+int raw_gadget_init_ext(int fd, enum usb_device_speed speed,
+			const char *driver, const char *device,
+			uint32_t event_queue_size) {
+	struct usb_raw_init_ext arg;
+	int rv;
+
+	memset(&arg, 0, sizeof(arg));
+	rv = copy_udc_names(arg.driver_name, arg.device_name, driver, device);
+	if (rv < 0)
+		return rv;
+	arg.speed = speed;
+	arg.event_queue_size = event_queue_size;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_INIT_EXT, &arg);
+}
+
+int raw_gadget_run(int fd) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_RUN, 0);
+}
+
+int raw_gadget_event_fetch(int fd, struct usb_raw_event *event) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EVENT_FETCH, event);
+}
+
+int raw_gadget_events_fetch(int fd, struct usb_raw_events *events) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EVENTS_FETCH, events);
+}
+
+int raw_gadget_ep0_read(int fd, struct usb_raw_ep_io *io) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP0_READ, io);
+}
+
+int raw_gadget_ep0_write(int fd, struct usb_raw_ep_io *io) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP0_WRITE, io);
+}
+
+int raw_gadget_ep0_stall(int fd) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+}
+
+int raw_gadget_ep_enable(int fd, struct usb_endpoint_descriptor *desc) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+}
+
+int raw_gadget_ep_enable_ext(int fd, struct usb_raw_ep_enable_ext *arg) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_ENABLE_EXT, arg);
+}
+
+int raw_gadget_ep_disable(int fd, int ep) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP_DISABLE, ep);
+}
+
+int raw_gadget_ep_read(int fd, struct usb_raw_ep_io *io) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_READ, io);
+}
+
+int raw_gadget_ep_write(int fd, struct usb_raw_ep_io *io) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_WRITE, io);
+}
+
+int raw_gadget_ep_submit(int fd, struct usb_raw_ep_submit *submit) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_SUBMIT, submit);
+}
+
+int raw_gadget_ep_reap(int fd, struct usb_raw_ep_reap *reap) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_REAP, reap);
+}
+
+int raw_gadget_ep_alloc_bufs(int fd, struct usb_raw_ep_bufs *bufs) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_ALLOC_BUFS, bufs);
+}
+
+int raw_gadget_ep_set_halt(int fd, int ep) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP_SET_HALT, ep);
+}
+
+int raw_gadget_ep_clear_halt(int fd, int ep) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP_CLEAR_HALT, ep);
+}
+
+int raw_gadget_ep_set_wedge(int fd, int ep) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP_SET_WEDGE, ep);
+}
+
+int raw_gadget_configure(int fd) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+}
+
+int raw_gadget_vbus_draw(int fd, uint32_t power) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, power);
+}
+
+int raw_gadget_eps_info(int fd, struct usb_raw_eps_info *info) {
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EPS_INFO, info);
+}
+
+int raw_gadget_desc_set(int fd, uint8_t type, uint8_t index,
+			uint16_t lang_id, const void *data, uint32_t length) {
+	struct usb_raw_desc *arg;
+	int rv;
+
+	if (length > USB_RAW_DESC_LENGTH_MAX)
+		return -EINVAL;
+	arg = malloc(sizeof(*arg) + length);
+	if (!arg)
+		return -ENOMEM;
+	arg->type = type;
+	arg->index = index;
+	arg->lang_id = lang_id;
+	arg->length = length;
+	memcpy(&arg->data[0], data, length);
+	rv = raw_ioctl_ptr(fd, USB_RAW_IOCTL_DESC_SET, arg);
+	free(arg);
+	return rv;
+}
+
+int raw_gadget_rebind(int fd) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_REBIND, 0);
+}
+
+int raw_gadget_ep_open(int fd, int ep) {
+	return raw_ioctl(fd, USB_RAW_IOCTL_EP_OPEN, ep);
+}
+
+int raw_gadget_ep_set_coalesce(int fd, int ep, uint32_t count,
+			uint32_t usecs) {
+	struct usb_raw_ep_coalesce arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ep = ep;
+	arg.count = count;
+	arg.usecs = usecs;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_SET_COALESCE, &arg);
+}
+
+int raw_gadget_ep_set_timeout(int fd, int ep, uint32_t msecs) {
+	struct usb_raw_ep_timeout arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ep = ep;
+	arg.msecs = msecs;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_SET_TIMEOUT, &arg);
+}
+
+int raw_gadget_ep0_set_timeout(int fd, uint32_t msecs) {
+	struct usb_raw_ep_timeout arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.flags = USB_RAW_EP_TIMEOUT_FLAGS_EP0;
+	arg.msecs = msecs;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_SET_TIMEOUT, &arg);
+}
+
+int raw_gadget_ep_cancel(int fd, int ep, uint16_t flags, uint64_t cookie) {
+	struct usb_raw_ep_cancel arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ep = ep;
+	arg.flags = flags;
+	arg.cookie = cookie;
+	return raw_ioctl_ptr(fd, USB_RAW_IOCTL_EP_CANCEL, &arg);
+}
+
+/*----------------------------------------------------------------------*/
+
+void *raw_gadget_buf_alloc(size_t size) {
+	void *buf;
+
+	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), size))
+		return NULL;
+	return buf;
+}
+
+void raw_gadget_buf_free(void *buf) {
+	free(buf);
+}
+
+/*----------------------------------------------------------------------*/
+
+static bool ep_valid(int ep) {
+	return ep >= 0 && ep < USB_RAW_EPS_NUM_MAX;
+}
+
+int raw_gadget_create(struct raw_gadget *rg) {
+	memset(rg, 0, sizeof(*rg));
+	rg->fd = raw_gadget_open();
+	return rg->fd < 0 ? rg->fd : 0;
+}
+
+static void unmap_ep_bufs(struct raw_gadget_ep *rep) {
+	if (rep->bufs)
+		munmap(rep->bufs, (size_t)rep->buf_count * rep->buf_size);
+	rep->bufs = NULL;
+	rep->buf_count = 0;
+	rep->buf_size = 0;
+}
+
+void raw_gadget_destroy(struct raw_gadget *rg) {
+	for (int i = 0; i < USB_RAW_EPS_NUM_MAX; i++)
+		unmap_ep_bufs(&rg->eps[i]);
+	if (rg->ring)
+		munmap(rg->ring, rg->ring_size);
+	rg->ring = NULL;
+	if (rg->fd >= 0)
+		close(rg->fd);
+	rg->fd = -1;
+}
+
+int raw_gadget_ring_setup(struct raw_gadget *rg, uint32_t sq_entries) {
+	struct usb_raw_ring_setup arg;
+	void *ring;
+	int rv;
+
+	if (rg->ring)
+		return -EBUSY;
+	memset(&arg, 0, sizeof(arg));
+	arg.sq_entries = sq_entries;
+	arg.eventfd = -1;
+	rv = raw_ioctl_ptr(rg->fd, USB_RAW_IOCTL_RING_SETUP, &arg);
+	if (rv < 0)
+		return rv;
+	ring = mmap(NULL, arg.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			rg->fd, USB_RAW_RING_MMAP_OFFSET);
+	if (ring == MAP_FAILED)
+		return -errno;
+
+	rg->ring = ring;
+	rg->ring_size = arg.size;
+	rg->hdr = ring;
+	rg->sq = (struct usb_raw_ep_submit *)((char *)ring + arg.sq_offset);
+	rg->cq = (struct usb_raw_ep_completion *)((char *)ring +
+							arg.cq_offset);
+	rg->sq_mask = rg->hdr->sq_entries - 1;
+	rg->cq_mask = rg->hdr->cq_entries - 1;
+	rg->sq_tail = rg->hdr->sq_tail;
+	return 0;
+}
+
+void raw_gadget_set_event_handler(struct raw_gadget *rg,
+			raw_gadget_event_fn event, void *data) {
+	rg->event = event;
+	rg->event_data = data;
+}
+
+void raw_gadget_ep_set_handler(struct raw_gadget *rg, int ep,
+			raw_gadget_complete_fn complete, void *data) {
+	if (!ep_valid(ep))
+		return;
+	rg->eps[ep].complete = complete;
+	rg->eps[ep].data = data;
+}
+
+int raw_gadget_ep_bufs(struct raw_gadget *rg, int ep, uint32_t count,
+			uint32_t size) {
+	struct raw_gadget_ep *rep;
+	struct usb_raw_ep_bufs arg;
+	void *bufs;
+	int rv;
+
+	if (!ep_valid(ep))
+		return -EINVAL;
+	rep = &rg->eps[ep];
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ep = ep;
+	arg.count = count;
+	arg.size = size;
+	rv = raw_gadget_ep_alloc_bufs(rg->fd, &arg);
+	// On failure, the old buffers stay in place and mapped.
+	if (rv < 0)
+		return rv;
+	// The old mapping keeps the pages of the replaced buffers, drop it.
+	unmap_ep_bufs(rep);
+	if (count == 0)
+		return 0;
+	bufs = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, rg->fd, arg.offset);
+	if (bufs == MAP_FAILED)
+		return -errno;
+
+	rep->bufs = bufs;
+	rep->buf_count = count;
+	rep->buf_size = size;
+	return 0;
+}
+
+int raw_gadget_queue(struct raw_gadget *rg, int ep, uint16_t flags,
+			uint64_t buffer, uint32_t length, uint64_t cookie) {
+	struct usb_raw_ep_submit *sqe;
+	uint32_t sq_head;
+
+	if (!rg->ring)
+		return -EINVAL;
+	// Pairs with the driver's store-release of sq_head.
+	sq_head = __atomic_load_n(&rg->hdr->sq_head, __ATOMIC_ACQUIRE);
+	if (rg->sq_tail - sq_head > rg->sq_mask)
+		return -EBUSY;
+
+	sqe = &rg->sq[rg->sq_tail & rg->sq_mask];
+	sqe->ep = ep;
+	sqe->flags = flags;
+	sqe->length = length;
+	sqe->cookie = cookie;
+	sqe->buffer = buffer;
+	sqe->stream_id = 0;
+	sqe->reserved = 0;
+	rg->sq_tail++;
+	return 0;
+}
+
+int raw_gadget_flush(struct raw_gadget *rg) {
+	struct usb_raw_ring_enter arg;
+	uint32_t sq_head;
+
+	if (!rg->ring)
+		return -EINVAL;
+	sq_head = __atomic_load_n(&rg->hdr->sq_head, __ATOMIC_ACQUIRE);
+	if (sq_head == rg->sq_tail)
+		return 0;
+	// Pairs with the driver's load-acquire of sq_tail.
+	__atomic_store_n(&rg->hdr->sq_tail, rg->sq_tail, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+	arg.to_submit = rg->sq_tail - sq_head;
+	return raw_ioctl_ptr(rg->fd, USB_RAW_IOCTL_RING_ENTER, &arg);
+}
+
+static int dispatch_completions(struct raw_gadget *rg) {
+	uint32_t cq_head = rg->hdr->cq_head;
+	uint32_t cq_tail;
+	int count = 0;
+	int rv = 0;
+
+	// Pairs with the driver's store-release of cq_tail.
+	cq_tail = __atomic_load_n(&rg->hdr->cq_tail, __ATOMIC_ACQUIRE);
+	while (cq_head != cq_tail) {
+		struct usb_raw_ep_completion cqe = rg->cq[cq_head & rg->cq_mask];
+		struct raw_gadget_ep *rep;
+
+		// Release the entry before calling the handler, so that the
+		// requests it queues can use the space.
+		cq_head++;
+		__atomic_store_n(&rg->hdr->cq_head, cq_head, __ATOMIC_RELEASE);
+		count++;
+
+		if (!ep_valid(cqe.ep))
+			continue;
+		rep = &rg->eps[cqe.ep];
+		if (rep->complete) {
+			rv = rep->complete(rg, &cqe, rep->data);
+			if (rv < 0)
+				return rv;
+		}
+	}
+	return count;
+}
+
+static int dispatch_events(struct raw_gadget *rg) {
+	struct {
+		struct usb_raw_events		inner;
+		struct usb_raw_event_entry	events[EVENTS_BATCH];
+	} arg;
+	int count = 0;
+	int rv;
+
+	do {
+		arg.inner.count = EVENTS_BATCH;
+		arg.inner.flags = USB_RAW_EVENTS_FLAGS_NONBLOCK;
+		rv = raw_gadget_events_fetch(rg->fd, &arg.inner);
+		if (rv < 0)
+			return rv;
+		for (int i = 0; i < rv; i++) {
+			int ret;
+
+			if (!rg->event)
+				continue;
+			ret = rg->event(rg, &arg.inner.events[i],
+					rg->event_data);
+			if (ret < 0)
+				return ret;
+		}
+		count += rv;
+	} while (rv == EVENTS_BATCH);
+	return count;
+}
+
+static int dispatch(struct raw_gadget *rg) {
+	int events, completions;
+
+	completions = dispatch_completions(rg);
+	if (completions < 0)
+		return completions;
+	events = dispatch_events(rg);
+	if (events < 0)
+		return events;
+	return events + completions;
+}
+
+int raw_gadget_loop_once(struct raw_gadget *rg, int timeout_ms) {
+	struct pollfd pfd;
+	int count, rv;
+
+	if (!rg->ring)
+		return -EINVAL;
+
+	// Free up completion ring space first: the driver refuses to submit
+	// requests when there's no space left for their completions.
+	count = dispatch(rg);
+	if (count < 0)
+		return count;
+	rv = raw_gadget_flush(rg);
+	if (rv < 0 && rv != -EBUSY)
+		return rv;
+	if (count)
+		return count;
+
+	pfd.fd = rg->fd;
+	pfd.events = POLLIN;
+	do {
+		rv = poll(&pfd, 1, timeout_ms);
+	} while (rv < 0 && errno == EINTR && !rg->stopped);
+	if (rv < 0 && errno != EINTR)
+		return -errno;
+	if (rv <= 0)
+		return 0;
+	return dispatch(rg);
+}
+
+int raw_gadget_loop(struct raw_gadget *rg) {
+	rg->stopped = false;
+	while (!rg->stopped) {
+		int rv = raw_gadget_loop_once(rg, -1);
+		if (rv < 0)
+			return rv;
+	}
+	return 0;
+}
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: Apache-2.0
+//
+// libraw_gadget: userspace library for USB Raw Gadget.
+//
+// Provides thin wrappers for the Raw Gadget ioctls and an event loop built on
+// top of the submission/completion rings and endpoint buffers mapped with
+// mmap(). None of the functions print anything or exit; they all return 0 (or
+// a non-negative value described for each ioctl in raw_gadget.h) on success
+// and a negative error code on failure. When the failure comes from a
+// syscall, errno is left set as well.
+//
+// Part of the USB Raw Gadget library.
+// See https://github.com/xairy/raw-gadget for details.
+
+#ifndef LIBRAW_GADGET_H
+#define LIBRAW_GADGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/types.h>
+#include <linux/usb/ch9.h>
+
+#include "../raw_gadget/raw_gadget.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*----------------------------------------------------------------------*/
+
+// Thin ioctl wrappers. Each one performs exactly one syscall.
+
+int raw_gadget_open(void);
+int raw_gadget_init(int fd, enum usb_device_speed speed,
+		const char *driver, const char *device);
+int raw_gadget_init_ext(int fd, enum usb_device_speed speed,
+		const char *driver, const char *device,
+		uint32_t event_queue_size);
+int raw_gadget_run(int fd);
+int raw_gadget_event_fetch(int fd, struct usb_raw_event *event);
+int raw_gadget_events_fetch(int fd, struct usb_raw_events *events);
+int raw_gadget_ep0_read(int fd, struct usb_raw_ep_io *io);
+int raw_gadget_ep0_write(int fd, struct usb_raw_ep_io *io);
+int raw_gadget_ep0_stall(int fd);
+int raw_gadget_ep_enable(int fd, struct usb_endpoint_descriptor *desc);
+int raw_gadget_ep_enable_ext(int fd, struct usb_raw_ep_enable_ext *arg);
+int raw_gadget_ep_disable(int fd, int ep);
+int raw_gadget_ep_read(int fd, struct usb_raw_ep_io *io);
+int raw_gadget_ep_write(int fd, struct usb_raw_ep_io *io);
+int raw_gadget_ep_submit(int fd, struct usb_raw_ep_submit *submit);
+int raw_gadget_ep_reap(int fd, struct usb_raw_ep_reap *reap);
+int raw_gadget_ep_alloc_bufs(int fd, struct usb_raw_ep_bufs *bufs);
+int raw_gadget_ep_set_halt(int fd, int ep);
+int raw_gadget_ep_clear_halt(int fd, int ep);
+int raw_gadget_ep_set_wedge(int fd, int ep);
+int raw_gadget_configure(int fd);
+int raw_gadget_vbus_draw(int fd, uint32_t power);
+int raw_gadget_eps_info(int fd, struct usb_raw_eps_info *info);
+int raw_gadget_desc_set(int fd, uint8_t type, uint8_t index,
+		uint16_t lang_id, const void *data, uint32_t length);
+int raw_gadget_rebind(int fd);
+int raw_gadget_ep_open(int fd, int ep);
+int raw_gadget_ep_set_coalesce(int fd, int ep, uint32_t count,
+		uint32_t usecs);
+int raw_gadget_ep_set_timeout(int fd, int ep, uint32_t msecs);
+int raw_gadget_ep0_set_timeout(int fd, uint32_t msecs);
+int raw_gadget_ep_cancel(int fd, int ep, uint16_t flags, uint64_t cookie);
+
+/*----------------------------------------------------------------------*/
+
+// Page-aligned buffers for USB_RAW_IOCTL_EP_SUBMIT and friends. Unlike the
+// buffers mapped with raw_gadget_ep_bufs(), these are not shared with the
+// driver, so the data is copied, but they can be of any size.
+
+void *raw_gadget_buf_alloc(size_t size);
+void raw_gadget_buf_free(void *buf);
+
+/*----------------------------------------------------------------------*/
+
+// Event loop.
+//
+// A raw_gadget context owns a Raw Gadget file descriptor, its rings, and the
+// endpoint buffers mapped into the process. Requests are queued into the
+// submission ring with raw_gadget_queue() without entering the kernel;
+// raw_gadget_loop_once() submits everything queued so far, waits for events
+// or completions, and dispatches them to the registered handlers. Handlers
+// may queue new requests; they are submitted on the next iteration.
+//
+// Control requests are still answered with the synchronous
+// raw_gadget_ep0_read/write() wrappers from the event handler, as ep0
+// transfers don't go through the rings.
+
+struct raw_gadget;
+
+// Called for each fetched event. Returning a negative value stops the loop,
+// and that value is returned from raw_gadget_loop().
+typedef int (*raw_gadget_event_fn)(struct raw_gadget *rg,
+		const struct usb_raw_event_entry *event, void *data);
+
+// Called for each completion posted to the completion ring for an endpoint.
+// Same return value convention as raw_gadget_event_fn.
+typedef int (*raw_gadget_complete_fn)(struct raw_gadget *rg,
+		const struct usb_raw_ep_completion *completion, void *data);
+
+struct raw_gadget_ep {
+	raw_gadget_complete_fn	complete;
+	void			*data;
+	uint8_t			*bufs;
+	uint32_t		buf_count;
+	uint32_t		buf_size;
+};
+
+struct raw_gadget {
+	int				fd;
+	bool				stopped;
+
+	raw_gadget_event_fn		event;
+	void				*event_data;
+
+	void				*ring;
+	size_t				ring_size;
+	struct usb_raw_ring_hdr		*hdr;
+	struct usb_raw_ep_submit	*sq;
+	struct usb_raw_ep_completion	*cq;
+	uint32_t			sq_mask;
+	uint32_t			cq_mask;
+	// Entries queued with raw_gadget_queue() but not yet published to
+	// the driver, see raw_gadget_flush().
+	uint32_t			sq_tail;
+
+	struct raw_gadget_ep		eps[USB_RAW_EPS_NUM_MAX];
+};
+
+// Opens /dev/raw-gadget and initializes the context. Call raw_gadget_init()
+// or raw_gadget_init_ext() on rg->fd, then raw_gadget_ring_setup() and
+// raw_gadget_run().
+int raw_gadget_create(struct raw_gadget *rg);
+
+// Unmaps the rings and the endpoint buffers and closes the file descriptor.
+void raw_gadget_destroy(struct raw_gadget *rg);
+
+// Sets up the rings with sq_entries submission entries (a power of 2) and
+// maps them. The completion ring gets twice as many entries.
+int raw_gadget_ring_setup(struct raw_gadget *rg, uint32_t sq_entries);
+
+void raw_gadget_set_event_handler(struct raw_gadget *rg,
+		raw_gadget_event_fn event, void *data);
+void raw_gadget_ep_set_handler(struct raw_gadget *rg, int ep,
+		raw_gadget_complete_fn complete, void *data);
+
+// Allocates count endpoint buffers of size bytes (a multiple of the page
+// size) with USB_RAW_IOCTL_EP_ALLOC_BUFS and maps them. The buffers are
+// returned by raw_gadget_ep_buf(). Passing count 0 unmaps and frees them. If
+// the ioctl fails, the previous buffers stay mapped.
+int raw_gadget_ep_bufs(struct raw_gadget *rg, int ep, uint32_t count,
+		uint32_t size);
+
+static inline void *raw_gadget_ep_buf(struct raw_gadget *rg, int ep,
+		uint32_t index) {
+	struct raw_gadget_ep *rep = &rg->eps[ep];
+
+	if (index >= rep->buf_count)
+		return NULL;
+	return rep->bufs + (size_t)index * rep->buf_size;
+}
+
+// Queues a request into the submission ring. With USB_RAW_SUBMIT_FLAGS_MAPPED
+// in flags, buffer is the index of an endpoint buffer; otherwise it is a
+// pointer to the data to send (IN endpoints only, as OUT requests submitted
+// through the ring must use mapped buffers). Returns -EBUSY if the ring is
+// full; submit the queued entries with raw_gadget_flush() and retry.
+int raw_gadget_queue(struct raw_gadget *rg, int ep, uint16_t flags,
+		uint64_t buffer, uint32_t length, uint64_t cookie);
+
+static inline int raw_gadget_queue_buf(struct raw_gadget *rg, int ep,
+		uint16_t flags, uint32_t index, uint32_t length,
+		uint64_t cookie) {
+	return raw_gadget_queue(rg, ep, flags | USB_RAW_SUBMIT_FLAGS_MAPPED,
+			index, length, cookie);
+}
+
+// Submits all queued entries. Returns the number of submitted entries. On
+// failure, the entry that failed to be submitted and the ones after it stay
+// in the ring.
+int raw_gadget_flush(struct raw_gadget *rg);
+
+// Submits queued entries, waits up to timeout_ms (-1 means forever) for
+// events or completions, and dispatches them. Returns the number of
+// dispatched events and completions, or the negative value returned by a
+// handler.
+int raw_gadget_loop_once(struct raw_gadget *rg, int timeout_ms);
+
+// Runs raw_gadget_loop_once() until raw_gadget_stop() is called or a handler
+// or the loop itself fails. Returns 0 or the error.
+int raw_gadget_loop(struct raw_gadget *rg);
+
+static inline void raw_gadget_stop(struct raw_gadget *rg) {
+	rg->stopped = true;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBRAW_GADGET_H
@@ -7,18 +7,36 @@
  * Author: Andrey Konovalov <andreyknvl@gmail.com>
  */
 
+#include <linux/anon_inodes.h>
 #include <linux/compiler.h>
 #include <linux/ctype.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/eventfd.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/idr.h>
 #include <linux/kref.h>
+#include <linux/log2.h>
 #include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/semaphore.h>
 #include <linux/sched.h>
+#include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
+#include <linux/splice.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
 
 #include <linux/usb.h>
@@ -29,6 +47,9 @@
 
 #include "raw_gadget.h"
 
+#define CREATE_TRACE_POINTS
+#include "raw_gadget_trace.h"
+
 #define	DRIVER_DESC "USB Raw Gadget"
 #define DRIVER_NAME "raw-gadget"
 
@@ -43,54 +64,78 @@ static DEFINE_IDA(driver_id_numbers);
 
 #define RAW_EVENT_QUEUE_SIZE	16
 
+/*
+ * Has the same layout as struct usb_raw_event followed by its data, and as
+ * struct usb_raw_event_entry.
+ */
+struct raw_event {
+	u32			type;
+	u32			length;
+	u8			data[USB_RAW_EVENT_DATA_MAX];
+};
+
 struct raw_event_queue {
 	/* See the comment in raw_event_queue_fetch() for locking details. */
 	spinlock_t		lock;
 	struct semaphore	sema;
-	struct usb_raw_event	*events[RAW_EVENT_QUEUE_SIZE];
+	/* Preallocated ring of capacity events, allocated on init ioctl. */
+	struct raw_event	*events;
+	int			capacity;
+	int			head;
 	int			size;
+	/* Slots of events fetched by raw_event_queue_fetch_many() in use: */
+	int			reserved;
+	/* Statistics for debugfs, protected by lock: */
+	int			size_max;
+	unsigned int		dropped;
 };
 
 static void raw_event_queue_init(struct raw_event_queue *queue)
 {
 	spin_lock_init(&queue->lock);
 	sema_init(&queue->sema, 0);
+	queue->events = NULL;
+	queue->capacity = 0;
+	queue->head = 0;
 	queue->size = 0;
+	queue->reserved = 0;
+	queue->size_max = 0;
+	queue->dropped = 0;
 }
 
 static int raw_event_queue_add(struct raw_event_queue *queue,
 	enum usb_raw_event_type type, size_t length, const void *data)
 {
 	unsigned long flags;
-	struct usb_raw_event *event;
+	struct raw_event *event;
+
+	if (WARN_ON(length > USB_RAW_EVENT_DATA_MAX))
+		return -EINVAL;
 
 	spin_lock_irqsave(&queue->lock, flags);
-	if (queue->size >= RAW_EVENT_QUEUE_SIZE) {
-		spin_unlock_irqrestore(&queue->lock, flags);
-		return -ENOMEM;
-	}
-	event = kmalloc(sizeof(*event) + length, GFP_ATOMIC);
-	if (!event) {
+	if (queue->size + queue->reserved >= queue->capacity) {
+		queue->dropped++;
 		spin_unlock_irqrestore(&queue->lock, flags);
 		return -ENOMEM;
 	}
+	event = &queue->events[(queue->head + queue->size) % queue->capacity];
 	event->type = type;
 	event->length = length;
 	if (event->length)
 		memcpy(&event->data[0], data, length);
-	queue->events[queue->size] = event;
 	queue->size++;
+	if (queue->size > queue->size_max)
+		queue->size_max = queue->size;
 	up(&queue->sema);
 	spin_unlock_irqrestore(&queue->lock, flags);
 	return 0;
 }
 
-static struct usb_raw_event *raw_event_queue_fetch(
-				struct raw_event_queue *queue)
+static int raw_event_queue_fetch(struct raw_event_queue *queue,
+					struct raw_event *event)
 {
 	int ret;
 	unsigned long flags;
-	struct usb_raw_event *event;
 
 	/*
 	 * This function can be called concurrently. We first check that
@@ -99,7 +144,7 @@ static struct usb_raw_event *raw_event_queue_fetch(
 	 */
 	ret = down_interruptible(&queue->sema);
 	if (ret)
-		return ERR_PTR(ret);
+		return ret;
 	spin_lock_irqsave(&queue->lock, flags);
 	/*
 	 * queue->size must have the same value as queue->sema counter (before
@@ -107,28 +152,191 @@ static struct usb_raw_event *raw_event_queue_fetch(
 	 */
 	if (WARN_ON(!queue->size)) {
 		spin_unlock_irqrestore(&queue->lock, flags);
-		return ERR_PTR(-ENODEV);
+		return -ENODEV;
 	}
-	event = queue->events[0];
+	*event = queue->events[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
 	queue->size--;
-	memmove(&queue->events[0], &queue->events[1],
-			queue->size * sizeof(queue->events[0]));
 	spin_unlock_irqrestore(&queue->lock, flags);
-	return event;
+	return 0;
 }
 
-static void raw_event_queue_destroy(struct raw_event_queue *queue)
+/*
+ * Fetches up to max events. Blocks until at least one event is queued unless
+ * nonblock is set. Returns the number of fetched events or negative error code.
+ * The slots of the fetched events stay reserved until they are returned with
+ * raw_event_queue_return().
+ */
+static int raw_event_queue_fetch_many(struct raw_event_queue *queue,
+			struct raw_event *events, int max, bool nonblock)
 {
-	int i;
+	int ret, n = 0;
+	unsigned long flags;
+
+	if (nonblock) {
+		if (down_trylock(&queue->sema))
+			return 0;
+	} else {
+		ret = down_interruptible(&queue->sema);
+		if (ret)
+			return ret;
+	}
+	spin_lock_irqsave(&queue->lock, flags);
+	/*
+	 * Every successful semaphore decrement accounts for one event. While
+	 * the lock is held, no other fetcher can consume the accounted ones.
+	 */
+	do {
+		if (WARN_ON(!queue->size)) {
+			spin_unlock_irqrestore(&queue->lock, flags);
+			return -ENODEV;
+		}
+		events[n++] = queue->events[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->size--;
+	} while (n < max && !down_trylock(&queue->sema));
+	queue->reserved += n;
+	spin_unlock_irqrestore(&queue->lock, flags);
+	return n;
+}
+
+/*
+ * Returns the slots of n events fetched by raw_event_queue_fetch_many(), and
+ * puts the ones after the first done events back at the front of the queue.
+ * The reserved slots guarantee that they fit.
+ */
+static void raw_event_queue_return(struct raw_event_queue *queue,
+			const struct raw_event *events, int n, int done)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	queue->reserved -= n;
+	while (n > done) {
+		queue->head = (queue->head + queue->capacity - 1) %
+							queue->capacity;
+		queue->events[queue->head] = events[--n];
+		queue->size++;
+		up(&queue->sema);
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
+
+/* Drops all queued events, keeping the semaphore in sync with the size. */
+static void raw_event_queue_clear(struct raw_event_queue *queue)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&queue->lock, flags);
+	while (queue->size && !down_trylock(&queue->sema)) {
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->size--;
+	}
+	spin_unlock_irqrestore(&queue->lock, flags);
+}
 
-	for (i = 0; i < queue->size; i++)
-		kfree(queue->events[i]);
+static void raw_event_queue_destroy(struct raw_event_queue *queue)
+{
+	kfree(queue->events);
+	queue->events = NULL;
+	queue->capacity = 0;
 	queue->size = 0;
 }
 
 /*----------------------------------------------------------------------*/
 
+/*
+ * Latency of requests from usb_ep_queue() to their completion is counted in
+ * buckets of [2^N, 2^(N + 1)) nanoseconds, the last bucket counts the rest.
+ */
+#define RAW_LATENCY_BUCKETS	32
+
+/*
+ * Per-CPU statistics of an endpoint, updated from completion callbacks and
+ * summed up when read through debugfs.
+ */
+struct raw_ep_stats {
+	u64			transfers;
+	u64			bytes;
+	u64			errors;
+	/* Time spent waiting for synchronous transfers to complete: */
+	u64			wait_ns;
+	u64			latency[RAW_LATENCY_BUCKETS];
+};
+
+struct raw_stats {
+	struct raw_ep_stats	ep0;
+	struct raw_ep_stats	eps[USB_RAW_EPS_NUM_MAX];
+};
+
+static void raw_stats_account(struct raw_ep_stats __percpu *stats,
+				struct usb_request *req, ktime_t queued)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), queued));
+
+	this_cpu_inc(stats->transfers);
+	this_cpu_add(stats->bytes, req->actual);
+	if (req->status)
+		this_cpu_inc(stats->errors);
+	this_cpu_inc(stats->latency[min_t(u32, ilog2(ns | 1),
+					RAW_LATENCY_BUCKETS - 1)]);
+}
+
+static void raw_stats_wait(struct raw_ep_stats __percpu *stats, ktime_t start)
+{
+	this_cpu_add(stats->wait_ns,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/*----------------------------------------------------------------------*/
+
 struct raw_dev;
+struct raw_ep;
+struct raw_capture;
+
+/*
+ * A request submitted with USB_RAW_IOCTL_EP_SUBMIT, or a request from the
+ * endpoint pool preallocated by USB_RAW_IOCTL_EP_ENABLE_EXT.
+ */
+struct raw_ep_req {
+	struct list_head	entry;
+	struct raw_ep		*ep;
+	struct usb_request	*req;
+	void __user		*buffer;
+	u32			buf_index;
+	u64			cookie;
+	u16			flags;
+	bool			in;
+	bool			ring;
+	u32			frame;
+	ktime_t			queued;
+
+	/*
+	 * Set by raw_ioctl_ep_cancel() under ep->lock. While held, the request
+	 * is not freed when it's done, but marked as released instead.
+	 */
+	bool			cancelled;
+	bool			held;
+	bool			released;
+
+	/* Pooled requests keep their own buffer of ep->pool_buf_len bytes: */
+	bool			pooled;
+	u32			pool_gen;
+	void			*buf;
+};
+
+/* A buffer allocated with USB_RAW_IOCTL_EP_ALLOC_BUFS. */
+struct raw_ep_buf {
+	void			*data;
+	bool			busy;
+};
+
+/*
+ * Buffers of endpoint N are mapped at mmap() offset RAW_MMAP_EP_OFFSET(N).
+ * Offsets below RAW_MMAP_EP_OFFSET(0) are used for the rings.
+ */
+#define RAW_MMAP_EP_SHIFT	28
+#define RAW_MMAP_EP_OFFSET(i)	((u64)((i) + 1) << RAW_MMAP_EP_SHIFT)
 
 enum ep_state {
 	STATE_EP_DISABLED,
@@ -137,13 +345,97 @@ enum ep_state {
 
 struct raw_ep {
 	struct raw_dev		*dev;
-	enum ep_state		state;
 	struct usb_ep		*ep;
 	u8			addr;
+
+	/*
+	 * Protects the fields below. Nests inside dev->lock, so that device
+	 * wide operations can walk the endpoints, but I/O on an endpoint and
+	 * its completion callbacks only take this lock.
+	 */
+	spinlock_t		lock;
+	enum ep_state		state;
 	struct usb_request	*req;
 	bool			urb_queued;
 	bool			disabling;
 	ssize_t			status;
+	ktime_t			queued;
+	/* Set by USB_RAW_IOCTL_EP_SET_TIMEOUT and USB_RAW_IOCTL_EP_CANCEL: */
+	u32			timeout;
+	bool			cancelling;
+	bool			cancelled;
+
+	/* Requests submitted with USB_RAW_IOCTL_EP_SUBMIT: */
+	struct list_head	reqs_pending;
+	struct list_head	reqs_done;
+	int			reqs_num;
+	int			reqs_max;
+	wait_queue_head_t	reqs_wait;
+
+	/* Requests submitted through the submission ring: */
+	struct list_head	reqs_ring;
+
+	/*
+	 * Requests queued by USB_RAW_IOCTL_EP_STREAM_START. They are queued
+	 * again on completion while streaming is set, and stay on reqs_stream
+	 * until they complete after that.
+	 */
+	struct list_head	reqs_stream;
+	bool			streaming;
+	bool			stream_lost;
+
+	/*
+	 * Free pooled requests. pool_gen changes when the pool is destroyed,
+	 * so that requests taken from it are freed instead of put back.
+	 */
+	struct list_head	reqs_free;
+	u32			pool_buf_len;
+	u32			pool_gen;
+
+	/*
+	 * Set by USB_RAW_IOCTL_EP_SET_COALESCE: waiters for completions are
+	 * woken up once coalesce_count completions are pending, or after
+	 * coalesce_usecs since the first one, whichever comes first.
+	 */
+	u32			coalesce_count;
+	u32			coalesce_usecs;
+	u32			coalesce_pending;
+	struct hrtimer		coalesce_timer;
+
+	/* Protected by both lock and dev->mmap_lock for writing: */
+	struct raw_ep_buf	*bufs;
+	u32			bufs_num;
+	u32			buf_size;
+};
+
+/* Rings set up with USB_RAW_IOCTL_RING_SETUP. */
+struct raw_ring {
+	struct usb_raw_ring_hdr		*hdr;
+	struct usb_raw_ep_submit	*sqes;
+	struct usb_raw_ep_completion	*cqes;
+	u32				sq_entries;
+	u32				cq_entries;
+	size_t				size;
+	struct eventfd_ctx		*eventfd;
+
+	/* Protected by dev->ring_lock: */
+	u32				sq_head;
+
+	/* Protected by lock, which nests inside the endpoint locks: */
+	spinlock_t			lock;
+	u32				cq_tail;
+	u32				inflight;
+	u32				cq_overflow;
+};
+
+/* A descriptor loaded with USB_RAW_IOCTL_DESC_SET. */
+struct raw_desc {
+	struct list_head		entry;
+	u8				type;
+	u8				index;
+	u16				lang_id;
+	u32				length;
+	u8				data[];
 };
 
 enum dev_state {
@@ -169,41 +461,480 @@ struct raw_dev {
 	/* Make driver names unique */
 	int				driver_id_number;
 
-	/* Protected by lock: */
+	/*
+	 * Protected by lock. The gadget and the endpoints are set up before
+	 * the device enters STATE_DEV_RUNNING, so endpoint operations check
+	 * for it with raw_check_running() without taking the lock.
+	 */
 	enum dev_state			state;
 	bool				gadget_registered;
 	struct usb_gadget		*gadget;
 	struct usb_request		*req;
+	struct raw_ep			eps[USB_RAW_EPS_NUM_MAX];
+	int				eps_num;
+
+	/* Protected by ep0_lock: */
+	spinlock_t			ep0_lock;
 	bool				ep0_in_pending;
 	bool				ep0_out_pending;
 	bool				ep0_urb_queued;
 	ssize_t				ep0_status;
-	struct raw_ep			eps[USB_RAW_EPS_NUM_MAX];
-	int				eps_num;
+	ktime_t				ep0_queued;
+	u32				ep0_timeout;
+	bool				ep0_cancelling;
+	bool				ep0_cancelled;
+	/* Descriptors answered from gadget_setup() and the request for that: */
+	struct list_head		descs;
+	int				descs_num;
+	struct usb_request		*desc_req;
+	bool				desc_req_queued;
+	ktime_t				desc_queued;
 
 	struct completion		ep0_done;
 	struct raw_event_queue		queue;
+
+	/* Serializes mmap() against endpoint buffers reallocation: */
+	struct mutex			mmap_lock;
+
+	/* Set once by USB_RAW_IOCTL_RING_SETUP, freed in dev_free(): */
+	struct raw_ring			*ring;
+	struct mutex			ring_lock;
+
+	/* Woken up on new events and completions for poll(): */
+	wait_queue_head_t		poll_wait;
+
+	struct raw_stats __percpu	*stats;
+	/* Created once by raw_dev_init(), removed in raw_release(): */
+	struct dentry			*debugfs;
+
+	/* Set while the capture file is open, assigned under lock: */
+	struct raw_capture __rcu	*capture;
+	/* Set by raw_capture_detach(), protected by lock: */
+	bool				capture_closed;
+
+	/*
+	 * Ioctls in progress and open endpoint fds, which can use the gadget
+	 * and the endpoints; USB_RAW_IOCTL_REBIND fails while there are any:
+	 */
+	atomic_t			users;
+	/* I/O in progress on endpoint fds, drained by raw_release(): */
+	atomic_t			ep_io;
+	wait_queue_head_t		ep_io_wait;
+};
+
+static struct raw_ep_stats __percpu *raw_ep_stats(struct raw_ep *ep)
+{
+	return &ep->dev->stats->eps[ep - &ep->dev->eps[0]];
+}
+
+/* Must be called with ep->lock held. */
+static void raw_ep_reqs_inc(struct raw_ep *ep, int num)
+{
+	ep->reqs_num += num;
+	if (ep->reqs_num > ep->reqs_max)
+		ep->reqs_max = ep->reqs_num;
+}
+
+/*----------------------------------------------------------------------*/
+
+/*
+ * Traffic capture. While the capture debugfs file is open, setup packets,
+ * events, and request submissions and completions are recorded into a ring
+ * in the usbmon binary format, and the file reads out as a pcap stream.
+ * Recording only takes capture->lock to copy a record in and never waits
+ * for the reader: records that don't fit into the ring are dropped.
+ */
+
+static unsigned int capture_size = SZ_1M;
+module_param(capture_size, uint, 0644);
+MODULE_PARM_DESC(capture_size, "size of capture rings in bytes");
+
+static unsigned int capture_snaplen = 64;
+module_param(capture_snaplen, uint, 0644);
+MODULE_PARM_DESC(capture_snaplen, "payload bytes captured per transfer");
+
+#define RAW_CAPTURE_SIZE_MIN	SZ_64K
+#define RAW_CAPTURE_SIZE_MAX	SZ_64M
+
+/* Same layout as struct usbmon_packet, see Documentation/usb/usbmon.rst. */
+struct raw_capture_hdr {
+	u64		id;
+	u8		type;
+	u8		xfer_type;
+	u8		epnum;
+	u8		devnum;
+	u16		busnum;
+	s8		flag_setup;
+	s8		flag_data;
+	s64		ts_sec;
+	s32		ts_usec;
+	s32		status;
+	u32		length;
+	u32		len_cap;
+	u8		setup[8];
+	s32		interval;
+	s32		start_frame;
+	u32		xfer_flags;
+	u32		ndesc;
+};
+static_assert(sizeof(struct raw_capture_hdr) == 64);
+
+/* usbmon transfer types, indexed by USB_ENDPOINT_XFER_*. */
+static const u8 raw_capture_xfer_types[] = { 2, 0, 3, 1 };
+#define RAW_CAPTURE_XFER_CONTROL	2
+
+#define RAW_PCAP_MAGIC			0xa1b2c3d4
+#define RAW_PCAP_LINKTYPE_USB_MMAPPED	220
+
+struct raw_pcap_file_hdr {
+	u32		magic;
+	u16		version_major;
+	u16		version_minor;
+	s32		thiszone;
+	u32		sigfigs;
+	u32		snaplen;
+	u32		network;
+};
+
+struct raw_pcap_rec_hdr {
+	u32		ts_sec;
+	u32		ts_usec;
+	u32		incl_len;
+	u32		orig_len;
+};
+
+struct raw_capture {
+	/* Cleared by raw_capture_detach() under raw_capture_mutex: */
+	struct raw_dev		*dev;
+	u8			*buf;
+	u32			size;
+	u32			snaplen;
+	wait_queue_head_t	wait;
+
+	/* Free running offsets; head is protected by lock. */
+	spinlock_t		lock;
+	u32			head;
+	u32			tail;
+	u64			dropped;
+	/* Direction of the last control transfer, for ep0 completions: */
+	bool			ep0_in;
+
+	/* Only used by the reader, protected by read_lock: */
+	struct mutex		read_lock;
+	struct raw_pcap_file_hdr file_hdr;
+	u32			file_hdr_pos;
 };
 
+/* Must be called with capture->lock held. */
+static void raw_capture_copy(struct raw_capture *cap, u32 pos,
+				const void *data, u32 len)
+{
+	u32 off = pos & (cap->size - 1);
+	u32 first = min(len, cap->size - off);
+
+	memcpy(cap->buf + off, data, first);
+	memcpy(cap->buf, data + first, len - first);
+}
+
+/* Must be called with capture->lock held. */
+static void raw_capture_copy_sg(struct raw_capture *cap, u32 pos,
+			struct scatterlist *sg, unsigned int nents, u32 len)
+{
+	u32 off = pos & (cap->size - 1);
+	u32 first = min(len, cap->size - off);
+
+	sg_pcopy_to_buffer(sg, nents, cap->buf + off, first, 0);
+	sg_pcopy_to_buffer(sg, nents, cap->buf, len - first, first);
+}
+
+/*
+ * Records hdr followed by up to snaplen bytes of the len bytes of payload,
+ * which is taken from data or, if it's NULL, from the request scatterlist.
+ */
+static void raw_capture_add(struct raw_capture *cap,
+			struct raw_capture_hdr *hdr, const void *data,
+			struct usb_request *req, u32 len)
+{
+	struct raw_pcap_rec_hdr rec;
+	unsigned long flags;
+	u32 pos, total;
+
+	if (!data && (!req || !req->num_sgs))
+		len = 0;
+	hdr->len_cap = min(len, cap->snaplen);
+	hdr->flag_data = hdr->len_cap ? 0 : (hdr->type == 'S' ? '<' : '>');
+	rec.ts_sec = hdr->ts_sec;
+	rec.ts_usec = hdr->ts_usec;
+	rec.incl_len = sizeof(*hdr) + hdr->len_cap;
+	rec.orig_len = sizeof(*hdr) + len;
+	total = sizeof(rec) + rec.incl_len;
+
+	spin_lock_irqsave(&cap->lock, flags);
+	pos = cap->head;
+	/* Pairs with smp_store_release() in raw_capture_read(). */
+	if (pos + total - smp_load_acquire(&cap->tail) > cap->size) {
+		cap->dropped++;
+		spin_unlock_irqrestore(&cap->lock, flags);
+		return;
+	}
+	raw_capture_copy(cap, pos, &rec, sizeof(rec));
+	raw_capture_copy(cap, pos + sizeof(rec), hdr, sizeof(*hdr));
+	pos += sizeof(rec) + sizeof(*hdr);
+	if (data)
+		raw_capture_copy(cap, pos, data, hdr->len_cap);
+	else if (hdr->len_cap)
+		raw_capture_copy_sg(cap, pos, req->sg, req->num_sgs,
+							hdr->len_cap);
+	if (hdr->type == 'S' && hdr->flag_setup == 0)
+		cap->ep0_in = hdr->epnum & USB_DIR_IN;
+	/* Pairs with smp_load_acquire() in raw_capture_read(). */
+	smp_store_release(&cap->head, cap->head + total);
+	spin_unlock_irqrestore(&cap->lock, flags);
+
+	wake_up_interruptible(&cap->wait);
+}
+
+static void raw_capture_hdr_init(struct raw_dev *dev,
+			struct raw_capture_hdr *hdr, u8 type, u64 id)
+{
+	struct timespec64 ts;
+
+	ktime_get_real_ts64(&ts);
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->id = id;
+	hdr->type = type;
+	hdr->xfer_type = RAW_CAPTURE_XFER_CONTROL;
+	hdr->devnum = 1;
+	hdr->busnum = dev->driver_id_number;
+	hdr->flag_setup = '-';
+	hdr->ts_sec = ts.tv_sec;
+	hdr->ts_usec = ts.tv_nsec / NSEC_PER_USEC;
+}
+
+/* Records a setup packet as the submission of a control transfer. */
+static void raw_capture_setup(struct raw_dev *dev,
+				const struct usb_ctrlrequest *ctrl)
+{
+	struct raw_capture *cap;
+	struct raw_capture_hdr hdr;
+
+	rcu_read_lock();
+	cap = rcu_dereference(dev->capture);
+	if (cap) {
+		raw_capture_hdr_init(dev, &hdr, 'S', 0);
+		hdr.epnum = ctrl->bRequestType & USB_DIR_IN;
+		hdr.flag_setup = 0;
+		hdr.status = -EINPROGRESS;
+		hdr.length = le16_to_cpu(ctrl->wLength);
+		memcpy(hdr.setup, ctrl, sizeof(hdr.setup));
+		raw_capture_add(cap, &hdr, NULL, NULL, 0);
+	}
+	rcu_read_unlock();
+}
+
+/* Records an event as an error record on ep0 with the event type as status. */
+static void raw_capture_event(struct raw_dev *dev, u32 type, u32 length,
+				const void *data)
+{
+	struct raw_capture *cap;
+	struct raw_capture_hdr hdr;
+
+	rcu_read_lock();
+	cap = rcu_dereference(dev->capture);
+	if (cap) {
+		raw_capture_hdr_init(dev, &hdr, 'E', 0);
+		hdr.status = type;
+		hdr.length = length;
+		raw_capture_add(cap, &hdr, data, NULL, length);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Records a request submission or completion. Requests to ep0 are only
+ * recorded on completion, the setup packet stands for their submission.
+ */
+static void raw_capture_req(struct raw_dev *dev, struct usb_ep *ep,
+				struct usb_request *req, bool done)
+{
+	const struct usb_endpoint_descriptor *desc = ep->desc;
+	struct raw_capture *cap;
+	struct raw_capture_hdr hdr;
+	bool ep0 = dev->gadget && ep == dev->gadget->ep0;
+
+	if (ep0 && !done)
+		return;
+	rcu_read_lock();
+	cap = rcu_dereference(dev->capture);
+	if (cap) {
+		raw_capture_hdr_init(dev, &hdr, done ? 'C' : 'S',
+				ep0 ? 0 : hash_ptr(req, 32));
+		if (ep0)
+			hdr.epnum = READ_ONCE(cap->ep0_in) ? USB_DIR_IN : 0;
+		else
+			hdr.epnum = ep->address;
+		if (!ep0 && desc)
+			hdr.xfer_type =
+				raw_capture_xfer_types[usb_endpoint_type(desc)];
+		hdr.status = done ? req->status : -EINPROGRESS;
+		hdr.length = done ? req->actual : req->length;
+		/* Only completions carry data, both for IN and OUT. */
+		raw_capture_add(cap, &hdr, req->buf, done ? req : NULL,
+				done ? min(req->actual, req->length) : 0);
+	}
+	rcu_read_unlock();
+}
+
+static void raw_trace_queue(struct raw_dev *dev, struct usb_ep *ep,
+				struct usb_request *req)
+{
+	trace_raw_gadget_ep_queue(dev->driver_id_number, ep, req);
+	raw_capture_req(dev, ep, req, false);
+}
+
+static void raw_trace_complete(struct raw_dev *dev, struct usb_ep *ep,
+				struct usb_request *req)
+{
+	trace_raw_gadget_ep_complete(dev->driver_id_number, ep, req);
+	raw_capture_req(dev, ep, req, true);
+}
+
+/*----------------------------------------------------------------------*/
+
+static enum hrtimer_restart raw_ep_coalesce_timer(struct hrtimer *t);
+
 static struct raw_dev *dev_new(void)
 {
 	struct raw_dev *dev;
+	int i;
 
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
 		return NULL;
+	dev->stats = alloc_percpu(struct raw_stats);
+	if (!dev->stats) {
+		kfree(dev);
+		return NULL;
+	}
 	/* Matches kref_put() in raw_release(). */
 	kref_init(&dev->count);
 	spin_lock_init(&dev->lock);
+	spin_lock_init(&dev->ep0_lock);
+	INIT_LIST_HEAD(&dev->descs);
+	mutex_init(&dev->mmap_lock);
+	mutex_init(&dev->ring_lock);
+	init_waitqueue_head(&dev->poll_wait);
+	init_waitqueue_head(&dev->ep_io_wait);
 	init_completion(&dev->ep0_done);
 	raw_event_queue_init(&dev->queue);
+	for (i = 0; i < USB_RAW_EPS_NUM_MAX; i++) {
+		dev->eps[i].dev = dev;
+		spin_lock_init(&dev->eps[i].lock);
+		INIT_LIST_HEAD(&dev->eps[i].reqs_pending);
+		INIT_LIST_HEAD(&dev->eps[i].reqs_done);
+		INIT_LIST_HEAD(&dev->eps[i].reqs_ring);
+		INIT_LIST_HEAD(&dev->eps[i].reqs_stream);
+		INIT_LIST_HEAD(&dev->eps[i].reqs_free);
+		init_waitqueue_head(&dev->eps[i].reqs_wait);
+		hrtimer_init(&dev->eps[i].coalesce_timer, CLOCK_MONOTONIC,
+							HRTIMER_MODE_REL);
+		dev->eps[i].coalesce_timer.function = raw_ep_coalesce_timer;
+	}
 	dev->driver_id_number = -1;
 	return dev;
 }
 
+static void raw_ep_bufs_free(struct raw_ep_buf *bufs, u32 num, u32 size)
+{
+	u32 i;
+
+	for (i = 0; i < num; i++)
+		free_pages_exact(bufs[i].data, size);
+	kfree(bufs);
+}
+
+static void raw_ep_req_free(struct raw_ep_req *r_req)
+{
+	if (r_req->pooled)
+		kfree(r_req->buf);
+	else if (!usb_raw_submit_flags_mapped(r_req->flags))
+		kfree(r_req->req->buf);
+	usb_ep_free_request(r_req->ep->ep, r_req->req);
+	kfree(r_req);
+}
+
+/* Frees pooled requests that are not in use. */
+static void raw_ep_pool_free(struct list_head *pool, struct usb_ep *ep)
+{
+	struct raw_ep_req *r_req, *tmp;
+
+	list_for_each_entry_safe(r_req, tmp, pool, entry) {
+		if (r_req->req)
+			usb_ep_free_request(ep, r_req->req);
+		kfree(r_req->buf);
+		kfree(r_req);
+	}
+}
+
+/* Must be called with ep->lock held. */
+static struct raw_ep_req *raw_ep_pool_get(struct raw_ep *ep, u32 length)
+{
+	struct raw_ep_req *r_req;
+
+	if (length > ep->pool_buf_len)
+		return NULL;
+	r_req = list_first_entry_or_null(&ep->reqs_free, struct raw_ep_req,
+								entry);
+	if (r_req)
+		list_del(&r_req->entry);
+	return r_req;
+}
+
+/*
+ * Puts a request back to the endpoint pool. Returns false if the request is
+ * not pooled or its pool was destroyed, and thus must be freed by the caller.
+ * Must be called with ep->lock held.
+ */
+static bool raw_ep_pool_put(struct raw_ep *ep, struct raw_ep_req *r_req)
+{
+	if (!r_req->pooled || r_req->pool_gen != ep->pool_gen)
+		return false;
+	r_req->req->buf = r_req->buf;
+	/* Reuse the most recently used request, its buffer is cache hot. */
+	list_add(&r_req->entry, &ep->reqs_free);
+	return true;
+}
+
+/*
+ * Puts a request that is no longer used back to the endpoint pool, unless
+ * raw_ioctl_ep_cancel() holds it. Returns true if the request must be freed
+ * by the caller. Must be called with ep->lock held.
+ */
+static bool raw_ep_req_put(struct raw_ep *ep, struct raw_ep_req *r_req)
+{
+	if (r_req->held) {
+		r_req->released = true;
+		return false;
+	}
+	return !raw_ep_pool_put(ep, r_req);
+}
+
+static void raw_ep_req_release(struct raw_ep *ep, struct raw_ep_req *r_req)
+{
+	unsigned long flags;
+	bool free;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	free = raw_ep_req_put(ep, r_req);
+	spin_unlock_irqrestore(&ep->lock, flags);
+	if (free)
+		raw_ep_req_free(r_req);
+}
+
 static void dev_free(struct kref *kref)
 {
 	struct raw_dev *dev = container_of(kref, struct raw_dev, count);
+	struct raw_desc *desc, *desc_tmp;
 	int i;
 
 	kfree(dev->udc_name);
@@ -211,60 +942,167 @@ static void dev_free(struct kref *kref)
 	kfree(dev->driver.driver.name);
 	if (dev->driver_id_number >= 0)
 		ida_free(&driver_id_numbers, dev->driver_id_number);
-	if (dev->req) {
-		if (dev->ep0_urb_queued)
-			usb_ep_dequeue(dev->gadget->ep0, dev->req);
-		usb_ep_free_request(dev->gadget->ep0, dev->req);
-	}
+	/* Everything allocated from the UDC is freed in raw_dev_unbind(). */
+	WARN_ON(dev->req || dev->desc_req);
+	list_for_each_entry_safe(desc, desc_tmp, &dev->descs, entry)
+		kfree(desc);
 	raw_event_queue_destroy(&dev->queue);
 	for (i = 0; i < dev->eps_num; i++) {
-		if (dev->eps[i].state == STATE_EP_DISABLED)
-			continue;
-		usb_ep_disable(dev->eps[i].ep);
-		usb_ep_free_request(dev->eps[i].ep, dev->eps[i].req);
-		kfree(dev->eps[i].ep->desc);
-		dev->eps[i].state = STATE_EP_DISABLED;
+		hrtimer_cancel(&dev->eps[i].coalesce_timer);
+		WARN_ON(dev->eps[i].state != STATE_EP_DISABLED);
+		WARN_ON(!list_empty(&dev->eps[i].reqs_pending));
+		WARN_ON(!list_empty(&dev->eps[i].reqs_done));
+		WARN_ON(!list_empty(&dev->eps[i].reqs_free));
+		WARN_ON(!list_empty(&dev->eps[i].reqs_ring));
+		WARN_ON(!list_empty(&dev->eps[i].reqs_stream));
+		if (dev->eps[i].bufs)
+			raw_ep_bufs_free(dev->eps[i].bufs,
+				dev->eps[i].bufs_num, dev->eps[i].buf_size);
 	}
+	if (dev->ring) {
+		if (dev->ring->eventfd)
+			eventfd_ctx_put(dev->ring->eventfd);
+		vfree(dev->ring->hdr);
+		kfree(dev->ring);
+	}
+	free_percpu(dev->stats);
 	kfree(dev);
 }
 
 /*----------------------------------------------------------------------*/
 
-static int raw_queue_event(struct raw_dev *dev,
-	enum usb_raw_event_type type, size_t length, const void *data)
+static void raw_notify(struct raw_dev *dev)
 {
-	int ret = 0;
-	unsigned long flags;
+	struct raw_ring *ring = smp_load_acquire(&dev->ring);
 
-	ret = raw_event_queue_add(&dev->queue, type, length, data);
-	if (ret < 0) {
-		spin_lock_irqsave(&dev->lock, flags);
-		dev->state = STATE_DEV_FAILED;
-		spin_unlock_irqrestore(&dev->lock, flags);
-	}
-	return ret;
+	wake_up_interruptible(&dev->poll_wait);
+	if (ring && ring->eventfd)
+		eventfd_signal(ring->eventfd);
 }
 
-static void gadget_ep0_complete(struct usb_ep *ep, struct usb_request *req)
+static void raw_set_failed(struct raw_dev *dev)
 {
-	struct raw_dev *dev = req->context;
 	unsigned long flags;
 
 	spin_lock_irqsave(&dev->lock, flags);
-	if (req->status)
-		dev->ep0_status = req->status;
-	else
-		dev->ep0_status = req->actual;
-	if (dev->ep0_in_pending)
-		dev->ep0_in_pending = false;
-	else
-		dev->ep0_out_pending = false;
+	dev->state = STATE_DEV_FAILED;
 	spin_unlock_irqrestore(&dev->lock, flags);
+}
 
-	complete(&dev->ep0_done);
+/*
+ * Checks that the device is running without taking dev->lock. Once the
+ * device is running, dev->gadget and the endpoints only change after the
+ * gadget driver is unbound by raw_release() or raw_ioctl_rebind(). The
+ * former can't happen during an ioctl on the device fd and waits for the
+ * I/O on endpoint fds that took a reference with raw_ep_io_get(). The latter
+ * fails if it races with a caller that took a reference with
+ * raw_dev_users_get() beforehand.
+ */
+static int raw_check_running(struct raw_dev *dev)
+{
+	/* Pairs with smp_store_release() in raw_ioctl_run(). */
+	if (smp_load_acquire(&dev->state) != STATE_DEV_RUNNING) {
+		dev_dbg(dev->dev, "fail, device is not running\n");
+		return -EINVAL;
+	}
+	if (!dev->gadget) {
+		dev_dbg(dev->dev, "fail, gadget is not bound\n");
+		return -EBUSY;
+	}
+	return 0;
 }
 
-static u8 get_ep_addr(const char *name)
+static void raw_dev_users_get(struct raw_dev *dev)
+{
+	atomic_inc(&dev->users);
+	/* Pairs with smp_mb() in raw_ioctl_rebind(). */
+	smp_mb__after_atomic();
+}
+
+static void raw_dev_users_put(struct raw_dev *dev)
+{
+	atomic_dec(&dev->users);
+}
+
+/*
+ * Takes a reference for I/O on an endpoint fd. Fails with -ENODEV once
+ * raw_release() has started, as the endpoints are about to go away.
+ */
+static int raw_ep_io_get(struct raw_dev *dev)
+{
+	int ret;
+
+	atomic_inc(&dev->ep_io);
+	/* Pairs with smp_mb() in raw_ep_io_drain(). */
+	smp_mb__after_atomic();
+	if (smp_load_acquire(&dev->state) == STATE_DEV_CLOSED)
+		ret = -ENODEV;
+	else
+		ret = raw_check_running(dev);
+	if (ret && atomic_dec_and_test(&dev->ep_io))
+		wake_up(&dev->ep_io_wait);
+	return ret;
+}
+
+static void raw_ep_io_put(struct raw_dev *dev)
+{
+	if (atomic_dec_and_test(&dev->ep_io))
+		wake_up(&dev->ep_io_wait);
+}
+
+static int raw_queue_event(struct raw_dev *dev,
+	enum usb_raw_event_type type, size_t length, const void *data)
+{
+	int ret = 0;
+
+	ret = raw_event_queue_add(&dev->queue, type, length, data);
+	trace_raw_gadget_event_add(dev->driver_id_number, type, length, ret);
+	/* Control events are captured as setup packets. */
+	if (type != USB_RAW_EVENT_CONTROL)
+		raw_capture_event(dev, type, length, data);
+	if (ret < 0) {
+		raw_set_failed(dev);
+		return ret;
+	}
+	raw_notify(dev);
+	return ret;
+}
+
+static void gadget_ep0_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct raw_dev *dev = req->context;
+	unsigned long flags;
+
+	raw_trace_complete(dev, ep, req);
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	raw_stats_account(&dev->stats->ep0, req, dev->ep0_queued);
+	if (req->status)
+		dev->ep0_status = req->status;
+	else
+		dev->ep0_status = req->actual;
+	if (dev->ep0_in_pending)
+		dev->ep0_in_pending = false;
+	else
+		dev->ep0_out_pending = false;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+
+	complete(&dev->ep0_done);
+}
+
+static void gadget_ep0_desc_complete(struct usb_ep *ep,
+					struct usb_request *req)
+{
+	struct raw_dev *dev = req->context;
+	unsigned long flags;
+
+	raw_trace_complete(dev, ep, req);
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	raw_stats_account(&dev->stats->ep0, req, dev->desc_queued);
+	dev->desc_req_queued = false;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+}
+
+static u8 get_ep_addr(const char *name)
 {
 	/* If the endpoint has fixed function (named as e.g. "ep12out-bulk"),
 	 * parse the endpoint address from its name. We deliberately use
@@ -277,12 +1115,15 @@ static u8 get_ep_addr(const char *name)
 	return USB_RAW_EP_ADDR_ANY;
 }
 
+static void raw_dev_unbind(struct raw_dev *dev, struct usb_gadget *gadget);
+static void raw_ep_io_drain(struct raw_dev *dev);
+
 static int gadget_bind(struct usb_gadget *gadget,
 			struct usb_gadget_driver *driver)
 {
 	int ret = 0, i = 0;
 	struct raw_dev *dev = container_of(driver, struct raw_dev, driver);
-	struct usb_request *req;
+	struct usb_request *req, *desc_req;
 	struct usb_ep *ep;
 	unsigned long flags;
 
@@ -296,11 +1137,25 @@ static int gadget_bind(struct usb_gadget *gadget,
 		set_gadget_data(gadget, NULL);
 		return -ENOMEM;
 	}
+	desc_req = usb_ep_alloc_request(gadget->ep0, GFP_KERNEL);
+	if (desc_req)
+		desc_req->buf = kmalloc(USB_RAW_DESC_LENGTH_MAX, GFP_KERNEL);
+	if (!desc_req || !desc_req->buf) {
+		dev_err(&gadget->dev, "failed to allocate request buffer\n");
+		if (desc_req)
+			usb_ep_free_request(gadget->ep0, desc_req);
+		usb_ep_free_request(gadget->ep0, req);
+		set_gadget_data(gadget, NULL);
+		return -ENOMEM;
+	}
 
 	spin_lock_irqsave(&dev->lock, flags);
 	dev->req = req;
 	dev->req->context = dev;
 	dev->req->complete = gadget_ep0_complete;
+	dev->desc_req = desc_req;
+	dev->desc_req->context = dev;
+	dev->desc_req->complete = gadget_ep0_desc_complete;
 	dev->gadget = gadget;
 	gadget_for_each_ep(ep, dev->gadget) {
 		dev->eps[i].ep = ep;
@@ -315,6 +1170,7 @@ static int gadget_bind(struct usb_gadget *gadget,
 	ret = raw_queue_event(dev, USB_RAW_EVENT_CONNECT, 0, NULL);
 	if (ret < 0) {
 		dev_err(&gadget->dev, "failed to queue connect event\n");
+		raw_dev_unbind(dev, gadget);
 		set_gadget_data(gadget, NULL);
 		return ret;
 	}
@@ -328,11 +1184,79 @@ static void gadget_unbind(struct usb_gadget *gadget)
 {
 	struct raw_dev *dev = get_gadget_data(gadget);
 
+	raw_dev_unbind(dev, gadget);
 	set_gadget_data(gadget, NULL);
 	/* Matches kref_get() in gadget_bind(). */
 	kref_put(&dev->count, dev_free);
 }
 
+/* Must be called with ep0_lock held. */
+static struct raw_desc *raw_desc_find(struct raw_dev *dev, u8 type, u8 index,
+					u16 lang_id)
+{
+	struct raw_desc *desc;
+
+	list_for_each_entry(desc, &dev->descs, entry) {
+		if (desc->type == type && desc->index == index &&
+				desc->lang_id == lang_id)
+			return desc;
+	}
+	return NULL;
+}
+
+/*
+ * Fills in dev->desc_req with a reply to a standard GET_DESCRIPTOR request
+ * from the descriptors loaded with USB_RAW_IOCTL_DESC_SET. Returns false if
+ * the request must be forwarded to userspace instead.
+ * Must be called with ep0_lock held.
+ */
+static bool raw_ep0_desc_prepare(struct raw_dev *dev,
+				const struct usb_ctrlrequest *ctrl)
+{
+	u16 value = le16_to_cpu(ctrl->wValue);
+	u16 length = le16_to_cpu(ctrl->wLength);
+	u8 type = value >> 8;
+	struct raw_desc *desc;
+	u16 lang_id = 0;
+
+	if (ctrl->bRequestType != (USB_DIR_IN | USB_TYPE_STANDARD |
+						USB_RECIP_DEVICE) ||
+			ctrl->bRequest != USB_REQ_GET_DESCRIPTOR || !length)
+		return false;
+	if (list_empty(&dev->descs) || dev->desc_req_queued)
+		return false;
+	if (type == USB_DT_STRING)
+		lang_id = le16_to_cpu(ctrl->wIndex);
+	desc = raw_desc_find(dev, type, value & 0xff, lang_id);
+	if (!desc)
+		return false;
+
+	dev->desc_req->length = min_t(u32, length, desc->length);
+	memcpy(dev->desc_req->buf, desc->data, dev->desc_req->length);
+	/* Let the host know the descriptor is shorter than requested. */
+	dev->desc_req->zero = dev->desc_req->length < length;
+	dev->desc_req_queued = true;
+	dev->desc_queued = ktime_get();
+	return true;
+}
+
+static int raw_ep0_desc_queue(struct raw_dev *dev)
+{
+	unsigned long flags;
+	int ret;
+
+	raw_trace_queue(dev, dev->gadget->ep0, dev->desc_req);
+	ret = usb_ep_queue(dev->gadget->ep0, dev->desc_req, GFP_ATOMIC);
+	if (ret) {
+		dev_err(&dev->gadget->dev,
+				"fail, usb_ep_queue returned %d\n", ret);
+		spin_lock_irqsave(&dev->ep0_lock, flags);
+		dev->desc_req_queued = false;
+		spin_unlock_irqrestore(&dev->ep0_lock, flags);
+	}
+	return ret;
+}
+
 static int gadget_setup(struct usb_gadget *gadget,
 			const struct usb_ctrlrequest *ctrl)
 {
@@ -340,22 +1264,28 @@ static int gadget_setup(struct usb_gadget *gadget,
 	struct raw_dev *dev = get_gadget_data(gadget);
 	unsigned long flags;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
+	if (READ_ONCE(dev->state) != STATE_DEV_RUNNING) {
 		dev_err(&gadget->dev, "ignoring, device is not running\n");
 		ret = -ENODEV;
-		goto out_unlock;
+		goto out;
 	}
+	raw_capture_setup(dev, ctrl);
+
+	spin_lock_irqsave(&dev->ep0_lock, flags);
 	if (dev->ep0_in_pending || dev->ep0_out_pending) {
 		dev_dbg(&gadget->dev, "stalling, request already pending\n");
 		ret = -EBUSY;
 		goto out_unlock;
 	}
+	if (raw_ep0_desc_prepare(dev, ctrl)) {
+		spin_unlock_irqrestore(&dev->ep0_lock, flags);
+		return raw_ep0_desc_queue(dev);
+	}
 	if ((ctrl->bRequestType & USB_DIR_IN) && ctrl->wLength)
 		dev->ep0_in_pending = true;
 	else
 		dev->ep0_out_pending = true;
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
 
 	ret = raw_queue_event(dev, USB_RAW_EVENT_CONTROL, sizeof(*ctrl), ctrl);
 	if (ret < 0)
@@ -363,7 +1293,7 @@ static int gadget_setup(struct usb_gadget *gadget,
 	goto out;
 
 out_unlock:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
 out:
 	if (ret == 0 && ctrl->wLength == 0) {
 		/*
@@ -421,6 +1351,283 @@ static void gadget_reset(struct usb_gadget *gadget)
 
 /*----------------------------------------------------------------------*/
 
+static struct dentry *raw_debugfs_root;
+
+/* The counters are not read atomically, which is fine for statistics. */
+static void raw_stats_show_ep(struct seq_file *s, const char *name,
+				struct raw_ep_stats __percpu *stats)
+{
+	struct raw_ep_stats sum = {}, *cpu_stats;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(stats, cpu);
+		sum.transfers += cpu_stats->transfers;
+		sum.bytes += cpu_stats->bytes;
+		sum.errors += cpu_stats->errors;
+		sum.wait_ns += cpu_stats->wait_ns;
+		for (i = 0; i < RAW_LATENCY_BUCKETS; i++)
+			sum.latency[i] += cpu_stats->latency[i];
+	}
+	seq_printf(s,
+		"%s: transfers %llu bytes %llu errors %llu wait_ns %llu\n",
+		name, sum.transfers, sum.bytes, sum.errors, sum.wait_ns);
+	seq_puts(s, "  latency_ns:");
+	for (i = 0; i < RAW_LATENCY_BUCKETS; i++) {
+		if (sum.latency[i])
+			seq_printf(s, " %llu:%llu", 1ULL << i, sum.latency[i]);
+	}
+	seq_putc(s, '\n');
+}
+
+static int raw_stats_show(struct seq_file *s, void *unused)
+{
+	struct raw_dev *dev = s->private;
+	struct raw_capture *cap;
+	struct raw_ep *ep;
+	unsigned long flags;
+	int i, size, size_max, reqs_num, reqs_max;
+	unsigned int dropped;
+	bool enabled;
+	char name[16];
+
+	spin_lock_irqsave(&dev->queue.lock, flags);
+	size = dev->queue.size;
+	size_max = dev->queue.size_max;
+	dropped = dev->queue.dropped;
+	spin_unlock_irqrestore(&dev->queue.lock, flags);
+	seq_printf(s, "events: queued %d max %d capacity %d dropped %u\n",
+			size, size_max, dev->queue.capacity, dropped);
+	rcu_read_lock();
+	cap = rcu_dereference(dev->capture);
+	if (cap)
+		seq_printf(s, "capture: size %u snaplen %u dropped %llu\n",
+			cap->size, cap->snaplen, READ_ONCE(cap->dropped));
+	rcu_read_unlock();
+
+	raw_stats_show_ep(s, "ep0", &dev->stats->ep0);
+	/*
+	 * The UDC endpoints might go away together with the gadget, so only
+	 * the fields of struct raw_ep are used here.
+	 */
+	for (i = 0; i < READ_ONCE(dev->eps_num); i++) {
+		ep = &dev->eps[i];
+		snprintf(name, sizeof(name), "eps[%d]", i);
+		spin_lock_irqsave(&ep->lock, flags);
+		enabled = ep->state == STATE_EP_ENABLED;
+		reqs_num = ep->reqs_num;
+		reqs_max = ep->reqs_max;
+		spin_unlock_irqrestore(&ep->lock, flags);
+		raw_stats_show_ep(s, name, raw_ep_stats(ep));
+		seq_printf(s, "  addr %u enabled %d reqs %d reqs_max %d\n",
+				ep->addr, enabled, reqs_num, reqs_max);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(raw_stats);
+
+/*
+ * The capture file can stay open after the device is freed: debugfs only
+ * waits for the file operations in progress when the file is removed, and
+ * calls ->release() later. Thus, the capture doesn't hold a reference to
+ * the device. Instead, raw_release() detaches the capture before removing
+ * the files, and raw_capture_release() only touches the device if it's
+ * still attached.
+ */
+static DEFINE_MUTEX(raw_capture_mutex);
+
+static int raw_capture_open(struct inode *inode, struct file *file)
+{
+	struct raw_dev *dev = inode->i_private;
+	struct raw_capture *cap;
+	unsigned long flags;
+	u32 size;
+	int ret;
+
+	size = roundup_pow_of_two(clamp_t(u32, READ_ONCE(capture_size),
+			RAW_CAPTURE_SIZE_MIN, RAW_CAPTURE_SIZE_MAX));
+	cap = kzalloc(sizeof(*cap), GFP_KERNEL);
+	if (!cap)
+		return -ENOMEM;
+	cap->buf = vmalloc(size);
+	if (!cap->buf) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	cap->size = size;
+	/* Leave room for many records even with the largest payloads. */
+	cap->snaplen = min_t(u32, READ_ONCE(capture_snaplen), size / 16);
+	spin_lock_init(&cap->lock);
+	mutex_init(&cap->read_lock);
+	init_waitqueue_head(&cap->wait);
+	cap->file_hdr.magic = RAW_PCAP_MAGIC;
+	cap->file_hdr.version_major = 2;
+	cap->file_hdr.version_minor = 4;
+	cap->file_hdr.snaplen = sizeof(struct raw_capture_hdr) + cap->snaplen;
+	cap->file_hdr.network = RAW_PCAP_LINKTYPE_USB_MMAPPED;
+
+	cap->dev = dev;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dev->capture_closed) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		ret = -ENODEV;
+		goto out_free;
+	}
+	if (rcu_access_pointer(dev->capture)) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		ret = -EBUSY;
+		goto out_free;
+	}
+	rcu_assign_pointer(dev->capture, cap);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	file->private_data = cap;
+	return stream_open(inode, file);
+
+out_free:
+	vfree(cap->buf);
+	kfree(cap);
+	return ret;
+}
+
+static ssize_t raw_capture_read_locked(struct file *file,
+			struct raw_capture *cap, char __user *buf, size_t count)
+{
+	u32 head, off, first, len;
+	int ret;
+
+	if (cap->file_hdr_pos < sizeof(cap->file_hdr)) {
+		len = min_t(size_t, count,
+				sizeof(cap->file_hdr) - cap->file_hdr_pos);
+		if (copy_to_user(buf, (u8 *)&cap->file_hdr + cap->file_hdr_pos,
+									len))
+			return -EFAULT;
+		cap->file_hdr_pos += len;
+		return len;
+	}
+
+	if (!(file->f_flags & O_NONBLOCK)) {
+		ret = wait_event_interruptible(cap->wait,
+				smp_load_acquire(&cap->head) != cap->tail ||
+				!READ_ONCE(cap->dev));
+		if (ret)
+			return ret;
+	}
+	if (smp_load_acquire(&cap->head) == cap->tail) {
+		/* The device is closed, nothing more will be recorded. */
+		if (!READ_ONCE(cap->dev))
+			return 0;
+		return -EAGAIN;
+	}
+
+	/* Pairs with smp_store_release() in raw_capture_add(). */
+	head = smp_load_acquire(&cap->head);
+	len = min_t(size_t, count, head - cap->tail);
+	off = cap->tail & (cap->size - 1);
+	first = min(len, cap->size - off);
+	if (copy_to_user(buf, cap->buf + off, first) ||
+			copy_to_user(buf + first, cap->buf, len - first))
+		return -EFAULT;
+	/* Pairs with smp_load_acquire() in raw_capture_add(). */
+	smp_store_release(&cap->tail, cap->tail + len);
+	return len;
+}
+
+static ssize_t raw_capture_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct raw_capture *cap = file->private_data;
+	ssize_t ret;
+
+	ret = mutex_lock_interruptible(&cap->read_lock);
+	if (ret)
+		return ret;
+	ret = raw_capture_read_locked(file, cap, buf, count);
+	mutex_unlock(&cap->read_lock);
+	return ret;
+}
+
+static __poll_t raw_capture_poll(struct file *file, poll_table *wait)
+{
+	struct raw_capture *cap = file->private_data;
+
+	poll_wait(file, &cap->wait, wait);
+	if (cap->file_hdr_pos < sizeof(cap->file_hdr) ||
+			smp_load_acquire(&cap->head) != cap->tail)
+		return EPOLLIN | EPOLLRDNORM;
+	if (!READ_ONCE(cap->dev))
+		return EPOLLIN | EPOLLRDNORM | EPOLLHUP;
+	return 0;
+}
+
+static int raw_capture_release(struct inode *inode, struct file *file)
+{
+	struct raw_capture *cap = file->private_data;
+	struct raw_dev *dev;
+	unsigned long flags;
+
+	mutex_lock(&raw_capture_mutex);
+	dev = cap->dev;
+	if (dev) {
+		spin_lock_irqsave(&dev->lock, flags);
+		RCU_INIT_POINTER(dev->capture, NULL);
+		spin_unlock_irqrestore(&dev->lock, flags);
+	}
+	mutex_unlock(&raw_capture_mutex);
+	/* Waits for records that are being added, including from IRQs. */
+	synchronize_rcu();
+
+	vfree(cap->buf);
+	kfree(cap);
+	return 0;
+}
+
+/*
+ * Stops the capture for good and wakes up its reader, which then reads out
+ * what's left and gets an EOF. Must be called before the debugfs files are
+ * removed, as that waits for the reader.
+ */
+static void raw_capture_detach(struct raw_dev *dev)
+{
+	struct raw_capture *cap;
+	unsigned long flags;
+
+	mutex_lock(&raw_capture_mutex);
+	spin_lock_irqsave(&dev->lock, flags);
+	dev->capture_closed = true;
+	cap = rcu_dereference_protected(dev->capture,
+					lockdep_is_held(&dev->lock));
+	RCU_INIT_POINTER(dev->capture, NULL);
+	spin_unlock_irqrestore(&dev->lock, flags);
+	if (cap) {
+		WRITE_ONCE(cap->dev, NULL);
+		wake_up_interruptible(&cap->wait);
+	}
+	mutex_unlock(&raw_capture_mutex);
+}
+
+static const struct file_operations raw_capture_fops = {
+	.owner =		THIS_MODULE,
+	.open =			raw_capture_open,
+	.read =			raw_capture_read,
+	.poll =			raw_capture_poll,
+	.release =		raw_capture_release,
+	.llseek =		no_llseek,
+};
+
+static void raw_debugfs_init_dev(struct raw_dev *dev)
+{
+	dev->debugfs = debugfs_create_dir(dev->driver.driver.name,
+						raw_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs, dev,
+						&raw_stats_fops);
+	debugfs_create_file("capture", 0400, dev->debugfs, dev,
+						&raw_capture_fops);
+}
+
+/*----------------------------------------------------------------------*/
+
 static struct miscdevice raw_misc_device;
 
 static int raw_open(struct inode *inode, struct file *fd)
@@ -447,6 +1654,11 @@ static int raw_release(struct inode *inode, struct file *fd)
 	unsigned long flags;
 	bool unregister = false;
 
+	raw_capture_detach(dev);
+	/* Waits for the file operations in progress on the statistics files. */
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+
 	spin_lock_irqsave(&dev->lock, flags);
 	dev->state = STATE_DEV_CLOSED;
 	if (!dev->gadget) {
@@ -458,6 +1670,9 @@ static int raw_release(struct inode *inode, struct file *fd)
 	dev->gadget_registered = false;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
+	/* Endpoint fds can outlive this one, stop their I/O first. */
+	raw_ep_io_drain(dev);
+
 	if (unregister) {
 		ret = usb_gadget_unregister_driver(&dev->driver);
 		if (ret != 0)
@@ -476,22 +1691,19 @@ out_put:
 
 /*----------------------------------------------------------------------*/
 
-static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
+static int raw_dev_init(struct raw_dev *dev, struct usb_raw_init_ext *arg)
 {
 	int ret = 0;
 	int driver_id_number;
-	struct usb_raw_init arg;
 	char *udc_driver_name;
 	char *udc_device_name;
 	char *driver_driver_name;
+	struct raw_event *events;
 	unsigned long flags;
 
-	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
-		return -EFAULT;
-
-	switch (arg.speed) {
+	switch (arg->speed) {
 	case USB_SPEED_UNKNOWN:
-		arg.speed = USB_SPEED_HIGH;
+		arg->speed = USB_SPEED_HIGH;
 		break;
 	case USB_SPEED_LOW:
 	case USB_SPEED_FULL:
@@ -502,9 +1714,20 @@ static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
 		return -EINVAL;
 	}
 
+	if (!arg->event_queue_size)
+		arg->event_queue_size = RAW_EVENT_QUEUE_SIZE;
+	if (arg->event_queue_size > USB_RAW_EVENT_QUEUE_SIZE_MAX)
+		return -EINVAL;
+
+	events = kcalloc(arg->event_queue_size, sizeof(*events), GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
 	driver_id_number = ida_alloc(&driver_id_numbers, GFP_KERNEL);
-	if (driver_id_number < 0)
-		return driver_id_number;
+	if (driver_id_number < 0) {
+		ret = driver_id_number;
+		goto out_free_events;
+	}
 
 	driver_driver_name = kmalloc(DRIVER_DRIVER_NAME_LENGTH_MAX, GFP_KERNEL);
 	if (!driver_driver_name) {
@@ -519,7 +1742,7 @@ static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
 		ret = -ENOMEM;
 		goto out_free_driver_driver_name;
 	}
-	ret = strscpy(udc_driver_name, &arg.driver_name[0],
+	ret = strscpy(udc_driver_name, &arg->driver_name[0],
 				UDC_NAME_LENGTH_MAX);
 	if (ret < 0)
 		goto out_free_udc_driver_name;
@@ -530,7 +1753,7 @@ static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
 		ret = -ENOMEM;
 		goto out_free_udc_driver_name;
 	}
-	ret = strscpy(udc_device_name, &arg.device_name[0],
+	ret = strscpy(udc_device_name, &arg->device_name[0],
 				UDC_NAME_LENGTH_MAX);
 	if (ret < 0)
 		goto out_free_udc_device_name;
@@ -545,7 +1768,7 @@ static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
 	dev->udc_name = udc_driver_name;
 
 	dev->driver.function = DRIVER_DESC;
-	dev->driver.max_speed = arg.speed;
+	dev->driver.max_speed = arg->speed;
 	dev->driver.setup = gadget_setup;
 	dev->driver.disconnect = gadget_disconnect;
 	dev->driver.bind = gadget_bind;
@@ -557,9 +1780,15 @@ static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
 	dev->driver.udc_name = udc_device_name;
 	dev->driver.match_existing_only = 1;
 	dev->driver_id_number = driver_id_number;
+	/* No events can be queued before the gadget driver is registered. */
+	dev->queue.events = events;
+	dev->queue.capacity = arg->event_queue_size;
 
 	dev->state = STATE_DEV_INITIALIZED;
 	spin_unlock_irqrestore(&dev->lock, flags);
+
+	/* Only one init ioctl can get here, the state is checked above. */
+	raw_debugfs_init_dev(dev);
 	return ret;
 
 out_unlock:
@@ -572,9 +1801,39 @@ out_free_driver_driver_name:
 	kfree(driver_driver_name);
 out_free_driver_id_number:
 	ida_free(&driver_id_numbers, driver_id_number);
+out_free_events:
+	kfree(events);
 	return ret;
 }
 
+static int raw_ioctl_init(struct raw_dev *dev, unsigned long value)
+{
+	struct usb_raw_init arg;
+	struct usb_raw_init_ext arg_ext;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+
+	memset(&arg_ext, 0, sizeof(arg_ext));
+	memcpy(&arg_ext.driver_name[0], &arg.driver_name[0],
+					sizeof(arg.driver_name));
+	memcpy(&arg_ext.device_name[0], &arg.device_name[0],
+					sizeof(arg.device_name));
+	arg_ext.speed = arg.speed;
+	return raw_dev_init(dev, &arg_ext);
+}
+
+static int raw_ioctl_init_ext(struct raw_dev *dev, unsigned long value)
+{
+	struct usb_raw_init_ext arg;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	return raw_dev_init(dev, &arg);
+}
+
 static int raw_ioctl_run(struct raw_dev *dev, unsigned long value)
 {
 	int ret = 0;
@@ -602,7 +1861,8 @@ static int raw_ioctl_run(struct raw_dev *dev, unsigned long value)
 		goto out_unlock;
 	}
 	dev->gadget_registered = true;
-	dev->state = STATE_DEV_RUNNING;
+	/* Pairs with smp_load_acquire() in raw_check_running(). */
+	smp_store_release(&dev->state, STATE_DEV_RUNNING);
 	/* Matches kref_put() in raw_release(). */
 	kref_get(&dev->count);
 
@@ -613,90 +1873,168 @@ out_unlock:
 
 static int raw_ioctl_event_fetch(struct raw_dev *dev, unsigned long value)
 {
+	int ret;
 	struct usb_raw_event arg;
-	unsigned long flags;
-	struct usb_raw_event *event;
+	struct raw_event event;
 	uint32_t length;
 
+	BUILD_BUG_ON(offsetof(struct raw_event, data) !=
+					sizeof(struct usb_raw_event));
+
 	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
 		return -EFAULT;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
-		dev_dbg(dev->dev, "fail, device is not running\n");
-		spin_unlock_irqrestore(&dev->lock, flags);
-		return -EINVAL;
-	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		spin_unlock_irqrestore(&dev->lock, flags);
-		return -EBUSY;
-	}
-	spin_unlock_irqrestore(&dev->lock, flags);
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
 
-	event = raw_event_queue_fetch(&dev->queue);
-	if (PTR_ERR(event) == -EINTR) {
+	ret = raw_event_queue_fetch(&dev->queue, &event);
+	if (ret == -EINTR) {
 		dev_dbg(&dev->gadget->dev, "event fetching interrupted\n");
 		return -EINTR;
 	}
-	if (IS_ERR(event)) {
+	if (ret) {
 		dev_err(&dev->gadget->dev, "failed to fetch event\n");
-		spin_lock_irqsave(&dev->lock, flags);
-		dev->state = STATE_DEV_FAILED;
-		spin_unlock_irqrestore(&dev->lock, flags);
+		raw_set_failed(dev);
 		return -ENODEV;
 	}
-	length = min(arg.length, event->length);
-	if (copy_to_user((void __user *)value, event, sizeof(*event) + length)) {
-		kfree(event);
+	trace_raw_gadget_event_fetch(dev->driver_id_number, event.type,
+							event.length, 0);
+	length = min(arg.length, event.length);
+	if (copy_to_user((void __user *)value, &event,
+				sizeof(struct usb_raw_event) + length))
 		return -EFAULT;
-	}
 
-	kfree(event);
 	return 0;
 }
 
-static void *raw_alloc_io_data(struct usb_raw_ep_io *io, void __user *ptr,
-				bool get_from_user)
+static int raw_ioctl_events_fetch(struct raw_dev *dev, unsigned long value)
 {
-	void *data;
+	int ret;
+	struct usb_raw_events arg;
+	struct raw_event *events;
+	u32 count;
+	unsigned long left;
+	int i, copied;
 
-	if (copy_from_user(io, ptr, sizeof(*io)))
-		return ERR_PTR(-EFAULT);
-	if (io->ep >= USB_RAW_EPS_NUM_MAX)
-		return ERR_PTR(-EINVAL);
-	if (!usb_raw_io_flags_valid(io->flags))
-		return ERR_PTR(-EINVAL);
-	if (io->length > PAGE_SIZE)
-		return ERR_PTR(-EINVAL);
-	if (get_from_user)
-		data = memdup_user(ptr + sizeof(*io), io->length);
-	else {
-		data = kmalloc(io->length, GFP_KERNEL);
-		if (!data)
-			data = ERR_PTR(-ENOMEM);
-	}
-	return data;
-}
+	BUILD_BUG_ON(sizeof(struct raw_event) !=
+				sizeof(struct usb_raw_event_entry));
 
-static int raw_process_ep0_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~USB_RAW_EVENTS_FLAGS_MASK)
+		return -EINVAL;
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	count = min_t(u32, arg.count, dev->queue.capacity);
+
+	if (!count)
+		return 0;
+	events = kmalloc_array(count, sizeof(*events), GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
+	ret = raw_event_queue_fetch_many(&dev->queue, events, count,
+				arg.flags & USB_RAW_EVENTS_FLAGS_NONBLOCK);
+	if (ret == -EINTR) {
+		dev_dbg(&dev->gadget->dev, "event fetching interrupted\n");
+		goto out_free;
+	}
+	if (ret < 0) {
+		dev_err(&dev->gadget->dev, "failed to fetch events\n");
+		raw_set_failed(dev);
+		ret = -ENODEV;
+		goto out_free;
+	}
+	/* Events that don't make it to userspace stay queued. */
+	left = copy_to_user((void __user *)(value + sizeof(arg)), events,
+					ret * sizeof(*events));
+	copied = ret - DIV_ROUND_UP(left, sizeof(*events));
+	raw_event_queue_return(&dev->queue, events, ret, copied);
+	for (i = 0; i < copied; i++)
+		trace_raw_gadget_event_fetch(dev->driver_id_number,
+					events[i].type, events[i].length, 0);
+	ret = copied ? copied : -EFAULT;
+
+out_free:
+	kfree(events);
+	return ret;
+}
+
+static int raw_get_io(struct usb_raw_ep_io *io, void __user *ptr)
+{
+	if (copy_from_user(io, ptr, sizeof(*io)))
+		return -EFAULT;
+	if (io->ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (!usb_raw_io_flags_valid(io->flags))
+		return -EINVAL;
+	if (io->length > PAGE_SIZE)
+		return -EINVAL;
+	return 0;
+}
+
+static void *raw_alloc_io_buf(struct usb_raw_ep_io *io, void __user *ptr,
+				bool get_from_user)
+{
+	void *data;
+
+	if (get_from_user)
+		data = memdup_user(ptr + sizeof(*io), io->length);
+	else {
+		data = kmalloc(io->length, GFP_KERNEL);
+		if (!data)
+			data = ERR_PTR(-ENOMEM);
+	}
+	return data;
+}
+
+static void *raw_alloc_io_data(struct usb_raw_ep_io *io, void __user *ptr,
+				bool get_from_user)
+{
+	int ret;
+
+	ret = raw_get_io(io, ptr);
+	if (ret)
+		return ERR_PTR(ret);
+	return raw_alloc_io_buf(io, ptr, get_from_user);
+}
+
+/*
+ * Waits for a synchronous transfer to complete, for at most timeout
+ * milliseconds unless it's 0. Returns 0 if the transfer completed,
+ * -ETIMEDOUT or -ERESTARTSYS otherwise.
+ */
+static int raw_wait_done(struct completion *done, u32 timeout)
+{
+	long ret;
+
+	if (!timeout)
+		return wait_for_completion_interruptible(done);
+	ret = wait_for_completion_interruptible_timeout(done,
+						msecs_to_jiffies(timeout));
+	if (ret > 0)
+		return 0;
+	return ret ? ret : -ETIMEDOUT;
+}
+
+static int raw_process_ep0_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
 				void *data, bool in)
 {
 	int ret = 0;
 	unsigned long flags;
+	bool failed = false;
+	ktime_t start;
+	u32 timeout;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
-		dev_dbg(dev->dev, "fail, device is not running\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		ret = -EBUSY;
-		goto out_unlock;
-	}
-	if (dev->ep0_urb_queued) {
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	if (dev->ep0_urb_queued || dev->ep0_cancelling) {
 		dev_dbg(&dev->gadget->dev, "fail, urb already queued\n");
 		ret = -EBUSY;
 		goto out_unlock;
@@ -709,12 +2047,12 @@ static int raw_process_ep0_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
 	}
 	if (WARN_ON(in && dev->ep0_out_pending)) {
 		ret = -ENODEV;
-		dev->state = STATE_DEV_FAILED;
+		failed = true;
 		goto out_unlock;
 	}
 	if (WARN_ON(!in && dev->ep0_in_pending)) {
 		ret = -ENODEV;
-		dev->state = STATE_DEV_FAILED;
+		failed = true;
 		goto out_unlock;
 	}
 
@@ -722,35 +2060,51 @@ static int raw_process_ep0_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
 	dev->req->length = io->length;
 	dev->req->zero = usb_raw_io_flags_zero(io->flags);
 	dev->ep0_urb_queued = true;
-	spin_unlock_irqrestore(&dev->lock, flags);
+	dev->ep0_queued = ktime_get();
+	timeout = dev->ep0_timeout;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
 
+	raw_trace_queue(dev, dev->gadget->ep0, dev->req);
 	ret = usb_ep_queue(dev->gadget->ep0, dev->req, GFP_KERNEL);
 	if (ret) {
 		dev_err(&dev->gadget->dev,
 				"fail, usb_ep_queue returned %d\n", ret);
-		spin_lock_irqsave(&dev->lock, flags);
+		spin_lock_irqsave(&dev->ep0_lock, flags);
 		goto out_queue_failed;
 	}
 
-	ret = wait_for_completion_interruptible(&dev->ep0_done);
+	start = ktime_get();
+	ret = raw_wait_done(&dev->ep0_done, timeout);
+	raw_stats_wait(&dev->stats->ep0, start);
 	if (ret) {
-		dev_dbg(&dev->gadget->dev, "wait interrupted\n");
+		dev_dbg(&dev->gadget->dev, ret == -ETIMEDOUT ?
+				"wait timed out\n" : "wait interrupted\n");
+		trace_raw_gadget_ep_dequeue(dev->driver_id_number,
+						dev->gadget->ep0, dev->req);
 		usb_ep_dequeue(dev->gadget->ep0, dev->req);
 		wait_for_completion(&dev->ep0_done);
-		spin_lock_irqsave(&dev->lock, flags);
+		if (ret != -ETIMEDOUT)
+			ret = -EINTR;
+		spin_lock_irqsave(&dev->ep0_lock, flags);
 		if (dev->ep0_status == -ECONNRESET)
-			dev->ep0_status = -EINTR;
+			dev->ep0_status = ret;
 		goto out_interrupted;
 	}
 
-	spin_lock_irqsave(&dev->lock, flags);
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	if (dev->ep0_cancelled && dev->ep0_status == -ECONNRESET)
+		dev->ep0_status = -ECANCELED;
 
 out_interrupted:
 	ret = dev->ep0_status;
 out_queue_failed:
 	dev->ep0_urb_queued = false;
+	dev->ep0_cancelled = false;
 out_unlock:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+	/* ep0_lock and dev->lock are never nested. */
+	if (failed)
+		raw_set_failed(dev);
 	return ret;
 }
 
@@ -799,17 +2153,11 @@ static int raw_ioctl_ep0_stall(struct raw_dev *dev, unsigned long value)
 
 	if (value)
 		return -EINVAL;
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
-		dev_dbg(dev->dev, "fail, device is not running\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		ret = -EBUSY;
-		goto out_unlock;
-	}
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&dev->ep0_lock, flags);
 	if (dev->ep0_urb_queued) {
 		dev_dbg(&dev->gadget->dev, "fail, urb already queued\n");
 		ret = -EBUSY;
@@ -832,21 +2180,53 @@ static int raw_ioctl_ep0_stall(struct raw_dev *dev, unsigned long value)
 		dev->ep0_out_pending = false;
 
 out_unlock:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
 	return ret;
 }
 
-static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
+/* Must be called with ep->lock held. */
+static int raw_ep_pool_attach(struct raw_ep *ep, struct list_head *pool,
+				u32 buf_len)
+{
+	struct raw_ep_req *r_req;
+
+	list_for_each_entry(r_req, pool, entry) {
+		r_req->req = usb_ep_alloc_request(ep->ep, GFP_ATOMIC);
+		if (!r_req->req)
+			return -ENOMEM;
+		r_req->ep = ep;
+		r_req->pool_gen = ep->pool_gen;
+		r_req->req->buf = r_req->buf;
+	}
+	list_splice_init(pool, &ep->reqs_free);
+	ep->pool_buf_len = buf_len;
+	return 0;
+}
+
+/*
+ * Returns the number of bulk streams the endpoint was enabled with, or 0 if
+ * the endpoint doesn't use streams. Must be called with ep->lock held.
+ */
+static int raw_ep_num_streams(struct raw_ep *ep)
+{
+	if (!usb_endpoint_xfer_bulk(ep->ep->desc))
+		return 0;
+	return usb_ss_max_streams(ep->ep->comp_desc);
+}
+
+/* Takes ownership of desc and comp_desc. */
+static int raw_ep_enable(struct raw_dev *dev,
+			struct usb_endpoint_descriptor *desc,
+			struct usb_ss_ep_comp_descriptor *comp_desc,
+			u32 pool_size, u32 pool_buf_len)
 {
 	int ret = 0, i;
 	unsigned long flags;
-	struct usb_endpoint_descriptor *desc;
 	struct raw_ep *ep;
+	struct raw_ep_req *r_req;
+	struct usb_ep *pool_ep = NULL;
 	bool ep_props_matched = false;
-
-	desc = memdup_user((void __user *)value, sizeof(*desc));
-	if (IS_ERR(desc))
-		return PTR_ERR(desc);
+	LIST_HEAD(pool);
 
 	/*
 	 * Endpoints with a maxpacket length of 0 can cause crashes in UDC
@@ -854,10 +2234,27 @@ static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
 	 */
 	if (usb_endpoint_maxp(desc) == 0) {
 		dev_dbg(dev->dev, "fail, bad endpoint maxpacket\n");
+		kfree(comp_desc);
 		kfree(desc);
 		return -EINVAL;
 	}
 
+	/* USB requests can only be allocated once the endpoint is known. */
+	for (i = 0; i < pool_size; i++) {
+		r_req = kzalloc(sizeof(*r_req), GFP_KERNEL);
+		if (!r_req) {
+			ret = -ENOMEM;
+			goto out_free_pool;
+		}
+		list_add_tail(&r_req->entry, &pool);
+		r_req->pooled = true;
+		r_req->buf = kmalloc(pool_buf_len, GFP_KERNEL);
+		if (!r_req->buf) {
+			ret = -ENOMEM;
+			goto out_free_pool;
+		}
+	}
+
 	spin_lock_irqsave(&dev->lock, flags);
 	if (dev->state != STATE_DEV_RUNNING) {
 		dev_dbg(dev->dev, "fail, device is not running\n");
@@ -875,16 +2272,22 @@ static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
 		if (ep->addr != usb_endpoint_num(desc) &&
 				ep->addr != USB_RAW_EP_ADDR_ANY)
 			continue;
-		if (!usb_gadget_ep_match_desc(dev->gadget, ep->ep, desc, NULL))
+		if (!usb_gadget_ep_match_desc(dev->gadget, ep->ep, desc,
+								comp_desc))
 			continue;
 		ep_props_matched = true;
-		if (ep->state != STATE_EP_DISABLED)
+		spin_lock(&ep->lock);
+		if (ep->state != STATE_EP_DISABLED) {
+			spin_unlock(&ep->lock);
 			continue;
+		}
 		ep->ep->desc = desc;
+		ep->ep->comp_desc = comp_desc;
 		ret = usb_ep_enable(ep->ep);
 		if (ret < 0) {
 			dev_err(&dev->gadget->dev,
 				"fail, usb_ep_enable returned %d\n", ret);
+			spin_unlock(&ep->lock);
 			goto out_free;
 		}
 		ep->req = usb_ep_alloc_request(ep->ep, GFP_ATOMIC);
@@ -892,11 +2295,23 @@ static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
 			dev_err(&dev->gadget->dev,
 				"fail, usb_ep_alloc_request failed\n");
 			usb_ep_disable(ep->ep);
+			spin_unlock(&ep->lock);
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		if (raw_ep_pool_attach(ep, &pool, pool_buf_len)) {
+			dev_err(&dev->gadget->dev,
+				"fail, usb_ep_alloc_request failed\n");
+			usb_ep_free_request(ep->ep, ep->req);
+			usb_ep_disable(ep->ep);
+			spin_unlock(&ep->lock);
+			pool_ep = ep->ep;
 			ret = -ENOMEM;
 			goto out_free;
 		}
 		ep->state = STATE_EP_ENABLED;
 		ep->ep->driver_data = ep;
+		spin_unlock(&ep->lock);
 		ret = i;
 		goto out_unlock;
 	}
@@ -910,88 +2325,149 @@ static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
 	}
 
 out_free:
+	kfree(comp_desc);
 	kfree(desc);
 out_unlock:
 	spin_unlock_irqrestore(&dev->lock, flags);
+	/* The pool is only left here if enabling the endpoint failed. */
+	raw_ep_pool_free(&pool, pool_ep);
+	return ret;
+
+out_free_pool:
+	raw_ep_pool_free(&pool, NULL);
+	kfree(comp_desc);
+	kfree(desc);
 	return ret;
 }
 
-static int raw_ioctl_ep_disable(struct raw_dev *dev, unsigned long value)
+static int raw_ioctl_ep_enable(struct raw_dev *dev, unsigned long value)
 {
-	int ret = 0, i = value;
-	unsigned long flags;
+	struct usb_endpoint_descriptor *desc;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
-		dev_dbg(dev->dev, "fail, device is not running\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		ret = -EBUSY;
-		goto out_unlock;
+	desc = memdup_user((void __user *)value, sizeof(*desc));
+	if (IS_ERR(desc))
+		return PTR_ERR(desc);
+	return raw_ep_enable(dev, desc, NULL, 0, 0);
+}
+
+static int raw_ioctl_ep_enable_ext(struct raw_dev *dev, unsigned long value)
+{
+	struct usb_raw_ep_enable_ext arg;
+	struct usb_endpoint_descriptor *desc;
+	struct usb_ss_ep_comp_descriptor *comp_desc = NULL;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if ((arg.flags & ~USB_RAW_EP_ENABLE_FLAGS_MASK) || arg.reserved)
+		return -EINVAL;
+	if (arg.pool_size > USB_RAW_EP_SUBMIT_MAX ||
+			arg.pool_buf_len > PAGE_SIZE)
+		return -EINVAL;
+	if (arg.flags & USB_RAW_EP_ENABLE_FLAGS_SS_COMP) {
+		if (arg.comp_desc.bDescriptorType != USB_DT_SS_ENDPOINT_COMP)
+			return -EINVAL;
+		comp_desc = kmemdup(&arg.comp_desc, sizeof(*comp_desc),
+								GFP_KERNEL);
+		if (!comp_desc)
+			return -ENOMEM;
 	}
-	if (i < 0 || i >= dev->eps_num) {
-		dev_dbg(dev->dev, "fail, invalid endpoint\n");
-		ret = -EBUSY;
-		goto out_unlock;
+	desc = kmemdup(&arg.desc, sizeof(*desc), GFP_KERNEL);
+	if (!desc) {
+		kfree(comp_desc);
+		return -ENOMEM;
 	}
-	if (dev->eps[i].state == STATE_EP_DISABLED) {
-		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+	return raw_ep_enable(dev, desc, comp_desc, arg.pool_size,
+							arg.pool_buf_len);
+}
+
+static int raw_ep_disable(struct raw_ep *ep)
+{
+	int ret = 0;
+	unsigned long flags;
+	LIST_HEAD(pool);
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state == STATE_EP_DISABLED) {
+		dev_dbg(&ep->dev->gadget->dev,
+				"fail, endpoint is not enabled\n");
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	if (dev->eps[i].disabling) {
-		dev_dbg(&dev->gadget->dev,
+	if (ep->disabling) {
+		dev_dbg(&ep->dev->gadget->dev,
 				"fail, disable already in progress\n");
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	if (dev->eps[i].urb_queued) {
-		dev_dbg(&dev->gadget->dev,
+	if (ep->urb_queued || ep->cancelling) {
+		dev_dbg(&ep->dev->gadget->dev,
 				"fail, waiting for urb completion\n");
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	dev->eps[i].disabling = true;
-	spin_unlock_irqrestore(&dev->lock, flags);
-
-	usb_ep_disable(dev->eps[i].ep);
-
-	spin_lock_irqsave(&dev->lock, flags);
-	usb_ep_free_request(dev->eps[i].ep, dev->eps[i].req);
-	kfree(dev->eps[i].ep->desc);
-	dev->eps[i].state = STATE_EP_DISABLED;
-	dev->eps[i].disabling = false;
+	ep->disabling = true;
+	/* Let usb_ep_disable() cancel the stream for good. */
+	ep->streaming = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	usb_ep_disable(ep->ep);
+
+	spin_lock_irqsave(&ep->lock, flags);
+	usb_ep_free_request(ep->ep, ep->req);
+	kfree(ep->ep->comp_desc);
+	ep->ep->comp_desc = NULL;
+	kfree(ep->ep->desc);
+	/* Pooled requests that are still in use are freed once reaped. */
+	list_splice_init(&ep->reqs_free, &pool);
+	ep->pool_buf_len = 0;
+	ep->pool_gen++;
+	ep->coalesce_count = 0;
+	ep->coalesce_usecs = 0;
+	ep->coalesce_pending = 0;
+	ep->timeout = 0;
+	ep->state = STATE_EP_DISABLED;
+	ep->disabling = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	hrtimer_cancel(&ep->coalesce_timer);
+	wake_up(&ep->reqs_wait);
+	raw_ep_pool_free(&pool, ep->ep);
+	return ret;
 
 out_unlock:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&ep->lock, flags);
 	return ret;
 }
 
+static int raw_ioctl_ep_disable(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0, i = value;
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (i < 0 || i >= dev->eps_num) {
+		dev_dbg(dev->dev, "fail, invalid endpoint\n");
+		return -EBUSY;
+	}
+	return raw_ep_disable(&dev->eps[i]);
+}
+
 static int raw_ioctl_ep_set_clear_halt_wedge(struct raw_dev *dev,
 		unsigned long value, bool set, bool halt)
 {
 	int ret = 0, i = value;
 	unsigned long flags;
 
-	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
-		dev_dbg(dev->dev, "fail, device is not running\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		ret = -EBUSY;
-		goto out_unlock;
-	}
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
 	if (i < 0 || i >= dev->eps_num) {
 		dev_dbg(dev->dev, "fail, invalid endpoint\n");
-		ret = -EBUSY;
-		goto out_unlock;
+		return -EBUSY;
 	}
+
+	spin_lock_irqsave(&dev->eps[i].lock, flags);
 	if (dev->eps[i].state == STATE_EP_DISABLED) {
 		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
 		ret = -EINVAL;
@@ -1003,181 +2479,2078 @@ static int raw_ioctl_ep_set_clear_halt_wedge(struct raw_dev *dev,
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	if (dev->eps[i].urb_queued) {
+	if (dev->eps[i].urb_queued ||
+			!list_empty(&dev->eps[i].reqs_pending) ||
+			!list_empty(&dev->eps[i].reqs_ring) ||
+			!list_empty(&dev->eps[i].reqs_stream)) {
 		dev_dbg(&dev->gadget->dev,
 				"fail, waiting for urb completion\n");
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	if (usb_endpoint_xfer_isoc(dev->eps[i].ep->desc)) {
-		dev_dbg(&dev->gadget->dev,
-				"fail, can't halt/wedge ISO endpoint\n");
-		ret = -EINVAL;
-		goto out_unlock;
+	if (usb_endpoint_xfer_isoc(dev->eps[i].ep->desc)) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, can't halt/wedge ISO endpoint\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	if (set && halt) {
+		ret = usb_ep_set_halt(dev->eps[i].ep);
+		if (ret < 0)
+			dev_err(&dev->gadget->dev,
+				"fail, usb_ep_set_halt returned %d\n", ret);
+	} else if (!set && halt) {
+		ret = usb_ep_clear_halt(dev->eps[i].ep);
+		if (ret < 0)
+			dev_err(&dev->gadget->dev,
+				"fail, usb_ep_clear_halt returned %d\n", ret);
+	} else if (set && !halt) {
+		ret = usb_ep_set_wedge(dev->eps[i].ep);
+		if (ret < 0)
+			dev_err(&dev->gadget->dev,
+				"fail, usb_ep_set_wedge returned %d\n", ret);
+	}
+
+out_unlock:
+	spin_unlock_irqrestore(&dev->eps[i].lock, flags);
+	return ret;
+}
+
+static void gadget_ep_complete(struct usb_ep *ep, struct usb_request *req)
+{
+	struct raw_ep *r_ep = (struct raw_ep *)ep->driver_data;
+	unsigned long flags;
+
+	raw_trace_complete(r_ep->dev, ep, req);
+	spin_lock_irqsave(&r_ep->lock, flags);
+	raw_stats_account(raw_ep_stats(r_ep), req, r_ep->queued);
+	if (req->status)
+		r_ep->status = req->status;
+	else
+		r_ep->status = req->actual;
+	spin_unlock_irqrestore(&r_ep->lock, flags);
+
+	complete((struct completion *)req->context);
+}
+
+/* Transfers data either from/to the data buffer or the sgt scatterlist. */
+static int raw_process_ep_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
+				void *data, struct sg_table *sgt, bool in)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct raw_ep *ep;
+	ktime_t start;
+	u32 timeout;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (io->ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[io->ep];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state != STATE_EP_ENABLED) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (ep->disabling) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, endpoint is already being disabled\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (ep->urb_queued || ep->cancelling) {
+		dev_dbg(&dev->gadget->dev, "fail, urb already queued\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (ep->reqs_num) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, submitted requests not reaped\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (in != usb_endpoint_dir_in(ep->ep->desc)) {
+		dev_dbg(&dev->gadget->dev, "fail, wrong direction\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (raw_ep_num_streams(ep)) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, endpoint needs a stream ID\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	ep->req->context = &done;
+	ep->req->complete = gadget_ep_complete;
+	ep->req->buf = data;
+	ep->req->sg = sgt ? sgt->sgl : NULL;
+	ep->req->num_sgs = sgt ? sgt->nents : 0;
+	ep->req->length = io->length;
+	ep->req->zero = usb_raw_io_flags_zero(io->flags);
+	ep->urb_queued = true;
+	ep->queued = ktime_get();
+	timeout = ep->timeout;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	raw_trace_queue(dev, ep->ep, ep->req);
+	ret = usb_ep_queue(ep->ep, ep->req, GFP_KERNEL);
+	if (ret) {
+		dev_err(&dev->gadget->dev,
+				"fail, usb_ep_queue returned %d\n", ret);
+		spin_lock_irqsave(&ep->lock, flags);
+		goto out_queue_failed;
+	}
+
+	start = ktime_get();
+	ret = raw_wait_done(&done, timeout);
+	raw_stats_wait(raw_ep_stats(ep), start);
+	if (ret) {
+		dev_dbg(&dev->gadget->dev, ret == -ETIMEDOUT ?
+				"wait timed out\n" : "wait interrupted\n");
+		trace_raw_gadget_ep_dequeue(dev->driver_id_number, ep->ep,
+								ep->req);
+		usb_ep_dequeue(ep->ep, ep->req);
+		wait_for_completion(&done);
+		if (ret != -ETIMEDOUT)
+			ret = -EINTR;
+		spin_lock_irqsave(&ep->lock, flags);
+		if (ep->status == -ECONNRESET)
+			ep->status = ret;
+		goto out_interrupted;
+	}
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->cancelled && ep->status == -ECONNRESET)
+		ep->status = -ECANCELED;
+
+out_interrupted:
+	ret = ep->status;
+out_queue_failed:
+	ep->urb_queued = false;
+	ep->cancelled = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	/* Wakes up poll() on the endpoint file descriptor. */
+	wake_up(&ep->reqs_wait);
+	return ret;
+
+out_unlock:
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return ret;
+}
+
+/*
+ * Same as raw_alloc_io_data(), but borrows the buffer of a pooled request
+ * instead of allocating one if the endpoint has a request pool.
+ */
+static void *raw_alloc_ep_io_data(struct raw_dev *dev, struct usb_raw_ep_io *io,
+			void __user *ptr, bool get_from_user,
+			struct raw_ep_req **pooled)
+{
+	struct raw_ep *ep;
+	unsigned long flags;
+	int ret;
+
+	*pooled = NULL;
+	ret = raw_get_io(io, ptr);
+	if (ret)
+		return ERR_PTR(ret);
+	/* Pairs with smp_store_release() in raw_ioctl_run(). */
+	if (smp_load_acquire(&dev->state) == STATE_DEV_RUNNING &&
+					io->ep < dev->eps_num) {
+		ep = &dev->eps[io->ep];
+		spin_lock_irqsave(&ep->lock, flags);
+		*pooled = raw_ep_pool_get(ep, io->length);
+		spin_unlock_irqrestore(&ep->lock, flags);
+	}
+	if (!*pooled)
+		return raw_alloc_io_buf(io, ptr, get_from_user);
+	if (get_from_user && copy_from_user((*pooled)->buf,
+					ptr + sizeof(*io), io->length)) {
+		raw_ep_req_release(&dev->eps[io->ep], *pooled);
+		return ERR_PTR(-EFAULT);
+	}
+	return (*pooled)->buf;
+}
+
+static void raw_free_ep_io_data(struct raw_dev *dev, struct usb_raw_ep_io *io,
+				void *data, struct raw_ep_req *pooled)
+{
+	if (pooled)
+		raw_ep_req_release(&dev->eps[io->ep], pooled);
+	else
+		kfree(data);
+}
+
+static int raw_ioctl_ep_write(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	char *data;
+	struct usb_raw_ep_io io;
+	struct raw_ep_req *pooled;
+
+	data = raw_alloc_ep_io_data(dev, &io, (void __user *)value, true,
+								&pooled);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	ret = raw_process_ep_io(dev, &io, data, NULL, true);
+	raw_free_ep_io_data(dev, &io, data, pooled);
+	return ret;
+}
+
+static int raw_ioctl_ep_read(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	char *data;
+	struct usb_raw_ep_io io;
+	struct raw_ep_req *pooled;
+	unsigned int length;
+
+	data = raw_alloc_ep_io_data(dev, &io, (void __user *)value, false,
+								&pooled);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+	ret = raw_process_ep_io(dev, &io, data, NULL, false);
+	if (ret < 0)
+		goto free;
+
+	length = min(io.length, (unsigned int)ret);
+	if (copy_to_user((void __user *)(value + sizeof(io)), data, length))
+		ret = -EFAULT;
+	else
+		ret = length;
+free:
+	raw_free_ep_io_data(dev, &io, data, pooled);
+	return ret;
+}
+
+/* Size of the bounce buffer for vectored transfers without scatter-gather. */
+#define RAW_EP_IOV_CHUNK_SIZE	(16 * 1024)
+
+/* User pages backing the buffers of a vectored transfer. */
+struct raw_ep_iov_sg {
+	struct sg_table		sgt;
+	struct page		**pages;
+	unsigned int		npages;
+	bool			pinned;
+};
+
+static void raw_ep_iov_sg_free(struct raw_ep_iov_sg *iov_sg, bool in)
+{
+	/* Pages receiving data of OUT transfers need to be dirtied. */
+	if (iov_sg->pinned)
+		unpin_user_pages_dirty_lock(iov_sg->pages, iov_sg->npages, !in);
+	sg_free_table(&iov_sg->sgt);
+	kvfree(iov_sg->pages);
+}
+
+static int raw_ep_iov_sg_alloc(struct raw_ep_iov_sg *iov_sg,
+				struct iov_iter *iter)
+{
+	struct scatterlist *sg, *last = NULL;
+	struct page **pages;
+	unsigned int max, nents = 0;
+	size_t offset, length;
+	ssize_t extracted;
+	int ret;
+
+	memset(iov_sg, 0, sizeof(*iov_sg));
+	max = iov_iter_npages(iter, INT_MAX);
+	iov_sg->pages = kvmalloc_array(max, sizeof(*pages), GFP_KERNEL);
+	if (!iov_sg->pages)
+		return -ENOMEM;
+	ret = sg_alloc_table(&iov_sg->sgt, max, GFP_KERNEL);
+	if (ret) {
+		kvfree(iov_sg->pages);
+		return ret;
+	}
+	iov_sg->pinned = iov_iter_extract_will_pin(iter);
+
+	sg = iov_sg->sgt.sgl;
+	while (iov_iter_count(iter)) {
+		pages = iov_sg->pages + iov_sg->npages;
+		extracted = iov_iter_extract_pages(iter, &pages,
+				iov_iter_count(iter), max - iov_sg->npages,
+				0, &offset);
+		if (extracted <= 0) {
+			raw_ep_iov_sg_free(iov_sg, true);
+			return extracted ? extracted : -EFAULT;
+		}
+		while (extracted) {
+			length = min_t(size_t, extracted, PAGE_SIZE - offset);
+			sg_set_page(sg, iov_sg->pages[iov_sg->npages++],
+							length, offset);
+			last = sg;
+			sg = sg_next(sg);
+			nents++;
+			extracted -= length;
+			offset = 0;
+		}
+	}
+	sg_mark_end(last);
+	iov_sg->sgt.nents = nents;
+	return 0;
+}
+
+/*
+ * Splits a vectored transfer into requests of up to RAW_EP_IOV_CHUNK_SIZE
+ * bytes, which is a multiple of any maxpacket, copied through a bounce buffer.
+ */
+static int raw_process_ep_iov_chunked(struct raw_dev *dev,
+		struct usb_raw_ep_io *io, struct iov_iter *iter, bool in)
+{
+	struct usb_raw_ep_io chunk = *io;
+	u32 done = 0;
+	void *data;
+	int ret;
+
+	data = kmalloc(min_t(u32, io->length, RAW_EP_IOV_CHUNK_SIZE),
+								GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	do {
+		chunk.length = min_t(u32, io->length - done,
+						RAW_EP_IOV_CHUNK_SIZE);
+		/* Only the last request may need to end with a ZLP. */
+		chunk.flags = done + chunk.length == io->length ? io->flags : 0;
+		if (in && !copy_from_iter_full(data, chunk.length, iter)) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = raw_process_ep_io(dev, &chunk, data, NULL, in);
+		if (ret < 0)
+			break;
+		if (!in && copy_to_iter(data, ret, iter) != ret) {
+			ret = -EFAULT;
+			break;
+		}
+		done += ret;
+	} while (ret == chunk.length && done < io->length);
+	kfree(data);
+
+	if (done)
+		return done;
+	return ret;
+}
+
+/* Must be called after raw_check_running(). */
+static int raw_process_ep_iter(struct raw_dev *dev, struct usb_raw_ep_io *io,
+				struct iov_iter *iter, bool in)
+{
+	struct raw_ep_iov_sg iov_sg;
+	int ret;
+
+	if (!io->length || !dev->gadget->sg_supported)
+		return raw_process_ep_iov_chunked(dev, io, iter, in);
+	ret = raw_ep_iov_sg_alloc(&iov_sg, iter);
+	if (ret)
+		return ret;
+	ret = raw_process_ep_io(dev, io, NULL, &iov_sg.sgt, in);
+	raw_ep_iov_sg_free(&iov_sg, in);
+	return ret;
+}
+
+static int raw_process_ep_iov(struct raw_dev *dev, unsigned long value,
+				bool in)
+{
+	struct iovec iovstack[UIO_FASTIOV], *iov = iovstack;
+	struct usb_raw_ep_iov arg;
+	struct usb_raw_ep_io io;
+	struct iov_iter iter;
+	ssize_t length;
+	int ret;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (!usb_raw_io_flags_valid(arg.flags))
+		return -EINVAL;
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+
+	length = import_iovec(in ? ITER_SOURCE : ITER_DEST,
+			u64_to_user_ptr(arg.iov), arg.iovcnt,
+			ARRAY_SIZE(iovstack), &iov, &iter);
+	if (length < 0)
+		return length;
+	if (length > USB_RAW_EP_IOV_LEN_MAX) {
+		ret = -EINVAL;
+		goto out_free_iov;
+	}
+
+	io.ep = arg.ep;
+	io.flags = arg.flags;
+	io.length = length;
+	ret = raw_process_ep_iter(dev, &io, &iter, in);
+
+out_free_iov:
+	kfree(iov);
+	return ret;
+}
+
+static int raw_ioctl_ep_writev(struct raw_dev *dev, unsigned long value)
+{
+	return raw_process_ep_iov(dev, value, true);
+}
+
+static int raw_ioctl_ep_readv(struct raw_dev *dev, unsigned long value)
+{
+	return raw_process_ep_iov(dev, value, false);
+}
+
+/*----------------------------------------------------------------------*/
+
+/*
+ * Endpoint file descriptors returned by USB_RAW_IOCTL_EP_OPEN. Each read() or
+ * write() is one transfer, done the same way as USB_RAW_IOCTL_EP_READV/WRITEV,
+ * so spliced page cache pages are used for the transfer directly when the UDC
+ * supports scatter-gather.
+ */
+
+static ssize_t raw_ep_file_io(struct raw_ep *ep, struct iov_iter *iter,
+				bool in)
+{
+	struct raw_dev *dev = ep->dev;
+	struct usb_raw_ep_io io;
+	int ret;
+
+	ret = raw_ep_io_get(dev);
+	if (ret)
+		return ret;
+	iov_iter_truncate(iter, USB_RAW_EP_IOV_LEN_MAX);
+	io.ep = ep - &dev->eps[0];
+	io.flags = 0;
+	io.length = iov_iter_count(iter);
+	ret = raw_process_ep_iter(dev, &io, iter, in);
+	raw_ep_io_put(dev);
+	return ret;
+}
+
+static ssize_t raw_ep_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return raw_ep_file_io(iocb->ki_filp->private_data, to, false);
+}
+
+static ssize_t raw_ep_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return raw_ep_file_io(iocb->ki_filp->private_data, from, true);
+}
+
+static __poll_t raw_ep_poll(struct file *file, poll_table *wait)
+{
+	struct raw_ep *ep = file->private_data;
+	unsigned long flags;
+	__poll_t mask = 0;
+
+	poll_wait(file, &ep->reqs_wait, wait);
+
+	/* Pairs with smp_store_release() in raw_ioctl_run(). */
+	if (smp_load_acquire(&ep->dev->state) != STATE_DEV_RUNNING)
+		return EPOLLERR | EPOLLHUP;
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state != STATE_EP_ENABLED || ep->disabling)
+		mask = EPOLLERR | EPOLLHUP;
+	else if (!ep->urb_queued && !ep->reqs_num)
+		mask = usb_endpoint_dir_in(ep->ep->desc) ?
+				EPOLLOUT | EPOLLWRNORM : EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return mask;
+}
+
+static int raw_ep_release(struct inode *inode, struct file *file)
+{
+	struct raw_ep *ep = file->private_data;
+
+	/* Matches atomic_inc() in raw_ioctl_ep_open(). */
+	raw_dev_users_put(ep->dev);
+	/* Matches kref_get() in raw_ioctl_ep_open(). */
+	kref_put(&ep->dev->count, dev_free);
+	return 0;
+}
+
+static const struct file_operations raw_ep_fops = {
+	.owner =		THIS_MODULE,
+	.read_iter =		raw_ep_read_iter,
+	.write_iter =		raw_ep_write_iter,
+	.splice_read =		copy_splice_read,
+	.splice_write =		iter_file_splice_write,
+	.poll =			raw_ep_poll,
+	.release =		raw_ep_release,
+	.llseek =		no_llseek,
+};
+
+static int raw_ioctl_ep_open(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0, i = value, fd;
+	unsigned long flags;
+	struct raw_ep *ep;
+	struct file *file;
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (i < 0 || i >= dev->eps_num) {
+		dev_dbg(dev->dev, "fail, invalid endpoint\n");
+		return -EBUSY;
+	}
+	ep = &dev->eps[i];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state != STATE_EP_ENABLED) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+		ret = -EBUSY;
+	}
+	spin_unlock_irqrestore(&ep->lock, flags);
+	if (ret)
+		return ret;
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+	file = anon_inode_getfile("[raw-gadget-ep]", &raw_ep_fops, ep,
+							O_RDWR | O_CLOEXEC);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		return PTR_ERR(file);
+	}
+	/* Transfers have no file position. */
+	stream_open(file_inode(file), file);
+	/*
+	 * Keeps USB_RAW_IOCTL_REBIND from tearing down the endpoint while the
+	 * fd is open. raw_ioctl() already holds a reference, so there is no
+	 * need for the barrier in raw_dev_users_get().
+	 */
+	atomic_inc(&dev->users);
+	/* Matches kref_put() in raw_ep_release(). */
+	kref_get(&dev->count);
+	fd_install(fd, file);
+	return fd;
+}
+
+/*
+ * Must be called from the completion callback of the request, before it is
+ * published under the endpoint lock.
+ */
+static void raw_ep_req_set_frame(struct raw_ep_req *r_req)
+{
+	const struct usb_endpoint_descriptor *desc = r_req->ep->ep->desc;
+	int frame;
+
+	r_req->frame = 0;
+	/* Some UDCs clear the descriptor before cancelling requests. */
+	if (!desc || !usb_endpoint_xfer_isoc(desc))
+		return;
+	frame = usb_gadget_frame_number(r_req->ep->dev->gadget);
+	if (frame >= 0)
+		r_req->frame = frame;
+}
+
+/*
+ * Writes a completion entry unless that would leave less than reserve free
+ * entries. Must be called with ring->lock held.
+ */
+static bool raw_ring_write_cqe(struct raw_dev *dev, struct raw_ep_req *r_req,
+				u16 flags, u32 reserve)
+{
+	struct raw_ring *ring = dev->ring;
+	struct usb_raw_ep_completion *cqe;
+	u32 cq_used = ring->cq_tail - READ_ONCE(ring->hdr->cq_head);
+
+	if (cq_used >= ring->cq_entries ||
+			reserve >= ring->cq_entries - cq_used)
+		return false;
+	cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+	cqe->cookie = r_req->cookie;
+	cqe->status = r_req->req->status;
+	cqe->length = r_req->req->actual;
+	cqe->ep = r_req->ep - &dev->eps[0];
+	cqe->flags = flags;
+	cqe->frame = r_req->frame;
+	ring->cq_tail++;
+	/* Publish the entry before the new tail. */
+	smp_store_release(&ring->hdr->cq_tail, ring->cq_tail);
+	return true;
+}
+
+static void raw_ring_post(struct raw_dev *dev, struct raw_ep_req *r_req)
+{
+	struct raw_ring *ring = dev->ring;
+
+	r_req->ep->reqs_num--;
+	if (usb_raw_submit_flags_mapped(r_req->flags))
+		r_req->ep->bufs[r_req->buf_index].busy = false;
+
+	spin_lock(&ring->lock);
+	ring->inflight--;
+	/*
+	 * The number of requests in flight is limited by the free space in
+	 * the completion queue, so it only overflows if userspace moved
+	 * cq_head to a bogus value.
+	 */
+	if (!raw_ring_write_cqe(dev, r_req, r_req->flags, 0)) {
+		ring->cq_overflow++;
+		WRITE_ONCE(ring->hdr->cq_overflow, ring->cq_overflow);
+	}
+	spin_unlock(&ring->lock);
+}
+
+/* Wakes up waiters for completions of submitted and stream requests. */
+static void raw_ep_wake(struct raw_ep *ep)
+{
+	wake_up(&ep->reqs_wait);
+	raw_notify(ep->dev);
+}
+
+static enum hrtimer_restart raw_ep_coalesce_timer(struct hrtimer *t)
+{
+	struct raw_ep *ep = container_of(t, struct raw_ep, coalesce_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	ep->coalesce_pending = 0;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	raw_ep_wake(ep);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Accounts a completion with the given status for coalescing. Returns true
+ * if waiters must be woken up right away. Must be called with ep->lock held.
+ */
+static bool raw_ep_coalesce(struct raw_ep *ep, int status)
+{
+	if (ep->coalesce_count <= 1)
+		return true;
+	/* Failed requests are reported right away. */
+	if (status || ++ep->coalesce_pending >= ep->coalesce_count) {
+		ep->coalesce_pending = 0;
+		/* A racing timer only causes a spurious wakeup. */
+		hrtimer_try_to_cancel(&ep->coalesce_timer);
+		return true;
+	}
+	if (ep->coalesce_pending == 1)
+		hrtimer_start(&ep->coalesce_timer,
+				us_to_ktime(ep->coalesce_usecs),
+				HRTIMER_MODE_REL);
+	return false;
+}
+
+static void gadget_ep_submit_complete(struct usb_ep *ep,
+					struct usb_request *req)
+{
+	struct raw_ep_req *r_req = req->context;
+	struct raw_ep *r_ep = r_req->ep;
+	struct raw_dev *dev = r_ep->dev;
+	unsigned long flags;
+	bool ring = r_req->ring;
+	bool free = false;
+	bool wake;
+
+	raw_trace_complete(dev, ep, req);
+	raw_stats_account(raw_ep_stats(r_ep), req, r_req->queued);
+	raw_ep_req_set_frame(r_req);
+	spin_lock_irqsave(&r_ep->lock, flags);
+	if (ring) {
+		list_del(&r_req->entry);
+		raw_ring_post(dev, r_req);
+		free = raw_ep_req_put(r_ep, r_req);
+	} else
+		list_move_tail(&r_req->entry, &r_ep->reqs_done);
+	wake = raw_ep_coalesce(r_ep, req->status);
+	spin_unlock_irqrestore(&r_ep->lock, flags);
+
+	if (free)
+		raw_ep_req_free(r_req);
+	if (wake)
+		raw_ep_wake(r_ep);
+}
+
+/*
+ * Posts the completion of a stream request. Completions of stream requests
+ * are not accounted in ring->inflight, so they only use the free space left
+ * after the other requests in flight; they are dropped when there is none.
+ * Must be called with ep->lock held.
+ */
+static void raw_stream_post(struct raw_dev *dev, struct raw_ep_req *r_req)
+{
+	struct raw_ring *ring = dev->ring;
+	struct raw_ep *ep = r_req->ep;
+	u16 flags = r_req->flags | USB_RAW_COMPLETION_FLAGS_STREAM;
+
+	if (ep->stream_lost)
+		flags |= USB_RAW_COMPLETION_FLAGS_LOST;
+	spin_lock(&ring->lock);
+	ep->stream_lost = !raw_ring_write_cqe(dev, r_req, flags,
+							ring->inflight);
+	spin_unlock(&ring->lock);
+}
+
+/* Must be called with ep->lock held. */
+static void raw_stream_req_done(struct raw_ep *ep, struct raw_ep_req *r_req)
+{
+	list_del(&r_req->entry);
+	ep->reqs_num--;
+	ep->bufs[r_req->buf_index].busy = false;
+}
+
+static void gadget_ep_stream_complete(struct usb_ep *ep,
+					struct usb_request *req)
+{
+	struct raw_ep_req *r_req = req->context;
+	struct raw_ep *r_ep = r_req->ep;
+	struct raw_dev *dev = r_ep->dev;
+	unsigned long flags;
+	bool requeue, wake;
+	int ret;
+
+	raw_trace_complete(dev, ep, req);
+	raw_stats_account(raw_ep_stats(r_ep), req, r_req->queued);
+	raw_ep_req_set_frame(r_req);
+	spin_lock_irqsave(&r_ep->lock, flags);
+	raw_stream_post(dev, r_req);
+	requeue = r_ep->streaming && req->status != -ESHUTDOWN &&
+					req->status != -ECONNRESET;
+	if (!requeue)
+		raw_stream_req_done(r_ep, r_req);
+	wake = raw_ep_coalesce(r_ep, req->status);
+	spin_unlock_irqrestore(&r_ep->lock, flags);
+	if (wake)
+		raw_notify(dev);
+
+	if (!requeue) {
+		raw_ep_req_free(r_req);
+		return;
+	}
+	/*
+	 * The completion might be called synchronously from usb_ep_queue(),
+	 * so the request must be queued again without holding ep->lock.
+	 */
+	r_req->queued = ktime_get();
+	raw_trace_queue(dev, ep, req);
+	ret = usb_ep_queue(ep, req, GFP_ATOMIC);
+	if (!ret)
+		return;
+	dev_err(&dev->gadget->dev, "fail, usb_ep_queue returned %d\n", ret);
+	req->status = ret;
+	req->actual = 0;
+	spin_lock_irqsave(&r_ep->lock, flags);
+	raw_stream_post(dev, r_req);
+	raw_stream_req_done(r_ep, r_req);
+	spin_unlock_irqrestore(&r_ep->lock, flags);
+	raw_notify(dev);
+	raw_ep_req_free(r_req);
+}
+
+/* Must be called with ep->lock held. */
+static int raw_check_submit_ep(struct raw_dev *dev, struct raw_ep *ep)
+{
+	if (ep->state != STATE_EP_ENABLED) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+		return -EBUSY;
+	}
+	if (ep->disabling) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, endpoint is already being disabled\n");
+		return -EBUSY;
+	}
+	if (ep->urb_queued) {
+		dev_dbg(&dev->gadget->dev, "fail, urb already queued\n");
+		return -EBUSY;
+	}
+	if (ep->reqs_num >= USB_RAW_EP_SUBMIT_MAX) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, too many requests submitted\n");
+		return -EBUSY;
+	}
+	if (!list_empty(&ep->reqs_stream)) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is streaming\n");
+		return -EBUSY;
+	}
+	return 0;
+}
+
+/* Must be called with ep->lock held. */
+static void *raw_get_submit_buf(struct raw_dev *dev, struct raw_ep *ep,
+				struct usb_raw_ep_submit *arg)
+{
+	if (arg->buffer >= ep->bufs_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid buffer index\n");
+		return ERR_PTR(-EINVAL);
+	}
+	if (arg->length > ep->buf_size) {
+		dev_dbg(&dev->gadget->dev, "fail, buffer is too small\n");
+		return ERR_PTR(-EINVAL);
+	}
+	if (ep->bufs[arg->buffer].busy) {
+		dev_dbg(&dev->gadget->dev, "fail, buffer is busy\n");
+		return ERR_PTR(-EBUSY);
+	}
+	ep->bufs[arg->buffer].busy = true;
+	return ep->bufs[arg->buffer].data;
+}
+
+/* Must be called with ring->lock held. */
+static bool raw_ring_full(struct raw_ring *ring)
+{
+	u32 cq_used = ring->cq_tail - READ_ONCE(ring->hdr->cq_head);
+
+	return cq_used >= ring->cq_entries ||
+			ring->inflight >= ring->cq_entries - cq_used;
+}
+
+/*
+ * Submits a request described by p. Requests submitted with ring set post
+ * their completions to the completion ring instead of the endpoint done list.
+ */
+static int raw_ep_submit(struct raw_dev *dev, struct usb_raw_ep_submit *p,
+				bool ring)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_submit arg = *p;
+	struct raw_ep_req *r_req;
+	struct raw_ep *ep;
+	void *data = NULL;
+	bool in, mapped, full;
+	int streams;
+
+	trace_raw_gadget_ep_submit(dev->driver_id_number, &arg, ring);
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (!usb_raw_submit_flags_valid(arg.flags))
+		return -EINVAL;
+	if (arg.reserved || arg.stream_id > U16_MAX)
+		return -EINVAL;
+	mapped = usb_raw_submit_flags_mapped(arg.flags);
+	if (!mapped && arg.length > PAGE_SIZE)
+		return -EINVAL;
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	ret = raw_check_submit_ep(dev, ep);
+	if (ret) {
+		spin_unlock_irqrestore(&ep->lock, flags);
+		return ret;
+	}
+	in = usb_endpoint_dir_in(ep->ep->desc);
+	/*
+	 * Completions posted to the ring can't copy data to user, so OUT
+	 * requests submitted through the ring must use mapped buffers.
+	 */
+	if (ring && !in && !mapped) {
+		spin_unlock_irqrestore(&ep->lock, flags);
+		dev_dbg(&dev->gadget->dev,
+				"fail, ring OUT needs mapped buffer\n");
+		return -EINVAL;
+	}
+	/* Mapped requests only need a pooled request, not its buffer. */
+	r_req = raw_ep_pool_get(ep, mapped ? 0 : arg.length);
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	if (!r_req) {
+		r_req = kzalloc(sizeof(*r_req), GFP_KERNEL);
+		if (!r_req)
+			return -ENOMEM;
+	}
+	if (mapped)
+		r_req->buf_index = arg.buffer;
+	else if (r_req->pooled) {
+		data = r_req->buf;
+		if (in && copy_from_user(data, u64_to_user_ptr(arg.buffer),
+								arg.length)) {
+			raw_ep_req_release(ep, r_req);
+			return -EFAULT;
+		}
+	} else if (in)
+		data = memdup_user(u64_to_user_ptr(arg.buffer), arg.length);
+	else {
+		data = kmalloc(arg.length, GFP_KERNEL);
+		if (!data)
+			data = ERR_PTR(-ENOMEM);
+	}
+	if (IS_ERR(data)) {
+		ret = PTR_ERR(data);
+		goto out_free_r_req;
+	}
+	if (!mapped)
+		r_req->buffer = u64_to_user_ptr(arg.buffer);
+	r_req->cookie = arg.cookie;
+	r_req->flags = arg.flags;
+	r_req->in = in;
+
+	/* The endpoint might have been disabled or reenabled meanwhile. */
+	spin_lock_irqsave(&ep->lock, flags);
+	ret = raw_check_submit_ep(dev, ep);
+	if (ret)
+		goto out_unlock;
+	if (in != usb_endpoint_dir_in(ep->ep->desc)) {
+		dev_dbg(&dev->gadget->dev, "fail, wrong direction\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	streams = raw_ep_num_streams(ep);
+	if ((streams && !arg.stream_id) || arg.stream_id > streams) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid stream ID\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	/*
+	 * Ring submissions are serialized by dev->ring_lock and completions
+	 * never use up free space, so the ring can't fill up before inflight
+	 * is incremented below.
+	 */
+	if (ring) {
+		spin_lock(&dev->ring->lock);
+		full = raw_ring_full(dev->ring);
+		spin_unlock(&dev->ring->lock);
+		if (full) {
+			dev_dbg(&dev->gadget->dev,
+					"fail, completion ring is full\n");
+			ret = -EBUSY;
+			goto out_unlock;
+		}
+	}
+	if (!r_req->pooled) {
+		r_req->req = usb_ep_alloc_request(ep->ep, GFP_ATOMIC);
+		if (!r_req->req) {
+			dev_err(&dev->gadget->dev,
+					"fail, usb_ep_alloc_request failed\n");
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+	}
+	if (mapped) {
+		data = raw_get_submit_buf(dev, ep, &arg);
+		if (IS_ERR(data)) {
+			if (!r_req->pooled)
+				usb_ep_free_request(ep->ep, r_req->req);
+			ret = PTR_ERR(data);
+			data = NULL;
+			goto out_unlock;
+		}
+	}
+	r_req->ep = ep;
+	r_req->req->context = r_req;
+	r_req->req->complete = gadget_ep_submit_complete;
+	r_req->req->buf = data;
+	r_req->req->length = arg.length;
+	r_req->req->zero = usb_raw_io_flags_zero(arg.flags);
+	r_req->req->stream_id = arg.stream_id;
+	r_req->ring = ring;
+	r_req->cancelled = false;
+	if (ring) {
+		list_add_tail(&r_req->entry, &ep->reqs_ring);
+		spin_lock(&dev->ring->lock);
+		dev->ring->inflight++;
+		spin_unlock(&dev->ring->lock);
+	} else
+		list_add_tail(&r_req->entry, &ep->reqs_pending);
+	raw_ep_reqs_inc(ep, 1);
+	r_req->queued = ktime_get();
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	raw_trace_queue(dev, ep->ep, r_req->req);
+	ret = usb_ep_queue(ep->ep, r_req->req, GFP_KERNEL);
+	if (ret) {
+		dev_err(&dev->gadget->dev,
+				"fail, usb_ep_queue returned %d\n", ret);
+		spin_lock_irqsave(&ep->lock, flags);
+		list_del(&r_req->entry);
+		ep->reqs_num--;
+		if (ring) {
+			spin_lock(&dev->ring->lock);
+			dev->ring->inflight--;
+			spin_unlock(&dev->ring->lock);
+		}
+		if (mapped)
+			ep->bufs[r_req->buf_index].busy = false;
+		spin_unlock_irqrestore(&ep->lock, flags);
+		raw_ep_req_release(ep, r_req);
+	}
+	return ret;
+
+out_unlock:
+	spin_unlock_irqrestore(&ep->lock, flags);
+	if (r_req->pooled) {
+		raw_ep_req_release(ep, r_req);
+		return ret;
+	}
+	if (!mapped)
+		kfree(data);
+out_free_r_req:
+	kfree(r_req);
+	return ret;
+}
+
+static int raw_ioctl_ep_submit(struct raw_dev *dev, unsigned long value)
+{
+	struct usb_raw_ep_submit arg;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	return raw_ep_submit(dev, &arg, false);
+}
+
+static bool raw_ep_reap_ready(struct raw_ep *ep)
+{
+	unsigned long flags;
+	bool ready;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	ready = !list_empty(&ep->reqs_done) || list_empty(&ep->reqs_pending);
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return ready;
+}
+
+static int raw_ioctl_ep_reap(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_reap arg;
+	struct usb_raw_ep_completion __user *completions;
+	struct usb_raw_ep_completion completion;
+	struct raw_ep_req *r_req, *tmp;
+	struct raw_ep *ep;
+	unsigned int length;
+	LIST_HEAD(reaped);
+	LIST_HEAD(freed);
+	LIST_HEAD(unpooled);
+	u32 count = 0;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (arg.flags & ~USB_RAW_REAP_FLAGS_MASK)
+		return -EINVAL;
+	completions = (void __user *)(value + sizeof(arg));
+
+	/*
+	 * Completions can be reaped from a disabled endpoint: disabling gives
+	 * back submitted requests with -ESHUTDOWN.
+	 */
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+
+	if (!arg.count)
+		return 0;
+
+	if (!(arg.flags & USB_RAW_REAP_FLAGS_NONBLOCK)) {
+		ret = wait_event_interruptible(ep->reqs_wait,
+					raw_ep_reap_ready(ep));
+		if (ret) {
+			dev_dbg(&dev->gadget->dev, "wait interrupted\n");
+			return -EINTR;
+		}
+	}
+
+	spin_lock_irqsave(&ep->lock, flags);
+	list_for_each_entry_safe(r_req, tmp, &ep->reqs_done, entry) {
+		if (count == arg.count)
+			break;
+		list_move_tail(&r_req->entry, &reaped);
+		count++;
+	}
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	count = 0;
+	list_for_each_entry_safe(r_req, tmp, &reaped, entry) {
+		memset(&completion, 0, sizeof(completion));
+		completion.cookie = r_req->cookie;
+		completion.status = r_req->req->status;
+		completion.length = r_req->req->actual;
+		completion.ep = arg.ep;
+		completion.flags = r_req->flags;
+		completion.frame = r_req->frame;
+		if (!r_req->in && !completion.status &&
+				!usb_raw_submit_flags_mapped(r_req->flags)) {
+			length = min(r_req->req->length, r_req->req->actual);
+			if (copy_to_user(r_req->buffer, r_req->req->buf,
+								length))
+				completion.status = -EFAULT;
+		}
+		if (copy_to_user(&completions[count], &completion,
+						sizeof(completion))) {
+			ret = -EFAULT;
+			break;
+		}
+		list_move_tail(&r_req->entry, &freed);
+		count++;
+	}
+
+	spin_lock_irqsave(&ep->lock, flags);
+	/* Return completions that failed to be copied back to the queue. */
+	list_splice(&reaped, &ep->reqs_done);
+	ep->reqs_num -= count;
+	list_for_each_entry_safe(r_req, tmp, &freed, entry) {
+		list_del(&r_req->entry);
+		/*
+		 * Only now that the completion was copied out can the buffer
+		 * be submitted again.
+		 */
+		if (usb_raw_submit_flags_mapped(r_req->flags))
+			ep->bufs[r_req->buf_index].busy = false;
+		if (raw_ep_req_put(ep, r_req))
+			list_add_tail(&r_req->entry, &unpooled);
+	}
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	list_for_each_entry_safe(r_req, tmp, &unpooled, entry)
+		raw_ep_req_free(r_req);
+
+	if (count) {
+		/* Wakes up poll() on the endpoint file descriptor. */
+		wake_up(&ep->reqs_wait);
+		return count;
+	}
+	return ret;
+}
+
+static int raw_ioctl_ep_alloc_bufs(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_bufs arg;
+	struct raw_ep_buf *bufs = NULL;
+	struct raw_ep *ep;
+	u32 i, num, size;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	if (arg.count > USB_RAW_EP_SUBMIT_MAX)
+		return -EINVAL;
+	if (arg.count && (!arg.size || arg.size > USB_RAW_EP_BUF_SIZE_MAX ||
+					!PAGE_ALIGNED(arg.size)))
+		return -EINVAL;
+
+	if (arg.count) {
+		bufs = kcalloc(arg.count, sizeof(*bufs), GFP_KERNEL);
+		if (!bufs)
+			return -ENOMEM;
+	}
+	for (i = 0; i < arg.count; i++) {
+		bufs[i].data = alloc_pages_exact(arg.size,
+						GFP_KERNEL | __GFP_ZERO);
+		if (!bufs[i].data) {
+			raw_ep_bufs_free(bufs, i, arg.size);
+			return -ENOMEM;
+		}
+	}
+
+	ret = raw_check_running(dev);
+	if (ret)
+		goto out_free;
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		ret = -EINVAL;
+		goto out_free;
+	}
+	ep = &dev->eps[arg.ep];
+
+	mutex_lock(&dev->mmap_lock);
+	spin_lock_irqsave(&ep->lock, flags);
+	for (i = 0; i < ep->bufs_num; i++) {
+		if (ep->bufs[i].busy) {
+			dev_dbg(&dev->gadget->dev, "fail, buffer is busy\n");
+			ret = -EBUSY;
+			goto out_unlock;
+		}
+	}
+	swap(ep->bufs, bufs);
+	num = ep->bufs_num;
+	size = ep->buf_size;
+	ep->bufs_num = arg.count;
+	ep->buf_size = arg.size;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	mutex_unlock(&dev->mmap_lock);
+
+	/* Pages mapped to userspace stay alive until they are unmapped. */
+	if (bufs)
+		raw_ep_bufs_free(bufs, num, size);
+
+	arg.offset = arg.count ? RAW_MMAP_EP_OFFSET(arg.ep) : 0;
+	if (copy_to_user((void __user *)value, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+
+out_unlock:
+	spin_unlock_irqrestore(&ep->lock, flags);
+	mutex_unlock(&dev->mmap_lock);
+out_free:
+	if (bufs)
+		raw_ep_bufs_free(bufs, arg.count, arg.size);
+	return ret;
+}
+
+static int raw_ioctl_ep_stream_start(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_stream arg;
+	struct raw_ep_req **r_reqs;
+	struct raw_ep *ep;
+	u32 i, queued;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	if (!arg.count || arg.count > USB_RAW_EP_SUBMIT_MAX)
+		return -EINVAL;
+
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	if (!smp_load_acquire(&dev->ring)) {
+		dev_dbg(&dev->gadget->dev, "fail, rings are not set up\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+
+	r_reqs = kcalloc(arg.count, sizeof(*r_reqs), GFP_KERNEL);
+	if (!r_reqs)
+		return -ENOMEM;
+	for (i = 0; i < arg.count; i++) {
+		r_reqs[i] = kzalloc(sizeof(*r_reqs[i]), GFP_KERNEL);
+		if (!r_reqs[i]) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	spin_lock_irqsave(&ep->lock, flags);
+	ret = raw_check_submit_ep(dev, ep);
+	if (ret)
+		goto out_unlock;
+	if (ep->reqs_num + arg.count > USB_RAW_EP_SUBMIT_MAX) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, too many requests submitted\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	if (arg.count > ep->bufs_num) {
+		dev_dbg(&dev->gadget->dev, "fail, not enough buffers\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (arg.length > ep->buf_size) {
+		dev_dbg(&dev->gadget->dev, "fail, buffer is too small\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (raw_ep_num_streams(ep)) {
+		dev_dbg(&dev->gadget->dev,
+				"fail, endpoint needs a stream ID\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	for (i = 0; i < arg.count; i++) {
+		if (ep->bufs[i].busy) {
+			dev_dbg(&dev->gadget->dev, "fail, buffer is busy\n");
+			ret = -EBUSY;
+			goto out_unlock;
+		}
+	}
+	for (i = 0; i < arg.count; i++) {
+		r_reqs[i]->req = usb_ep_alloc_request(ep->ep, GFP_ATOMIC);
+		if (!r_reqs[i]->req) {
+			dev_err(&dev->gadget->dev,
+					"fail, usb_ep_alloc_request failed\n");
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+	}
+	for (i = 0; i < arg.count; i++) {
+		struct raw_ep_req *r_req = r_reqs[i];
+
+		r_req->ep = ep;
+		r_req->cookie = i;
+		r_req->flags = USB_RAW_SUBMIT_FLAGS_MAPPED;
+		r_req->buf_index = i;
+		r_req->in = usb_endpoint_dir_in(ep->ep->desc);
+		r_req->req->context = r_req;
+		r_req->req->complete = gadget_ep_stream_complete;
+		r_req->req->buf = ep->bufs[i].data;
+		r_req->req->length = arg.length;
+		ep->bufs[i].busy = true;
+		list_add_tail(&r_req->entry, &ep->reqs_stream);
+	}
+	raw_ep_reqs_inc(ep, arg.count);
+	ep->streaming = true;
+	ep->stream_lost = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	for (queued = 0; queued < arg.count; queued++) {
+		r_reqs[queued]->queued = ktime_get();
+		raw_trace_queue(dev, ep->ep, r_reqs[queued]->req);
+		ret = usb_ep_queue(ep->ep, r_reqs[queued]->req, GFP_KERNEL);
+		if (ret) {
+			dev_err(&dev->gadget->dev,
+				"fail, usb_ep_queue returned %d\n", ret);
+			break;
+		}
+	}
+	if (ret) {
+		/* Let the queued requests drain and free the others. */
+		spin_lock_irqsave(&ep->lock, flags);
+		ep->streaming = false;
+		for (i = queued; i < arg.count; i++)
+			raw_stream_req_done(ep, r_reqs[i]);
+		spin_unlock_irqrestore(&ep->lock, flags);
+		for (i = queued; i < arg.count; i++)
+			raw_ep_req_free(r_reqs[i]);
+	}
+	kfree(r_reqs);
+	return ret;
+
+out_unlock:
+	spin_unlock_irqrestore(&ep->lock, flags);
+	for (i = 0; i < arg.count && r_reqs[i]->req; i++)
+		usb_ep_free_request(ep->ep, r_reqs[i]->req);
+	i = arg.count;
+out_free:
+	while (i--)
+		kfree(r_reqs[i]);
+	kfree(r_reqs);
+	return ret;
+}
+
+static int raw_ioctl_ep_stream_stop(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct raw_ep *ep;
+
+	if (value >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (value >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[value];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (!ep->streaming) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not streaming\n");
+		ret = -EINVAL;
+	}
+	ep->streaming = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return ret;
+}
+
+static int raw_ioctl_ep_set_coalesce(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_coalesce arg;
+	struct raw_ep *ep;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.ep >= USB_RAW_EPS_NUM_MAX || arg.flags || arg.reserved)
+		return -EINVAL;
+	/* Coalescing without a timeout could delay completions forever. */
+	if (arg.count > 1 && (!arg.usecs ||
+			arg.usecs > USB_RAW_EP_COALESCE_USECS_MAX))
+		return -EINVAL;
+	if (arg.count <= 1 && arg.usecs)
+		return -EINVAL;
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state != STATE_EP_ENABLED || ep->disabling) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+		spin_unlock_irqrestore(&ep->lock, flags);
+		return -EBUSY;
+	}
+	ep->coalesce_count = arg.count;
+	ep->coalesce_usecs = arg.usecs;
+	ep->coalesce_pending = 0;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	/* Don't hold back completions accounted with the old settings. */
+	hrtimer_cancel(&ep->coalesce_timer);
+	raw_ep_wake(ep);
+	return 0;
+}
+
+static int raw_ioctl_ep_set_timeout(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ep_timeout arg;
+	struct raw_ep *ep;
+	bool ep0;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~USB_RAW_EP_TIMEOUT_FLAGS_MASK)
+		return -EINVAL;
+	ep0 = arg.flags & USB_RAW_EP_TIMEOUT_FLAGS_EP0;
+	if (!ep0 && arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+
+	if (ep0) {
+		spin_lock_irqsave(&dev->ep0_lock, flags);
+		dev->ep0_timeout = arg.msecs;
+		spin_unlock_irqrestore(&dev->ep0_lock, flags);
+		return 0;
+	}
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (ep->state != STATE_EP_ENABLED || ep->disabling) {
+		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
+		spin_unlock_irqrestore(&ep->lock, flags);
+		return -EBUSY;
+	}
+	ep->timeout = arg.msecs;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return 0;
+}
+
+/*
+ * Dequeues the synchronous transfer in progress on ep0. ep0_cancelling keeps
+ * the request from being freed or reused for another transfer meanwhile.
+ */
+static int raw_ep0_cancel(struct raw_dev *dev)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	if (!dev->ep0_urb_queued || dev->ep0_cancelling ||
+					dev->ep0_cancelled) {
+		spin_unlock_irqrestore(&dev->ep0_lock, flags);
+		return 0;
+	}
+	dev->ep0_cancelling = true;
+	dev->ep0_cancelled = true;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+
+	trace_raw_gadget_ep_dequeue(dev->driver_id_number, dev->gadget->ep0,
+								dev->req);
+	ret = usb_ep_dequeue(dev->gadget->ep0, dev->req);
+
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	dev->ep0_cancelling = false;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+	return ret ? 0 : 1;
+}
+
+/* Same as raw_ep0_cancel() for a non-control endpoint. */
+static int raw_ep_cancel_sync(struct raw_dev *dev, struct raw_ep *ep)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	if (!ep->urb_queued || ep->cancelling || ep->cancelled) {
+		spin_unlock_irqrestore(&ep->lock, flags);
+		return 0;
+	}
+	ep->cancelling = true;
+	ep->cancelled = true;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	trace_raw_gadget_ep_dequeue(dev->driver_id_number, ep->ep, ep->req);
+	ret = usb_ep_dequeue(ep->ep, ep->req);
+
+	spin_lock_irqsave(&ep->lock, flags);
+	ep->cancelling = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+	return ret ? 0 : 1;
+}
+
+/*
+ * Finds a request on the list that matches arg and was not cancelled yet,
+ * and holds it. Must be called with ep->lock held.
+ */
+static struct raw_ep_req *raw_ep_cancel_find(struct list_head *list,
+				const struct usb_raw_ep_cancel *arg)
+{
+	struct raw_ep_req *r_req;
+
+	list_for_each_entry(r_req, list, entry) {
+		if (r_req->cancelled)
+			continue;
+		if (!(arg->flags & USB_RAW_CANCEL_FLAGS_ALL) &&
+					r_req->cookie != arg->cookie)
+			continue;
+		r_req->cancelled = true;
+		r_req->held = true;
+		return r_req;
+	}
+	return NULL;
+}
+
+/*
+ * Dequeues submitted requests one by one. The completion of a request might
+ * be called synchronously from usb_ep_dequeue(), so ep->lock can't be held
+ * meanwhile; holding the request keeps it from being freed instead.
+ */
+static int raw_ep_cancel_submitted(struct raw_dev *dev, struct raw_ep *ep,
+				const struct usb_raw_ep_cancel *arg)
+{
+	struct raw_ep_req *r_req;
+	unsigned long flags;
+	bool free;
+	int count = 0;
+
+	while (true) {
+		spin_lock_irqsave(&ep->lock, flags);
+		r_req = raw_ep_cancel_find(&ep->reqs_pending, arg);
+		if (!r_req)
+			r_req = raw_ep_cancel_find(&ep->reqs_ring, arg);
+		spin_unlock_irqrestore(&ep->lock, flags);
+		if (!r_req)
+			break;
+
+		trace_raw_gadget_ep_dequeue(dev->driver_id_number, ep->ep,
+								r_req->req);
+		if (!usb_ep_dequeue(ep->ep, r_req->req))
+			count++;
+
+		free = false;
+		spin_lock_irqsave(&ep->lock, flags);
+		r_req->held = false;
+		if (r_req->released) {
+			r_req->released = false;
+			free = raw_ep_req_put(ep, r_req);
+		}
+		spin_unlock_irqrestore(&ep->lock, flags);
+		if (free)
+			raw_ep_req_free(r_req);
+	}
+	return count;
+}
+
+static int raw_ioctl_ep_cancel(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	struct usb_raw_ep_cancel arg;
+	struct raw_ep *ep;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags & ~USB_RAW_CANCEL_FLAGS_MASK || arg.reserved)
+		return -EINVAL;
+	if ((arg.flags & USB_RAW_CANCEL_FLAGS_EP0) &&
+			arg.flags != USB_RAW_CANCEL_FLAGS_EP0)
+		return -EINVAL;
+	if ((arg.flags & USB_RAW_CANCEL_FLAGS_SYNC) &&
+			(arg.flags & USB_RAW_CANCEL_FLAGS_ALL))
+		return -EINVAL;
+	if (!(arg.flags & USB_RAW_CANCEL_FLAGS_EP0) &&
+			arg.ep >= USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	ret = raw_check_running(dev);
+	if (ret)
+		return ret;
+
+	if (arg.flags & USB_RAW_CANCEL_FLAGS_EP0)
+		return raw_ep0_cancel(dev);
+	if (arg.ep >= dev->eps_num) {
+		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
+		return -EINVAL;
+	}
+	ep = &dev->eps[arg.ep];
+	if (arg.flags & USB_RAW_CANCEL_FLAGS_SYNC)
+		return raw_ep_cancel_sync(dev, ep);
+	return raw_ep_cancel_submitted(dev, ep, &arg);
+}
+
+static int raw_ioctl_ring_setup(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	unsigned long flags;
+	struct usb_raw_ring_setup arg;
+	struct raw_ring *ring;
+	size_t cq_end;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	if (!arg.cq_entries)
+		arg.cq_entries = 2 * arg.sq_entries;
+	if (!is_power_of_2(arg.sq_entries) || !is_power_of_2(arg.cq_entries))
+		return -EINVAL;
+	if (arg.sq_entries > USB_RAW_RING_ENTRIES_MAX ||
+			arg.cq_entries > 2 * USB_RAW_RING_ENTRIES_MAX ||
+			arg.cq_entries < arg.sq_entries)
+		return -EINVAL;
+
+	arg.sq_offset = sizeof(struct usb_raw_ring_hdr);
+	arg.cq_offset = arg.sq_offset +
+			arg.sq_entries * sizeof(struct usb_raw_ep_submit);
+	cq_end = arg.cq_offset +
+			arg.cq_entries * sizeof(struct usb_raw_ep_completion);
+	arg.size = PAGE_ALIGN(cq_end);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring->hdr = vmalloc_user(arg.size);
+	if (!ring->hdr) {
+		ret = -ENOMEM;
+		goto out_free_ring;
+	}
+	ring->sqes = (void *)ring->hdr + arg.sq_offset;
+	ring->cqes = (void *)ring->hdr + arg.cq_offset;
+	ring->sq_entries = arg.sq_entries;
+	ring->cq_entries = arg.cq_entries;
+	ring->size = arg.size;
+	spin_lock_init(&ring->lock);
+	ring->hdr->sq_entries = arg.sq_entries;
+	ring->hdr->cq_entries = arg.cq_entries;
+	if (arg.eventfd >= 0) {
+		ring->eventfd = eventfd_ctx_fdget(arg.eventfd);
+		if (IS_ERR(ring->eventfd)) {
+			ret = PTR_ERR(ring->eventfd);
+			goto out_free_hdr;
+		}
+	}
+
+	mutex_lock(&dev->mmap_lock);
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dev->state != STATE_DEV_INITIALIZED &&
+			dev->state != STATE_DEV_RUNNING) {
+		dev_dbg(dev->dev, "fail, device is not initialized\n");
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	if (dev->ring) {
+		dev_dbg(dev->dev, "fail, ring is already set up\n");
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+	/*
+	 * Pairs with smp_load_acquire() in the lockless readers, which then
+	 * see the ring initialized.
+	 */
+	smp_store_release(&dev->ring, ring);
+	spin_unlock_irqrestore(&dev->lock, flags);
+	mutex_unlock(&dev->mmap_lock);
+
+	if (copy_to_user((void __user *)value, &arg, sizeof(arg)))
+		return -EFAULT;
+	return 0;
+
+out_unlock:
+	spin_unlock_irqrestore(&dev->lock, flags);
+	mutex_unlock(&dev->mmap_lock);
+	if (ring->eventfd)
+		eventfd_ctx_put(ring->eventfd);
+out_free_hdr:
+	vfree(ring->hdr);
+out_free_ring:
+	kfree(ring);
+	return ret;
+}
+
+static bool raw_ring_ready(struct raw_ring *ring, u32 min_complete)
+{
+	unsigned long flags;
+	bool ready;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	ready = ring->cq_tail - READ_ONCE(ring->hdr->cq_head) >= min_complete ||
+			!ring->inflight;
+	spin_unlock_irqrestore(&ring->lock, flags);
+	return ready;
+}
+
+static int raw_ioctl_ring_enter(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	struct usb_raw_ring_enter arg;
+	struct usb_raw_ep_submit sqe;
+	struct raw_ring *ring;
+	u32 sq_tail, submitted = 0;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (arg.flags || arg.reserved)
+		return -EINVAL;
+	ring = smp_load_acquire(&dev->ring);
+	if (!ring) {
+		dev_dbg(dev->dev, "fail, ring is not set up\n");
+		return -EINVAL;
+	}
+
+	mutex_lock(&dev->ring_lock);
+	/* Pairs with the userspace store-release of sq_tail. */
+	sq_tail = smp_load_acquire(&ring->hdr->sq_tail);
+	while (submitted < min(arg.to_submit, ring->sq_entries) &&
+					ring->sq_head != sq_tail) {
+		/* Userspace can modify the entry concurrently, copy it. */
+		memcpy(&sqe, &ring->sqes[ring->sq_head &
+				(ring->sq_entries - 1)], sizeof(sqe));
+		ret = raw_ep_submit(dev, &sqe, true);
+		if (ret)
+			break;
+		ring->sq_head++;
+		submitted++;
+	}
+	smp_store_release(&ring->hdr->sq_head, ring->sq_head);
+	mutex_unlock(&dev->ring_lock);
+
+	if (ret && !submitted)
+		return ret;
+
+	if (arg.min_complete) {
+		ret = wait_event_interruptible(dev->poll_wait,
+				raw_ring_ready(ring, arg.min_complete));
+		if (ret && !submitted) {
+			dev_dbg(dev->dev, "wait interrupted\n");
+			return -EINTR;
+		}
+	}
+	return submitted;
+}
+
+static bool raw_desc_type_valid(u8 type)
+{
+	switch (type) {
+	case USB_DT_DEVICE:
+	case USB_DT_CONFIG:
+	case USB_DT_STRING:
+	case USB_DT_DEVICE_QUALIFIER:
+	case USB_DT_OTHER_SPEED_CONFIG:
+	case USB_DT_BOS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int raw_ioctl_desc_set(struct raw_dev *dev, unsigned long value)
+{
+	int ret = 0;
+	struct usb_raw_desc arg;
+	struct raw_desc *desc = NULL, *old;
+	unsigned long flags;
+
+	if (copy_from_user(&arg, (void __user *)value, sizeof(arg)))
+		return -EFAULT;
+	if (!raw_desc_type_valid(arg.type))
+		return -EINVAL;
+	if (arg.type != USB_DT_STRING && arg.lang_id)
+		return -EINVAL;
+	if (arg.length > USB_RAW_DESC_LENGTH_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	if (dev->state != STATE_DEV_INITIALIZED &&
+			dev->state != STATE_DEV_RUNNING) {
+		dev_dbg(dev->dev, "fail, device is not initialized\n");
+		ret = -EINVAL;
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+	if (ret)
+		return ret;
+
+	if (arg.length) {
+		desc = kmalloc(sizeof(*desc) + arg.length, GFP_KERNEL);
+		if (!desc)
+			return -ENOMEM;
+		if (copy_from_user(desc->data,
+				(void __user *)(value + sizeof(arg)),
+				arg.length)) {
+			kfree(desc);
+			return -EFAULT;
+		}
+		desc->type = arg.type;
+		desc->index = arg.index;
+		desc->lang_id = arg.lang_id;
+		desc->length = arg.length;
+	}
+
+	/* ep0_lock and dev->lock are never nested. */
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	old = raw_desc_find(dev, arg.type, arg.index, arg.lang_id);
+	if (!old && desc && dev->descs_num >= USB_RAW_DESCS_NUM_MAX) {
+		dev_dbg(dev->dev, "fail, too many descriptors\n");
+		ret = -ENOSPC;
+		goto out_unlock;
+	}
+	if (old) {
+		list_del(&old->entry);
+		dev->descs_num--;
 	}
-
-	if (set && halt) {
-		ret = usb_ep_set_halt(dev->eps[i].ep);
-		if (ret < 0)
-			dev_err(&dev->gadget->dev,
-				"fail, usb_ep_set_halt returned %d\n", ret);
-	} else if (!set && halt) {
-		ret = usb_ep_clear_halt(dev->eps[i].ep);
-		if (ret < 0)
-			dev_err(&dev->gadget->dev,
-				"fail, usb_ep_clear_halt returned %d\n", ret);
-	} else if (set && !halt) {
-		ret = usb_ep_set_wedge(dev->eps[i].ep);
-		if (ret < 0)
-			dev_err(&dev->gadget->dev,
-				"fail, usb_ep_set_wedge returned %d\n", ret);
+	if (desc) {
+		list_add_tail(&desc->entry, &dev->descs);
+		dev->descs_num++;
+		desc = NULL;
 	}
-
 out_unlock:
-	spin_unlock_irqrestore(&dev->lock, flags);
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+	kfree(old);
+	kfree(desc);
 	return ret;
 }
 
-static void gadget_ep_complete(struct usb_ep *ep, struct usb_request *req)
+/* Must be called with dev->lock held. */
+static bool raw_dev_io_pending(struct raw_dev *dev)
 {
-	struct raw_ep *r_ep = (struct raw_ep *)ep->driver_data;
-	struct raw_dev *dev = r_ep->dev;
+	struct raw_ep *ep;
+	bool pending;
+	int i;
+
+	/* ep0_lock and dev->lock are never nested. */
+	if (READ_ONCE(dev->ep0_urb_queued) || READ_ONCE(dev->ep0_cancelling))
+		return true;
+	for (i = 0; i < dev->eps_num; i++) {
+		ep = &dev->eps[i];
+		spin_lock(&ep->lock);
+		pending = ep->urb_queued || ep->disabling || ep->cancelling;
+		spin_unlock(&ep->lock);
+		if (pending)
+			return true;
+	}
+	return false;
+}
+
+/* Drops completions that were not reaped before the endpoint was disabled. */
+static void raw_ep_reqs_drop(struct raw_ep *ep)
+{
+	struct raw_ep_req *r_req, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+	u32 i;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	/* Submitted requests are given back by usb_ep_disable(). */
+	WARN_ON(!list_empty(&ep->reqs_pending));
+	list_splice_init(&ep->reqs_done, &done);
+	ep->reqs_num = 0;
+	for (i = 0; i < ep->bufs_num; i++)
+		ep->bufs[i].busy = false;
+	spin_unlock_irqrestore(&ep->lock, flags);
+
+	list_for_each_entry_safe(r_req, tmp, &done, entry) {
+		list_del(&r_req->entry);
+		raw_ep_req_release(ep, r_req);
+	}
+}
+
+/*
+ * Waits for the I/O on endpoint fds to finish after the device is closed.
+ * Transfers in progress are cancelled, repeatedly, as I/O that already took
+ * a reference can still queue a transfer after a cancellation attempt.
+ */
+static void raw_ep_io_drain(struct raw_dev *dev)
+{
+	int i;
+
+	/* Pairs with smp_mb__after_atomic() in raw_ep_io_get(). */
+	smp_mb();
+	while (atomic_read(&dev->ep_io)) {
+		for (i = 0; i < dev->eps_num; i++)
+			raw_ep_cancel_sync(dev, &dev->eps[i]);
+		wait_event_timeout(dev->ep_io_wait, !atomic_read(&dev->ep_io),
+					msecs_to_jiffies(10));
+	}
+}
+
+/*
+ * Disables the endpoints and frees the requests allocated from the UDC.
+ * After the gadget driver is unbound, the UDC can go away or be bound to
+ * another driver, while the device can stay around for longer: endpoint fds
+ * hold references to it. Thus, dev_free() only frees memory. Called from
+ * gadget_unbind(); raw_release() and raw_ioctl_rebind() make sure nothing
+ * uses the endpoints by then.
+ */
+static void raw_dev_unbind(struct raw_dev *dev, struct usb_gadget *gadget)
+{
+	struct usb_request *req, *desc_req;
+	bool urb_queued, desc_req_queued;
 	unsigned long flags;
+	int i;
+
+	for (i = 0; i < dev->eps_num; i++) {
+		if (dev->eps[i].state != STATE_EP_DISABLED &&
+				raw_ep_disable(&dev->eps[i]))
+			dev_err(&gadget->dev, "failed to disable endpoint %d\n",
+					i);
+		raw_ep_reqs_drop(&dev->eps[i]);
+	}
 
 	spin_lock_irqsave(&dev->lock, flags);
-	if (req->status)
-		r_ep->status = req->status;
-	else
-		r_ep->status = req->actual;
+	req = dev->req;
+	desc_req = dev->desc_req;
+	dev->req = NULL;
+	dev->desc_req = NULL;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	complete((struct completion *)req->context);
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	urb_queued = dev->ep0_urb_queued;
+	desc_req_queued = dev->desc_req_queued;
+	dev->desc_req_queued = false;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+
+	if (req) {
+		if (urb_queued)
+			usb_ep_dequeue(gadget->ep0, req);
+		usb_ep_free_request(gadget->ep0, req);
+	}
+	if (desc_req) {
+		if (desc_req_queued)
+			usb_ep_dequeue(gadget->ep0, desc_req);
+		kfree(desc_req->buf);
+		usb_ep_free_request(gadget->ep0, desc_req);
+	}
 }
 
-static int raw_process_ep_io(struct raw_dev *dev, struct usb_raw_ep_io *io,
-				void *data, bool in)
+/*
+ * Unbinds the gadget driver from the UDC and binds it again, as if the fd was
+ * closed and the device was set up from scratch, but without giving up the
+ * driver name, the event queue, the rings, the endpoint buffers and the
+ * loaded descriptors.
+ */
+static int raw_ioctl_rebind(struct raw_dev *dev, unsigned long value)
 {
 	int ret = 0;
 	unsigned long flags;
-	struct raw_ep *ep;
-	DECLARE_COMPLETION_ONSTACK(done);
+
+	if (value)
+		return -EINVAL;
 
 	spin_lock_irqsave(&dev->lock, flags);
-	if (dev->state != STATE_DEV_RUNNING) {
+	if (dev->state != STATE_DEV_RUNNING || !dev->gadget_registered) {
 		dev_dbg(dev->dev, "fail, device is not running\n");
 		ret = -EINVAL;
 		goto out_unlock;
 	}
-	if (!dev->gadget) {
-		dev_dbg(dev->dev, "fail, gadget is not bound\n");
-		ret = -EBUSY;
-		goto out_unlock;
-	}
-	if (io->ep >= dev->eps_num) {
-		dev_dbg(&dev->gadget->dev, "fail, invalid endpoint\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-	ep = &dev->eps[io->ep];
-	if (ep->state != STATE_EP_ENABLED) {
-		dev_dbg(&dev->gadget->dev, "fail, endpoint is not enabled\n");
-		ret = -EBUSY;
-		goto out_unlock;
-	}
-	if (ep->disabling) {
-		dev_dbg(&dev->gadget->dev,
-				"fail, endpoint is already being disabled\n");
+	if (raw_dev_io_pending(dev) || atomic_read(&dev->users)) {
+		dev_dbg(dev->dev, "fail, device is in use\n");
 		ret = -EBUSY;
 		goto out_unlock;
 	}
-	if (ep->urb_queued) {
-		dev_dbg(&dev->gadget->dev, "fail, urb already queued\n");
+	/* Makes other ioctls fail until the driver is registered again. */
+	dev->state = STATE_DEV_REGISTERING;
+	/*
+	 * Pairs with smp_mb__after_atomic() in raw_dev_users_get(): either
+	 * a concurrent ioctl sees the new state in raw_check_running() and
+	 * fails, or its reference is seen here.
+	 */
+	smp_mb();
+	if (atomic_read(&dev->users)) {
+		dev_dbg(dev->dev, "fail, device is in use\n");
+		dev->state = STATE_DEV_RUNNING;
 		ret = -EBUSY;
 		goto out_unlock;
 	}
-	if (in != usb_endpoint_dir_in(ep->ep->desc)) {
-		dev_dbg(&dev->gadget->dev, "fail, wrong direction\n");
-		ret = -EINVAL;
-		goto out_unlock;
-	}
-
-	ep->dev = dev;
-	ep->req->context = &done;
-	ep->req->complete = gadget_ep_complete;
-	ep->req->buf = data;
-	ep->req->length = io->length;
-	ep->req->zero = usb_raw_io_flags_zero(io->flags);
-	ep->urb_queued = true;
+	dev->gadget_registered = false;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	ret = usb_ep_queue(ep->ep, ep->req, GFP_KERNEL);
+	/*
+	 * The checks above leave nobody who could be using the endpoints, so
+	 * gadget_unbind() can disable them and free the ep0 requests.
+	 */
+	ret = usb_gadget_unregister_driver(&dev->driver);
 	if (ret) {
-		dev_err(&dev->gadget->dev,
-				"fail, usb_ep_queue returned %d\n", ret);
+		dev_err(dev->dev,
+			"usb_gadget_unregister_driver() failed with %d\n",
+			ret);
+		/* Let raw_release() retry. */
 		spin_lock_irqsave(&dev->lock, flags);
-		goto out_queue_failed;
+		dev->gadget_registered = true;
+		dev->state = STATE_DEV_FAILED;
+		goto out_unlock;
 	}
+	/* Matches kref_get() in raw_ioctl_run(). */
+	kref_put(&dev->count, dev_free);
 
-	ret = wait_for_completion_interruptible(&done);
-	if (ret) {
-		dev_dbg(&dev->gadget->dev, "wait interrupted\n");
-		usb_ep_dequeue(ep->ep, ep->req);
-		wait_for_completion(&done);
-		spin_lock_irqsave(&dev->lock, flags);
-		if (ep->status == -ECONNRESET)
-			ep->status = -EINTR;
-		goto out_interrupted;
-	}
+	spin_lock_irqsave(&dev->ep0_lock, flags);
+	dev->ep0_in_pending = false;
+	dev->ep0_out_pending = false;
+	dev->ep0_status = 0;
+	spin_unlock_irqrestore(&dev->ep0_lock, flags);
+	reinit_completion(&dev->ep0_done);
+
+	/* Events from the previous session must not be mixed with new ones. */
+	raw_event_queue_clear(&dev->queue);
+
+	ret = usb_gadget_register_driver(&dev->driver);
 
 	spin_lock_irqsave(&dev->lock, flags);
+	if (ret) {
+		dev_err(dev->dev,
+			"fail, usb_gadget_register_driver returned %d\n", ret);
+		dev->state = STATE_DEV_FAILED;
+		goto out_unlock;
+	}
+	dev->gadget_registered = true;
+	/* Matches kref_put() in raw_release(). */
+	kref_get(&dev->count);
+	/* Queueing an event from gadget_bind() or gadget_setup() can fail. */
+	if (dev->state == STATE_DEV_FAILED) {
+		dev_err(dev->dev, "fail, device failed while rebinding\n");
+		ret = -ENODEV;
+		goto out_unlock;
+	}
+	/* Pairs with smp_load_acquire() in raw_check_running(). */
+	smp_store_release(&dev->state, STATE_DEV_RUNNING);
 
-out_interrupted:
-	ret = ep->status;
-out_queue_failed:
-	ep->urb_queued = false;
 out_unlock:
 	spin_unlock_irqrestore(&dev->lock, flags);
 	return ret;
 }
 
-static int raw_ioctl_ep_write(struct raw_dev *dev, unsigned long value)
-{
-	int ret = 0;
-	char *data;
-	struct usb_raw_ep_io io;
-
-	data = raw_alloc_io_data(&io, (void __user *)value, true);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
-	ret = raw_process_ep_io(dev, &io, data, true);
-	kfree(data);
-	return ret;
-}
-
-static int raw_ioctl_ep_read(struct raw_dev *dev, unsigned long value)
-{
-	int ret = 0;
-	char *data;
-	struct usb_raw_ep_io io;
-	unsigned int length;
-
-	data = raw_alloc_io_data(&io, (void __user *)value, false);
-	if (IS_ERR(data))
-		return PTR_ERR(data);
-	ret = raw_process_ep_io(dev, &io, data, false);
-	if (ret < 0)
-		goto free;
-
-	length = min(io.length, (unsigned int)ret);
-	if (copy_to_user((void __user *)(value + sizeof(io)), data, length))
-		ret = -EFAULT;
-	else
-		ret = length;
-free:
-	kfree(data);
-	return ret;
-}
-
 static int raw_ioctl_configure(struct raw_dev *dev, unsigned long value)
 {
 	int ret = 0;
@@ -1293,11 +4666,22 @@ out:
 static long raw_ioctl(struct file *fd, unsigned int cmd, unsigned long value)
 {
 	struct raw_dev *dev = fd->private_data;
+	bool counted;
 	int ret = 0;
 
 	if (!dev)
 		return -EBUSY;
 
+	/*
+	 * Event fetching only uses the event queue, so threads blocked in it
+	 * don't keep USB_RAW_IOCTL_REBIND from going through.
+	 */
+	counted = cmd != USB_RAW_IOCTL_REBIND &&
+			cmd != USB_RAW_IOCTL_EVENT_FETCH &&
+			cmd != USB_RAW_IOCTL_EVENTS_FETCH;
+	if (counted)
+		raw_dev_users_get(dev);
+
 	switch (cmd) {
 	case USB_RAW_IOCTL_INIT:
 		ret = raw_ioctl_init(dev, value);
@@ -1350,19 +4734,174 @@ static long raw_ioctl(struct file *fd, unsigned int cmd, unsigned long value)
 		ret = raw_ioctl_ep_set_clear_halt_wedge(
 					dev, value, true, false);
 		break;
+	case USB_RAW_IOCTL_EP_SUBMIT:
+		ret = raw_ioctl_ep_submit(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_REAP:
+		ret = raw_ioctl_ep_reap(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_ALLOC_BUFS:
+		ret = raw_ioctl_ep_alloc_bufs(dev, value);
+		break;
+	case USB_RAW_IOCTL_RING_SETUP:
+		ret = raw_ioctl_ring_setup(dev, value);
+		break;
+	case USB_RAW_IOCTL_RING_ENTER:
+		ret = raw_ioctl_ring_enter(dev, value);
+		break;
+	case USB_RAW_IOCTL_INIT_EXT:
+		ret = raw_ioctl_init_ext(dev, value);
+		break;
+	case USB_RAW_IOCTL_EVENTS_FETCH:
+		ret = raw_ioctl_events_fetch(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_ENABLE_EXT:
+		ret = raw_ioctl_ep_enable_ext(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_WRITEV:
+		ret = raw_ioctl_ep_writev(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_READV:
+		ret = raw_ioctl_ep_readv(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_STREAM_START:
+		ret = raw_ioctl_ep_stream_start(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_STREAM_STOP:
+		ret = raw_ioctl_ep_stream_stop(dev, value);
+		break;
+	case USB_RAW_IOCTL_DESC_SET:
+		ret = raw_ioctl_desc_set(dev, value);
+		break;
+	case USB_RAW_IOCTL_REBIND:
+		ret = raw_ioctl_rebind(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_OPEN:
+		ret = raw_ioctl_ep_open(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_SET_COALESCE:
+		ret = raw_ioctl_ep_set_coalesce(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_SET_TIMEOUT:
+		ret = raw_ioctl_ep_set_timeout(dev, value);
+		break;
+	case USB_RAW_IOCTL_EP_CANCEL:
+		ret = raw_ioctl_ep_cancel(dev, value);
+		break;
 	default:
 		ret = -EINVAL;
 	}
 
+	if (counted)
+		raw_dev_users_put(dev);
+	return ret;
+}
+
+static int raw_mmap_ring(struct raw_dev *dev, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (vma->vm_pgoff != USB_RAW_RING_MMAP_OFFSET >> PAGE_SHIFT)
+		return -EINVAL;
+
+	mutex_lock(&dev->mmap_lock);
+	if (!dev->ring || size > dev->ring->size) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	ret = remap_vmalloc_range(vma, dev->ring->hdr, 0);
+
+out_unlock:
+	mutex_unlock(&dev->mmap_lock);
+	return ret;
+}
+
+static int raw_mmap(struct file *fd, struct vm_area_struct *vma)
+{
+	struct raw_dev *dev = fd->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long addr, offset;
+	struct raw_ep *ep;
+	struct raw_ep_buf *buf;
+	unsigned int i;
+	int ret = 0;
+
+	if (!dev)
+		return -EBUSY;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	i = vma->vm_pgoff >> (RAW_MMAP_EP_SHIFT - PAGE_SHIFT);
+	if (i == 0)
+		return raw_mmap_ring(dev, vma);
+	if (i > USB_RAW_EPS_NUM_MAX)
+		return -EINVAL;
+	ep = &dev->eps[i - 1];
+	offset = (vma->vm_pgoff << PAGE_SHIFT) &
+				((1UL << RAW_MMAP_EP_SHIFT) - 1);
+
+	mutex_lock(&dev->mmap_lock);
+	if (offset + size > (unsigned long)ep->bufs_num * ep->buf_size) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		buf = &ep->bufs[offset / ep->buf_size];
+		ret = vm_insert_page(vma, addr,
+			virt_to_page(buf->data + offset % ep->buf_size));
+		if (ret)
+			break;
+		offset += PAGE_SIZE;
+	}
+
+out_unlock:
+	mutex_unlock(&dev->mmap_lock);
 	return ret;
 }
 
+static __poll_t raw_poll(struct file *fd, poll_table *wait)
+{
+	struct raw_dev *dev = fd->private_data;
+	struct raw_ring *ring;
+	unsigned long flags;
+	__poll_t mask = 0;
+	int i;
+
+	if (!dev)
+		return EPOLLERR;
+	poll_wait(fd, &dev->poll_wait, wait);
+
+	if (READ_ONCE(dev->queue.size))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	ring = smp_load_acquire(&dev->ring);
+	if (ring) {
+		spin_lock_irqsave(&ring->lock, flags);
+		if (ring->cq_tail != READ_ONCE(ring->hdr->cq_head))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		spin_unlock_irqrestore(&ring->lock, flags);
+	}
+	/* A stale answer is fine, completions wake up poll_wait. */
+	for (i = 0; i < READ_ONCE(dev->eps_num); i++) {
+		if (!list_empty_careful(&dev->eps[i].reqs_done))
+			mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (READ_ONCE(dev->state) == STATE_DEV_FAILED)
+		mask |= EPOLLERR;
+
+	return mask;
+}
+
 /*----------------------------------------------------------------------*/
 
 static const struct file_operations raw_fops = {
 	.open =			raw_open,
 	.unlocked_ioctl =	raw_ioctl,
 	.compat_ioctl =		raw_ioctl,
+	.mmap =			raw_mmap,
+	.poll =			raw_poll,
 	.release =		raw_release,
 	.llseek =		no_llseek,
 };
@@ -1373,4 +4912,21 @@ static struct miscdevice raw_misc_device = {
 	.fops = &raw_fops,
 };
 
-module_misc_device(raw_misc_device);
+static int __init raw_init(void)
+{
+	int ret;
+
+	raw_debugfs_root = debugfs_create_dir(DRIVER_NAME, usb_debug_root);
+	ret = misc_register(&raw_misc_device);
+	if (ret)
+		debugfs_remove_recursive(raw_debugfs_root);
+	return ret;
+}
+module_init(raw_init);
+
+static void __exit raw_exit(void)
+{
+	misc_deregister(&raw_misc_device);
+	debugfs_remove_recursive(raw_debugfs_root);
+}
+module_exit(raw_exit);
@@ -34,6 +34,32 @@ struct usb_raw_init {
 	__u8	speed;
 };
 
+/* Maximum number of queued events that can be requested in usb_raw_init_ext. */
+#define USB_RAW_EVENT_QUEUE_SIZE_MAX	4096
+
+/*
+ * struct usb_raw_init_ext - argument for USB_RAW_IOCTL_INIT_EXT ioctl.
+ * @driver_name: Same as usb_raw_init.driver_name.
+ * @device_name: Same as usb_raw_init.device_name.
+ * @speed: Same as usb_raw_init.speed.
+ * @padding: Unused, ignored.
+ * @event_queue_size: Maximum number of events that can be queued before being
+ *     fetched, at most USB_RAW_EVENT_QUEUE_SIZE_MAX. 0 means the default size
+ *     used by USB_RAW_IOCTL_INIT (16). When the queue overflows, the device
+ *     goes into a failed state.
+ * @flags: Reserved, must be 0.
+ * @reserved: Empty, reserved for potential future extensions.
+ */
+struct usb_raw_init_ext {
+	__u8	driver_name[UDC_NAME_LENGTH_MAX];
+	__u8	device_name[UDC_NAME_LENGTH_MAX];
+	__u8	speed;
+	__u8	padding[3];
+	__u32	event_queue_size;
+	__u32	flags;
+	__u32	reserved;
+};
+
 /* The type of event fetched with the USB_RAW_IOCTL_EVENT_FETCH ioctl. */
 enum usb_raw_event_type {
 	USB_RAW_EVENT_INVALID = 0,
@@ -73,6 +99,38 @@ struct usb_raw_event {
 	__u8		data[];
 };
 
+/* Maximum length of event data, fits struct usb_ctrlrequest. */
+#define USB_RAW_EVENT_DATA_MAX	8
+
+/*
+ * struct usb_raw_event_entry - stores an event fetched with
+ *     USB_RAW_IOCTL_EVENTS_FETCH.
+ * @type: The type of the fetched event.
+ * @length: Length of the fetched event data.
+ * @data: The fetched event data, same as for USB_RAW_IOCTL_EVENT_FETCH.
+ */
+struct usb_raw_event_entry {
+	__u32		type;
+	__u32		length;
+	__u8		data[USB_RAW_EVENT_DATA_MAX];
+};
+
+#define USB_RAW_EVENTS_FLAGS_NONBLOCK	0x0001
+#define USB_RAW_EVENTS_FLAGS_MASK	0x0001
+
+/*
+ * struct usb_raw_events - argument for USB_RAW_IOCTL_EVENTS_FETCH ioctl.
+ * @count: Maximum number of events to store in the events buffer.
+ * @flags: When USB_RAW_EVENTS_FLAGS_NONBLOCK is specified, the ioctl does not
+ *     wait for an event to be queued and returns 0 if there are none.
+ * @events: A buffer to store the fetched events.
+ */
+struct usb_raw_events {
+	__u32				count;
+	__u32				flags;
+	struct usb_raw_event_entry	events[];
+};
+
 #define USB_RAW_IO_FLAGS_ZERO	0x0001
 #define USB_RAW_IO_FLAGS_MASK	0x0001
 
@@ -86,6 +144,21 @@ static inline int usb_raw_io_flags_zero(__u16 flags)
 	return (flags & USB_RAW_IO_FLAGS_ZERO);
 }
 
+/* Flags accepted by USB_RAW_IOCTL_EP_SUBMIT in addition to the IO flags. */
+#define USB_RAW_SUBMIT_FLAGS_MAPPED	0x8000
+#define USB_RAW_SUBMIT_FLAGS_MASK	(USB_RAW_IO_FLAGS_MASK | \
+					USB_RAW_SUBMIT_FLAGS_MAPPED)
+
+static inline int usb_raw_submit_flags_valid(__u16 flags)
+{
+	return (flags & ~USB_RAW_SUBMIT_FLAGS_MASK) == 0;
+}
+
+static inline int usb_raw_submit_flags_mapped(__u16 flags)
+{
+	return (flags & USB_RAW_SUBMIT_FLAGS_MAPPED);
+}
+
 /*
  * struct usb_raw_ep_io - argument for USB_RAW_IOCTL_EP0/EP_WRITE/READ ioctls.
  * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE for
@@ -161,6 +234,388 @@ struct usb_raw_eps_info {
 	struct usb_raw_ep_info	eps[USB_RAW_EPS_NUM_MAX];
 };
 
+/*
+ * Maximum number of requests submitted with USB_RAW_IOCTL_EP_SUBMIT that can
+ * exist for a single endpoint at the same time. A request counts towards this
+ * limit until its completion is reaped with USB_RAW_IOCTL_EP_REAP.
+ */
+#define USB_RAW_EP_SUBMIT_MAX	128
+
+/*
+ * struct usb_raw_ep_submit - argument for USB_RAW_IOCTL_EP_SUBMIT ioctl.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: Same as usb_raw_ep_io.flags. Additionally, when
+ *     USB_RAW_SUBMIT_FLAGS_MAPPED is specified, @buffer is treated as an index
+ *     of a buffer allocated with USB_RAW_IOCTL_EP_ALLOC_BUFS.
+ * @length: Length of data.
+ * @cookie: Arbitrary value that is reported back in the completion of this
+ *     request.
+ * @buffer: Pointer to the data to send for IN endpoints. Pointer to the buffer
+ *     to store received data for OUT endpoints; the buffer must stay valid
+ *     until the completion of this request is reaped.
+ * @stream_id: For bulk endpoints enabled with streams (see
+ *     struct usb_raw_ep_enable_ext), the ID of the stream to queue the request
+ *     to, from 1 to the number of streams. Must be 0 otherwise.
+ * @reserved: Empty, reserved for potential future extensions.
+ *
+ * Data in mapped buffers is never copied: the request is submitted with the
+ * buffer itself, which must not be reused until the completion is reaped.
+ */
+struct usb_raw_ep_submit {
+	__u16		ep;
+	__u16		flags;
+	__u32		length;
+	__u64		cookie;
+	__u64		buffer;
+	__u32		stream_id;
+	__u32		reserved;
+};
+
+/*
+ * Flags set by the driver in struct usb_raw_ep_completion in addition to the
+ * submission flags. USB_RAW_COMPLETION_FLAGS_STREAM marks completions of
+ * requests queued by USB_RAW_IOCTL_EP_STREAM_START.
+ * USB_RAW_COMPLETION_FLAGS_LOST means that completions of the same stream
+ * preceding this one were dropped because the completion ring was full.
+ */
+#define USB_RAW_COMPLETION_FLAGS_LOST	0x2000
+#define USB_RAW_COMPLETION_FLAGS_STREAM	0x4000
+
+/*
+ * struct usb_raw_ep_completion - stores information about a completed request
+ *     submitted with USB_RAW_IOCTL_EP_SUBMIT.
+ * @cookie: The cookie that was specified when submitting the request.
+ * @status: 0 on success or negative error code on failure. -ESHUTDOWN is
+ *     reported for requests that were cancelled due to endpoint disabling.
+ * @length: Length of transferred data.
+ * @ep: Endpoint handle the request was submitted to.
+ * @flags: The flags that were specified when submitting the request.
+ * @frame: For isochronous endpoints, the (micro)frame number the request
+ *     completed in, as reported by the UDC, or 0 if the UDC doesn't report it
+ *     (0 is a valid frame number too). 0 for other endpoints.
+ */
+struct usb_raw_ep_completion {
+	__u64		cookie;
+	__s32		status;
+	__u32		length;
+	__u16		ep;
+	__u16		flags;
+	__u32		frame;
+};
+
+/* Maximum size of a buffer allocated with USB_RAW_IOCTL_EP_ALLOC_BUFS. */
+#define USB_RAW_EP_BUF_SIZE_MAX	(64 * 1024)
+
+/*
+ * struct usb_raw_ep_bufs - argument for USB_RAW_IOCTL_EP_ALLOC_BUFS ioctl.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: Reserved, must be 0.
+ * @count: Number of buffers to allocate, at most USB_RAW_EP_SUBMIT_MAX.
+ *     0 frees previously allocated buffers.
+ * @size: Size of each buffer. Must be a multiple of the page size.
+ * @reserved: Empty, reserved for potential future extensions.
+ * @offset: Filled in by the driver: offset to pass to mmap() to map the
+ *     buffers. Buffer with index N is mapped at offset + N * size.
+ */
+struct usb_raw_ep_bufs {
+	__u16		ep;
+	__u16		flags;
+	__u32		count;
+	__u32		size;
+	__u32		reserved;
+	__u64		offset;
+};
+
+/* Offset to pass to mmap() to map the rings. */
+#define USB_RAW_RING_MMAP_OFFSET	0
+
+/* Maximum number of entries in the submission ring. */
+#define USB_RAW_RING_ENTRIES_MAX	4096
+
+/*
+ * struct usb_raw_ring_hdr - header of the memory mapped at
+ *     USB_RAW_RING_MMAP_OFFSET after USB_RAW_IOCTL_RING_SETUP.
+ * @sq_head: Index of the next submission entry to be consumed by the driver.
+ *     Written by the driver.
+ * @sq_tail: Index of the next submission entry to be filled in by the user.
+ *     Written by the user.
+ * @cq_head: Index of the next completion entry to be consumed by the user.
+ *     Written by the user.
+ * @cq_tail: Index of the next completion entry to be filled in by the driver.
+ *     Written by the driver.
+ * @sq_entries: Number of entries in the submission ring.
+ * @cq_entries: Number of entries in the completion ring.
+ * @cq_overflow: Number of completions dropped because the completion ring was
+ *     full. Written by the driver.
+ * @reserved: Empty, reserved for potential future extensions.
+ *
+ * Indices are free-running: the entry with index N is stored at position
+ * N & (entries - 1). The submission ring consists of struct usb_raw_ep_submit
+ * entries, the completion ring of struct usb_raw_ep_completion entries.
+ * Userspace must read sq_head and cq_tail with load-acquire semantics and
+ * write sq_tail and cq_head with store-release semantics.
+ */
+struct usb_raw_ring_hdr {
+	__u32		sq_head;
+	__u32		sq_tail;
+	__u32		cq_head;
+	__u32		cq_tail;
+	__u32		sq_entries;
+	__u32		cq_entries;
+	__u32		cq_overflow;
+	__u32		reserved;
+};
+
+/*
+ * struct usb_raw_ring_setup - argument for USB_RAW_IOCTL_RING_SETUP ioctl.
+ * @sq_entries: Number of entries in the submission ring, must be a power of 2
+ *     not greater than USB_RAW_RING_ENTRIES_MAX.
+ * @cq_entries: Number of entries in the completion ring, must be a power of 2
+ *     not smaller than sq_entries. 0 means 2 * sq_entries.
+ * @eventfd: eventfd file descriptor to signal on new events and completions,
+ *     or -1.
+ * @flags: Reserved, must be 0.
+ * @sq_offset: Filled in by the driver: offset of the submission ring within
+ *     the mapping.
+ * @cq_offset: Filled in by the driver: offset of the completion ring within
+ *     the mapping.
+ * @size: Filled in by the driver: size of the mapping.
+ * @reserved: Empty, reserved for potential future extensions.
+ */
+struct usb_raw_ring_setup {
+	__u32		sq_entries;
+	__u32		cq_entries;
+	__s32		eventfd;
+	__u32		flags;
+	__u32		sq_offset;
+	__u32		cq_offset;
+	__u32		size;
+	__u32		reserved;
+};
+
+/*
+ * struct usb_raw_ring_enter - argument for USB_RAW_IOCTL_RING_ENTER ioctl.
+ * @to_submit: Maximum number of submission entries to consume.
+ * @min_complete: Number of entries in the completion ring to wait for.
+ * @flags: Reserved, must be 0.
+ * @reserved: Empty, reserved for potential future extensions.
+ */
+struct usb_raw_ring_enter {
+	__u32		to_submit;
+	__u32		min_complete;
+	__u32		flags;
+	__u32		reserved;
+};
+
+#define USB_RAW_REAP_FLAGS_NONBLOCK	0x0001
+#define USB_RAW_REAP_FLAGS_MASK		0x0001
+
+/*
+ * struct usb_raw_ep_reap - argument for USB_RAW_IOCTL_EP_REAP ioctl.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: When USB_RAW_REAP_FLAGS_NONBLOCK is specified, the ioctl does not
+ *     wait for a request to complete and only reaps already completed ones.
+ * @count: Maximum number of completions to store in the completions buffer.
+ * @completions: A buffer to store completions.
+ */
+struct usb_raw_ep_reap {
+	__u16				ep;
+	__u16				flags;
+	__u32				count;
+	struct usb_raw_ep_completion	completions[];
+};
+
+#define USB_RAW_EP_ENABLE_FLAGS_SS_COMP	0x0001
+#define USB_RAW_EP_ENABLE_FLAGS_MASK	0x0001
+
+/*
+ * struct usb_raw_ep_enable_ext - argument for USB_RAW_IOCTL_EP_ENABLE_EXT.
+ * @flags: When USB_RAW_EP_ENABLE_FLAGS_SS_COMP is specified, @comp_desc is
+ *     passed to the UDC along with @desc.
+ * @pool_size: Number of requests to preallocate for the endpoint, at most
+ *     USB_RAW_EP_SUBMIT_MAX. Pooled requests are reused by USB_RAW_IOCTL_EP_*
+ *     ioctls instead of allocating a request and a buffer for each transfer.
+ * @pool_buf_len: Size of the buffer attached to each pooled request, at most
+ *     PAGE_SIZE. Transfers longer than that don't use the pool, unless they
+ *     use buffers allocated with USB_RAW_IOCTL_EP_ALLOC_BUFS.
+ * @reserved: Empty, reserved for potential future extensions.
+ * @desc: Endpoint descriptor, same as for USB_RAW_IOCTL_EP_ENABLE.
+ * @comp_desc: SuperSpeed endpoint companion descriptor. The UDC takes the
+ *     burst size and, for bulk endpoints, the number of streams from it. The
+ *     number of streams must not exceed usb_raw_ep_limits.max_streams.
+ *     Transfers on a bulk endpoint enabled with streams must be submitted with
+ *     USB_RAW_IOCTL_EP_SUBMIT or through the submission ring with a stream ID.
+ */
+struct usb_raw_ep_enable_ext {
+	__u32					flags;
+	__u32					pool_size;
+	__u32					pool_buf_len;
+	__u32					reserved;
+	struct usb_endpoint_descriptor		desc;
+	struct usb_ss_ep_comp_descriptor	comp_desc;
+};
+
+/* Maximum total length of a USB_RAW_IOCTL_EP_WRITEV/READV transfer. */
+#define USB_RAW_EP_IOV_LEN_MAX	(64 * 1024 * 1024)
+
+/*
+ * struct usb_raw_ep_iov - argument for USB_RAW_IOCTL_EP_WRITEV/READV ioctls.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: When USB_RAW_IO_FLAGS_ZERO is specified, the zero flag is set on
+ *     the last request of the transfer.
+ * @iovcnt: Number of entries in the iov array.
+ * @iov: Pointer to an array of struct iovec describing the buffers.
+ */
+struct usb_raw_ep_iov {
+	__u16		ep;
+	__u16		flags;
+	__u32		iovcnt;
+	__u64		iov;
+};
+
+/*
+ * struct usb_raw_ep_stream - argument for USB_RAW_IOCTL_EP_STREAM_START.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: Reserved, must be 0.
+ * @count: Number of buffers allocated with USB_RAW_IOCTL_EP_ALLOC_BUFS to
+ *     stream through, starting with buffer 0.
+ * @length: Length of each request, at most the size of the buffers.
+ *
+ * Each buffer is queued as a request, and a completed request is queued
+ * again right away, so the endpoint never runs dry. Completions are posted to
+ * the completion ring with the buffer index as the cookie and the
+ * USB_RAW_SUBMIT_FLAGS_MAPPED and USB_RAW_COMPLETION_FLAGS_STREAM flags set.
+ * After the completion of a buffer is posted, userspace has the time it
+ * takes to transfer count - 1 other requests to consume the received data (OUT)
+ * or to fill in the data to send next (IN).
+ */
+struct usb_raw_ep_stream {
+	__u16		ep;
+	__u16		flags;
+	__u32		count;
+	__u32		length;
+	__u32		reserved;
+};
+
+/* Maximum timeout for struct usb_raw_ep_coalesce, one second. */
+#define USB_RAW_EP_COALESCE_USECS_MAX	1000000
+
+/*
+ * struct usb_raw_ep_coalesce - argument for USB_RAW_IOCTL_EP_SET_COALESCE.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE.
+ * @flags: Reserved, must be 0.
+ * @count: Number of completions to accumulate before waking up waiters; 0 or
+ *     1 disables coalescing.
+ * @usecs: Maximum time in microseconds to hold back a completion, counted
+ *     from the first accumulated one. Required with @count above 1, must be
+ *     0 otherwise.
+ * @reserved: Empty, reserved for potential future extensions.
+ *
+ * Applies to completions of requests submitted with USB_RAW_IOCTL_EP_SUBMIT,
+ * through the submission ring, and by USB_RAW_IOCTL_EP_STREAM_START: threads
+ * blocked in USB_RAW_IOCTL_EP_REAP or USB_RAW_IOCTL_RING_ENTER, poll(), and
+ * the ring eventfd are only woken up once @count completions accumulate or
+ * @usecs pass. The completions themselves are queued right away, so
+ * non-blocking reaping sees them immediately. Failed requests are always
+ * reported right away.
+ */
+struct usb_raw_ep_coalesce {
+	__u16		ep;
+	__u16		flags;
+	__u32		count;
+	__u32		usecs;
+	__u32		reserved;
+};
+
+/* Arguments apply to ep0 instead of a non-control endpoint. */
+#define USB_RAW_EP_TIMEOUT_FLAGS_EP0	0x0001
+#define USB_RAW_EP_TIMEOUT_FLAGS_MASK	0x0001
+
+/*
+ * struct usb_raw_ep_timeout - argument for USB_RAW_IOCTL_EP_SET_TIMEOUT.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE. Ignored with
+ *     USB_RAW_EP_TIMEOUT_FLAGS_EP0.
+ * @flags: USB_RAW_EP_TIMEOUT_FLAGS_EP0 sets the timeout for ep0.
+ * @msecs: Timeout in milliseconds, 0 waits forever.
+ *
+ * Applies to synchronous transfers: USB_RAW_IOCTL_EP0_WRITE/READ for ep0, and
+ * USB_RAW_IOCTL_EP_WRITE/READ, USB_RAW_IOCTL_EP_WRITEV/READV, and transfers
+ * on the endpoint file descriptor for other endpoints. A transfer that
+ * doesn't complete in time is dequeued and fails with -ETIMEDOUT; for a
+ * vectored transfer the timeout applies to each of its requests.
+ */
+struct usb_raw_ep_timeout {
+	__u16		ep;
+	__u16		flags;
+	__u32		msecs;
+};
+
+/*
+ * USB_RAW_CANCEL_FLAGS_EP0 cancels the synchronous transfer in progress on
+ * ep0, USB_RAW_CANCEL_FLAGS_SYNC the one on a non-control endpoint.
+ * Without these, requests submitted with USB_RAW_IOCTL_EP_SUBMIT or through
+ * the submission ring are cancelled: the ones with a matching cookie, or all
+ * of them with USB_RAW_CANCEL_FLAGS_ALL.
+ */
+#define USB_RAW_CANCEL_FLAGS_EP0	0x0001
+#define USB_RAW_CANCEL_FLAGS_SYNC	0x0002
+#define USB_RAW_CANCEL_FLAGS_ALL	0x0004
+#define USB_RAW_CANCEL_FLAGS_MASK	0x0007
+
+/*
+ * struct usb_raw_ep_cancel - argument for USB_RAW_IOCTL_EP_CANCEL.
+ * @ep: Endpoint handle as returned by USB_RAW_IOCTL_EP_ENABLE. Ignored with
+ *     USB_RAW_CANCEL_FLAGS_EP0.
+ * @flags: See USB_RAW_CANCEL_FLAGS_*.
+ * @reserved: Empty, reserved for potential future extensions.
+ * @cookie: Cookie of the submitted requests to cancel.
+ *
+ * A cancelled synchronous transfer fails with -ECANCELED. Cancelled submitted
+ * requests complete as usual, with the status reported by the UDC for
+ * dequeued requests (usually -ECONNRESET). Requests that complete before
+ * they are dequeued are not affected, and neither are the requests queued by
+ * USB_RAW_IOCTL_EP_STREAM_START.
+ */
+struct usb_raw_ep_cancel {
+	__u16		ep;
+	__u16		flags;
+	__u32		reserved;
+	__u64		cookie;
+};
+
+/* Maximum length of a descriptor loaded with USB_RAW_IOCTL_DESC_SET. */
+#define USB_RAW_DESC_LENGTH_MAX	4096
+
+/* Maximum number of descriptors loaded with USB_RAW_IOCTL_DESC_SET. */
+#define USB_RAW_DESCS_NUM_MAX	256
+
+/*
+ * struct usb_raw_desc - argument for USB_RAW_IOCTL_DESC_SET ioctl.
+ * @type: Descriptor type: USB_DT_DEVICE, USB_DT_CONFIG, USB_DT_STRING,
+ *     USB_DT_DEVICE_QUALIFIER, USB_DT_OTHER_SPEED_CONFIG, or USB_DT_BOS.
+ * @index: Descriptor index, the low byte of wValue of the GET_DESCRIPTOR
+ *     request.
+ * @lang_id: Language ID, the wIndex of the GET_DESCRIPTOR request, for string
+ *     descriptors. Must be 0 for other descriptor types.
+ * @length: Length of the descriptor, at most USB_RAW_DESC_LENGTH_MAX. 0 removes
+ *     a previously loaded descriptor.
+ * @data: The descriptor, including the descriptors that follow it in the reply
+ *     (e.g. the interface and endpoint descriptors for USB_DT_CONFIG).
+ *
+ * Standard GET_DESCRIPTOR requests for loaded descriptors are answered by the
+ * driver without queueing a USB_RAW_EVENT_CONTROL event: the descriptor is
+ * sent truncated to wLength. The descriptors are not matched against the
+ * connection speed, so descriptors that depend on it should only be loaded
+ * when the speed is known.
+ */
+struct usb_raw_desc {
+	__u8		type;
+	__u8		index;
+	__u16		lang_id;
+	__u32		length;
+	__u8		data[];
+};
+
 /*
  * Initializes a Raw Gadget instance.
  * Accepts a pointer to the usb_raw_init struct as an argument.
@@ -256,4 +711,184 @@ struct usb_raw_eps_info {
 #define USB_RAW_IOCTL_EP_CLEAR_HALT	_IOW('U', 14, __u32)
 #define USB_RAW_IOCTL_EP_SET_WEDGE	_IOW('U', 15, __u32)
 
+/*
+ * Queues a request to endpoint usb_raw_ep_submit.ep without waiting for it to
+ * complete. Copies data to send from user for IN endpoints right away; copies
+ * received data to user for OUT endpoints once the completion is reaped.
+ * Multiple requests can be in flight for the same endpoint, but the endpoint
+ * can't be used with USB_RAW_IOCTL_EP_WRITE/READ at the same time.
+ * Accepts a pointer to the usb_raw_ep_submit struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_SUBMIT		_IOW('U', 16, struct usb_raw_ep_submit)
+
+/*
+ * Collects completions of requests submitted with USB_RAW_IOCTL_EP_SUBMIT to
+ * endpoint usb_raw_ep_reap.ep in the order the requests completed. Unless
+ * USB_RAW_REAP_FLAGS_NONBLOCK is specified, waits until at least one request
+ * completes if there are submitted requests.
+ * Accepts a pointer to the usb_raw_ep_reap struct as an argument.
+ * Returns the number of reaped completions on success or negative error code
+ * on failure.
+ */
+#define USB_RAW_IOCTL_EP_REAP		_IOWR('U', 17, struct usb_raw_ep_reap)
+
+/*
+ * Allocates buffers for endpoint usb_raw_ep_bufs.ep that can be mapped with
+ * mmap() on the Raw Gadget file descriptor (only with MAP_SHARED) and used by
+ * USB_RAW_IOCTL_EP_SUBMIT without copying data. Replaces previously allocated
+ * buffers; fails with -EBUSY if any of them are used by a submitted request.
+ * Accepts a pointer to the usb_raw_ep_bufs struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_ALLOC_BUFS	_IOWR('U', 18, struct usb_raw_ep_bufs)
+
+/*
+ * Sets up the submission and completion rings that can be mapped with mmap()
+ * at USB_RAW_RING_MMAP_OFFSET (only with MAP_SHARED). Requests submitted
+ * through the ring behave as the ones submitted with USB_RAW_IOCTL_EP_SUBMIT,
+ * but their completions are posted to the completion ring. OUT requests
+ * submitted through the ring must use mapped buffers. The number of requests in
+ * flight is limited by the free space in the completion ring.
+ * Independently of the rings, the Raw Gadget file descriptor supports poll(),
+ * which reports EPOLLIN when events, completions in the ring, or completions to
+ * be reaped with USB_RAW_IOCTL_EP_REAP are available.
+ * Accepts a pointer to the usb_raw_ring_setup struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_RING_SETUP	_IOWR('U', 19, struct usb_raw_ring_setup)
+
+/*
+ * Submits up to usb_raw_ring_enter.to_submit requests from the submission ring
+ * and then waits until there are at least usb_raw_ring_enter.min_complete
+ * entries in the completion ring or no requests are in flight. Stops at the
+ * first request that fails to be submitted; that entry stays in the ring.
+ * Accepts a pointer to the usb_raw_ring_enter struct as an argument.
+ * Returns the number of submitted requests on success or negative error code
+ * on failure.
+ */
+#define USB_RAW_IOCTL_RING_ENTER	_IOW('U', 20, struct usb_raw_ring_enter)
+
+/*
+ * Same as USB_RAW_IOCTL_INIT, but allows to specify additional parameters.
+ * Accepts a pointer to the usb_raw_init_ext struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_INIT_EXT		_IOW('U', 21, struct usb_raw_init_ext)
+
+/*
+ * Fetches up to usb_raw_events.count queued events in a single call. Unless
+ * USB_RAW_EVENTS_FLAGS_NONBLOCK is specified, waits until at least one event
+ * is queued. Events that can't be copied to the buffer stay queued.
+ * Accepts a pointer to the usb_raw_events struct as an argument.
+ * Returns the number of fetched events on success or negative error code on
+ * failure.
+ */
+#define USB_RAW_IOCTL_EVENTS_FETCH	_IOWR('U', 22, struct usb_raw_events)
+
+/*
+ * Same as USB_RAW_IOCTL_EP_ENABLE, but allows to preallocate a pool of
+ * requests for the endpoint. The pool is freed when the endpoint is disabled.
+ * Accepts a pointer to the usb_raw_ep_enable_ext struct as an argument.
+ * Returns enabled endpoint handle on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_ENABLE_EXT	_IOW('U', 23, struct usb_raw_ep_enable_ext)
+
+/*
+ * Same as USB_RAW_IOCTL_EP_WRITE/READ, but transfers data from/to a vector of
+ * buffers of up to USB_RAW_EP_IOV_LEN_MAX bytes in total. If the UDC supports
+ * scatter-gather, the buffers are used for the transfer directly; otherwise
+ * the transfer is split into multiple requests, and a short OUT request ends
+ * the transfer.
+ * Accepts a pointer to the usb_raw_ep_iov struct as an argument.
+ * Returns length of transferred data on success or negative error code on
+ * failure.
+ */
+#define USB_RAW_IOCTL_EP_WRITEV		_IOW('U', 24, struct usb_raw_ep_iov)
+#define USB_RAW_IOCTL_EP_READV		_IOW('U', 25, struct usb_raw_ep_iov)
+
+/*
+ * Starts streaming through the endpoint buffers, see struct usb_raw_ep_stream.
+ * Meant for isochronous endpoints, but works with any non-control endpoint.
+ * Requires the rings to be set up with USB_RAW_IOCTL_RING_SETUP. No other
+ * requests can be submitted to the endpoint until the stream is stopped and
+ * all of its requests are completed.
+ * Accepts a pointer to the usb_raw_ep_stream struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_STREAM_START	_IOW('U', 26, struct usb_raw_ep_stream)
+
+/*
+ * Stops streaming on the endpoint: queued requests complete as usual but are
+ * not queued again. Disabling the endpoint cancels them.
+ * Accepts endpoint handle as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_STREAM_STOP	_IOW('U', 27, __u32)
+
+/*
+ * Loads a descriptor to answer standard GET_DESCRIPTOR requests with, see
+ * struct usb_raw_desc. Replaces a previously loaded descriptor with the same
+ * type, index, and language ID. Can be used both before and after
+ * USB_RAW_IOCTL_RUN.
+ * Accepts a pointer to the usb_raw_desc struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_DESC_SET		_IOW('U', 28, struct usb_raw_desc)
+
+/*
+ * Disconnects the device and binds it to the same UDC again without closing
+ * the file descriptor: disables all endpoints, drops their unreaped
+ * completions and all queued events, and reports a new USB_RAW_EVENT_CONNECT.
+ * The driver name, the event queue, the rings, the endpoint buffers and their
+ * mappings, and the loaded descriptors are kept. Fails with -EBUSY if any
+ * transfer is in progress, any endpoint fd returned by USB_RAW_IOCTL_EP_OPEN
+ * is open, or any other ioctl except for USB_RAW_IOCTL_EVENT_FETCH and
+ * USB_RAW_IOCTL_EVENTS_FETCH is being executed. Ioctls issued while it is in
+ * progress fail with -EINVAL.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_REBIND		_IO('U', 29)
+
+/*
+ * Returns a new file descriptor for an enabled endpoint. Each read() or
+ * write() on it performs one transfer, like USB_RAW_IOCTL_EP_READV/WRITEV
+ * with no flags, and can be used with splice() and sendfile(). poll() reports
+ * the endpoint as ready when no transfer is in progress, and EPOLLERR once it
+ * is disabled. The file descriptor refers to the endpoint handle: after the
+ * endpoint is disabled, transfers fail until an endpoint with the same handle
+ * is enabled again.
+ * Accepts endpoint handle as an argument.
+ * Returns the file descriptor on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_OPEN		_IOW('U', 30, __u32)
+
+/*
+ * Sets up completion coalescing for an enabled endpoint, see
+ * struct usb_raw_ep_coalesce. The settings are reset when the endpoint is
+ * disabled.
+ * Accepts a pointer to the usb_raw_ep_coalesce struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_SET_COALESCE _IOW('U', 31, struct usb_raw_ep_coalesce)
+
+/*
+ * Sets the timeout for synchronous transfers on ep0 or an enabled endpoint,
+ * see struct usb_raw_ep_timeout. The timeout of a non-control endpoint is
+ * reset when the endpoint is disabled. Transfers already in progress keep
+ * the timeout they were started with.
+ * Accepts a pointer to the usb_raw_ep_timeout struct as an argument.
+ * Returns 0 on success or negative error code on failure.
+ */
+#define USB_RAW_IOCTL_EP_SET_TIMEOUT	_IOW('U', 32, struct usb_raw_ep_timeout)
+
+/*
+ * Cancels transfers in progress without sending a signal to the thread that
+ * waits for them, see struct usb_raw_ep_cancel.
+ * Accepts a pointer to the usb_raw_ep_cancel struct as an argument.
+ * Returns the number of dequeued requests on success or negative error code
+ * on failure.
+ */
+#define USB_RAW_IOCTL_EP_CANCEL		_IOW('U', 33, struct usb_raw_ep_cancel)
+
 #endif /* _UAPI__LINUX_USB_RAW_GADGET_H */
@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints for the USB Raw Gadget driver.
+ *
+ * Instances are identified by the number in their gadget driver name
+ * (raw-gadget.N), endpoints by their UDC names. The usb_request pointers
+ * match the ones reported by the Dummy HCD/UDC tracepoints.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM raw_gadget
+
+#if !defined(__RAW_GADGET_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __RAW_GADGET_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb/gadget.h>
+
+#define RAW_TRACE_EP_NAME_MAX	16
+
+DECLARE_EVENT_CLASS(raw_gadget_req,
+	TP_PROTO(int id, struct usb_ep *ep, struct usb_request *req),
+	TP_ARGS(id, ep, req),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__array(char, name, RAW_TRACE_EP_NAME_MAX)
+		__field(const void *, req)
+		__field(unsigned int, length)
+		__field(unsigned int, actual)
+		__field(unsigned int, stream_id)
+		__field(int, zero)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		strscpy(__entry->name, ep->name, RAW_TRACE_EP_NAME_MAX);
+		__entry->req = req;
+		__entry->length = req->length;
+		__entry->actual = req->actual;
+		__entry->stream_id = req->stream_id;
+		__entry->zero = req->zero;
+		__entry->status = req->status;
+	),
+	TP_printk("raw-gadget.%d %s: req %p length %u/%u stream %u zero %d status %d",
+		__entry->id, __entry->name, __entry->req, __entry->actual,
+		__entry->length, __entry->stream_id, __entry->zero,
+		__entry->status)
+);
+
+DEFINE_EVENT(raw_gadget_req, raw_gadget_ep_queue,
+	TP_PROTO(int id, struct usb_ep *ep, struct usb_request *req),
+	TP_ARGS(id, ep, req)
+);
+
+DEFINE_EVENT(raw_gadget_req, raw_gadget_ep_complete,
+	TP_PROTO(int id, struct usb_ep *ep, struct usb_request *req),
+	TP_ARGS(id, ep, req)
+);
+
+DEFINE_EVENT(raw_gadget_req, raw_gadget_ep_dequeue,
+	TP_PROTO(int id, struct usb_ep *ep, struct usb_request *req),
+	TP_ARGS(id, ep, req)
+);
+
+/* A request submitted with USB_RAW_IOCTL_EP_SUBMIT or through the ring. */
+TRACE_EVENT(raw_gadget_ep_submit,
+	TP_PROTO(int id, const struct usb_raw_ep_submit *arg, bool ring),
+	TP_ARGS(id, arg, ring),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u16, ep)
+		__field(u16, flags)
+		__field(u32, length)
+		__field(u32, stream_id)
+		__field(u64, cookie)
+		__field(bool, ring)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->ep = arg->ep;
+		__entry->flags = arg->flags;
+		__entry->length = arg->length;
+		__entry->stream_id = arg->stream_id;
+		__entry->cookie = arg->cookie;
+		__entry->ring = ring;
+	),
+	TP_printk("raw-gadget.%d ep %u: cookie %llx length %u stream %u flags %x%s",
+		__entry->id, __entry->ep, __entry->cookie, __entry->length,
+		__entry->stream_id, __entry->flags,
+		__entry->ring ? " ring" : "")
+);
+
+DECLARE_EVENT_CLASS(raw_gadget_event,
+	TP_PROTO(int id, u32 type, u32 length, int ret),
+	TP_ARGS(id, type, length, ret),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u32, type)
+		__field(u32, length)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->type = type;
+		__entry->length = length;
+		__entry->ret = ret;
+	),
+	TP_printk("raw-gadget.%d: type %u length %u ret %d",
+		__entry->id, __entry->type, __entry->length, __entry->ret)
+);
+
+DEFINE_EVENT(raw_gadget_event, raw_gadget_event_add,
+	TP_PROTO(int id, u32 type, u32 length, int ret),
+	TP_ARGS(id, type, length, ret)
+);
+
+DEFINE_EVENT(raw_gadget_event, raw_gadget_event_fetch,
+	TP_PROTO(int id, u32 type, u32 length, int ret),
+	TP_ARGS(id, type, length, ret)
+);
+
+#endif /* __RAW_GADGET_TRACE_H */
+
+/* The module is built out of tree, so the header is looked up locally. */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE raw_gadget_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,56 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+import errno
+import json
+import sys
+
+def read_log(filename):
+	with open(filename, 'r') as f:
+		data = f.read()
+		return json.loads(data)
+
+def format_rate(result):
+	if result["code"] != 0:
+		return errno.errorcode[result["code"]]
+	if "ops" in result:
+		return "%.1f ops/s" % (result["ops"],)
+	return "%.2f MB/s" % (result["throughput"],)
+
+def format_latency(result):
+	if result["code"] != 0:
+		return ""
+	return "%.0f / %.0f" % (result["latency"]["p50"],
+				result["latency"]["p99"])
+
+def format_ratio(raw, zero):
+	if raw["code"] != 0 or zero["code"] != 0:
+		return ""
+	key = "ops" if "ops" in raw else "throughput"
+	return "%.0f%%" % (100 * raw[key] / zero[key],)
+
+def format_benchmarks(raw_filename, zero_filename):
+	raw = read_log(raw_filename)
+	zero = read_log(zero_filename)
+	assert(len(raw) == len(zero))
+
+	print("| Benchmark | Length | Depth | `raw_gadget` | `g_zero` | " +
+		"Ratio | `raw_gadget` p50 / p99, us | `g_zero` p50 / p99, us |")
+	print("| :--- | ---: | ---: | ---: | ---: | ---: | ---: | ---: |")
+
+	for i in range(len(raw)):
+		for key in ("benchmark", "length", "depth"):
+			assert(raw[i][key] == zero[i][key])
+		print("| test %d: %s | %d | %d | %s | %s | %s | %s | %s |" % \
+			(raw[i]["test"], raw[i]["benchmark"],
+			raw[i]["length"], raw[i]["depth"],
+			format_rate(raw[i]), format_rate(zero[i]),
+			format_ratio(raw[i], zero[i]),
+			format_latency(raw[i]), format_latency(zero[i])))
+
+if __name__ == '__main__':
+	if len(sys.argv) != 3:
+		print("Usage: %s <RAW_GADGET.JSON> <G_ZERO.JSON>" % \
+			(sys.argv[0],))
+		sys.exit(-1)
+	format_benchmarks(sys.argv[1], sys.argv[2])
@@ -6,15 +6,20 @@
 //
 // Andrey Konovalov <andreyknvl@gmail.com>
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -26,90 +31,12 @@
 #include <linux/types.h>
 #include <linux/usb/ch9.h>
 
-/*----------------------------------------------------------------------*/
-
-#define UDC_NAME_LENGTH_MAX 128
-
-struct usb_raw_init {
-	__u8 driver_name[UDC_NAME_LENGTH_MAX];
-	__u8 device_name[UDC_NAME_LENGTH_MAX];
-	__u8 speed;
-};
-
-enum usb_raw_event_type {
-	USB_RAW_EVENT_INVALID = 0,
-	USB_RAW_EVENT_CONNECT = 1,
-	USB_RAW_EVENT_CONTROL = 2,
-	USB_RAW_EVENT_SUSPEND = 3,
-	USB_RAW_EVENT_RESUME = 4,
-	USB_RAW_EVENT_RESET = 5,
-	USB_RAW_EVENT_DISCONNECT = 6,
-};
-
-struct usb_raw_event {
-	__u32		type;
-	__u32		length;
-	__u8		data[];
-};
-
-struct usb_raw_ep_io {
-	__u16		ep;
-	__u16		flags;
-	__u32		length;
-	__u8		data[];
-};
-
-#define USB_RAW_EPS_NUM_MAX	30
-#define USB_RAW_EP_NAME_MAX	16
-#define USB_RAW_EP_ADDR_ANY	0xff
-
-struct usb_raw_ep_caps {
-	__u32	type_control	: 1;
-	__u32	type_iso	: 1;
-	__u32	type_bulk	: 1;
-	__u32	type_int	: 1;
-	__u32	dir_in		: 1;
-	__u32	dir_out		: 1;
-};
-
-struct usb_raw_ep_limits {
-	__u16	maxpacket_limit;
-	__u16	max_streams;
-	__u32	reserved;
-};
-
-struct usb_raw_ep_info {
-	__u8				name[USB_RAW_EP_NAME_MAX];
-	__u32				addr;
-	struct usb_raw_ep_caps		caps;
-	struct usb_raw_ep_limits	limits;
-};
-
-struct usb_raw_eps_info {
-	struct usb_raw_ep_info	eps[USB_RAW_EPS_NUM_MAX];
-};
-
-#define USB_RAW_IOCTL_INIT		_IOW('U', 0, struct usb_raw_init)
-#define USB_RAW_IOCTL_RUN		_IO('U', 1)
-#define USB_RAW_IOCTL_EVENT_FETCH	_IOR('U', 2, struct usb_raw_event)
-#define USB_RAW_IOCTL_EP0_WRITE		_IOW('U', 3, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP0_READ		_IOWR('U', 4, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP_ENABLE		_IOW('U', 5, struct usb_endpoint_descriptor)
-#define USB_RAW_IOCTL_EP_DISABLE	_IOW('U', 6, __u32)
-#define USB_RAW_IOCTL_EP_WRITE		_IOW('U', 7, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_EP_READ		_IOWR('U', 8, struct usb_raw_ep_io)
-#define USB_RAW_IOCTL_CONFIGURE		_IO('U', 9)
-#define USB_RAW_IOCTL_VBUS_DRAW		_IOW('U', 10, __u32)
-#define USB_RAW_IOCTL_EPS_INFO		_IOR('U', 11, struct usb_raw_eps_info)
-#define USB_RAW_IOCTL_EP0_STALL		_IO('U', 12)
-#define USB_RAW_IOCTL_EP_SET_HALT	_IOW('U', 13, __u32)
-#define USB_RAW_IOCTL_EP_CLEAR_HALT	_IOW('U', 14, __u32)
-#define USB_RAW_IOCTL_EP_SET_WEDGE	_IOW('U', 15, __u32)
+#include "../lib/libraw_gadget.h"
 
 /*----------------------------------------------------------------------*/
 
 int usb_raw_open() {
-	int fd = open("/dev/raw-gadget", O_RDWR);
+	int fd = raw_gadget_open();
 	if (fd < 0) {
 		perror("open()");
 		exit(EXIT_FAILURE);
@@ -119,11 +46,7 @@ int usb_raw_open() {
 
 void usb_raw_init(int fd, enum usb_device_speed speed,
 			const char *driver, const char *device) {
-	struct usb_raw_init arg;
-	strcpy((char *)&arg.driver_name[0], driver);
-	strcpy((char *)&arg.device_name[0], device);
-	arg.speed = speed;
-	int rv = ioctl(fd, USB_RAW_IOCTL_INIT, &arg);
+	int rv = raw_gadget_init(fd, speed, driver, device);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_INIT)");
 		exit(EXIT_FAILURE);
@@ -131,7 +54,7 @@ void usb_raw_init(int fd, enum usb_device_speed speed,
 }
 
 void usb_raw_run(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_RUN, 0);
+	int rv = raw_gadget_run(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_RUN)");
 		exit(EXIT_FAILURE);
@@ -139,7 +62,7 @@ void usb_raw_run(int fd) {
 }
 
 void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, event);
+	int rv = raw_gadget_event_fetch(fd, event);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EVENT_FETCH)");
 		exit(EXIT_FAILURE);
@@ -147,7 +70,7 @@ void usb_raw_event_fetch(int fd, struct usb_raw_event *event) {
 }
 
 int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_READ, io);
+	int rv = raw_gadget_ep0_read(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_READ)");
 		exit(EXIT_FAILURE);
@@ -156,7 +79,7 @@ int usb_raw_ep0_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep0_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, io);
+	int rv = raw_gadget_ep0_write(fd, io);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_WRITE)");
 		exit(EXIT_FAILURE);
@@ -165,7 +88,7 @@ int usb_raw_ep0_write(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_enable(int fd, struct usb_endpoint_descriptor *desc) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_ENABLE, desc);
+	int rv = raw_gadget_ep_enable(fd, desc);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_ENABLE)");
 		exit(EXIT_FAILURE);
@@ -174,7 +97,7 @@ int usb_raw_ep_enable(int fd, struct usb_endpoint_descriptor *desc) {
 }
 
 int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_READ, io);
+	int rv = raw_gadget_ep_read(fd, io);
 	if (rv < 0) {
 		if (errno == EINPROGRESS || errno == EPIPE) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -187,7 +110,7 @@ int usb_raw_ep_read(int fd, struct usb_raw_ep_io *io) {
 }
 
 int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_WRITE, io);
+	int rv = raw_gadget_ep_write(fd, io);
 	if (rv < 0) {
 		if (errno == EINPROGRESS || errno == EPIPE) {
 			// Ignore failures caused by the test that halts endpoints.
@@ -199,8 +122,50 @@ int usb_raw_ep_write(int fd, struct usb_raw_ep_io *io) {
 	return rv;
 }
 
+int usb_raw_ep_submit(int fd, struct usb_raw_ep_submit *submit) {
+	int rv = raw_gadget_ep_submit(fd, submit);
+	if (rv < 0) {
+		if (errno == EINPROGRESS || errno == EPIPE) {
+			// Ignore failures caused by the test that halts endpoints.
+			return rv;
+		}
+		perror("ioctl(USB_RAW_IOCTL_EP_SUBMIT)");
+		exit(EXIT_FAILURE);
+	}
+	return rv;
+}
+
+int usb_raw_ep_reap(int fd, struct usb_raw_ep_reap *reap) {
+	int rv = raw_gadget_ep_reap(fd, reap);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_REAP)");
+		exit(EXIT_FAILURE);
+	}
+	return rv;
+}
+
+void *usb_raw_ep_alloc_bufs(int fd, int ep, uint32_t count, uint32_t size) {
+	struct usb_raw_ep_bufs arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ep = ep;
+	arg.count = count;
+	arg.size = size;
+	int rv = raw_gadget_ep_alloc_bufs(fd, &arg);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_EP_ALLOC_BUFS)");
+		exit(EXIT_FAILURE);
+	}
+	void *bufs = mmap(NULL, (size_t)count * size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, arg.offset);
+	if (bufs == MAP_FAILED) {
+		perror("mmap()");
+		exit(EXIT_FAILURE);
+	}
+	return bufs;
+}
+
 void usb_raw_configure(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+	int rv = raw_gadget_configure(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_CONFIGURED)");
 		exit(EXIT_FAILURE);
@@ -208,7 +173,7 @@ void usb_raw_configure(int fd) {
 }
 
 void usb_raw_vbus_draw(int fd, uint32_t power) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, power);
+	int rv = raw_gadget_vbus_draw(fd, power);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_VBUS_DRAW)");
 		exit(EXIT_FAILURE);
@@ -216,7 +181,7 @@ void usb_raw_vbus_draw(int fd, uint32_t power) {
 }
 
 int usb_raw_eps_info(int fd, struct usb_raw_eps_info *info) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EPS_INFO, info);
+	int rv = raw_gadget_eps_info(fd, info);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EPS_INFO)");
 		exit(EXIT_FAILURE);
@@ -225,7 +190,7 @@ int usb_raw_eps_info(int fd, struct usb_raw_eps_info *info) {
 }
 
 void usb_raw_ep0_stall(int fd) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+	int rv = raw_gadget_ep0_stall(fd);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP0_STALL)");
 		exit(EXIT_FAILURE);
@@ -233,13 +198,22 @@ void usb_raw_ep0_stall(int fd) {
 }
 
 void usb_raw_ep_set_halt(int fd, int ep) {
-	int rv = ioctl(fd, USB_RAW_IOCTL_EP_SET_HALT, ep);
+	int rv = raw_gadget_ep_set_halt(fd, ep);
 	if (rv < 0) {
 		perror("ioctl(USB_RAW_IOCTL_EP_SET_HALT)");
 		exit(EXIT_FAILURE);
 	}
 }
 
+void usb_raw_desc_set(int fd, __u8 type, __u8 index, __u16 lang_id,
+			const void *data, __u32 length) {
+	int rv = raw_gadget_desc_set(fd, type, index, lang_id, data, length);
+	if (rv < 0) {
+		perror("ioctl(USB_RAW_IOCTL_DESC_SET)");
+		exit(EXIT_FAILURE);
+	}
+}
+
 /*----------------------------------------------------------------------*/
 
 void log_control_request(struct usb_ctrlrequest *ctrl) {
@@ -723,15 +697,16 @@ void *ep_bulk_in_loop(void *arg) {
 	int fd = (int)(long)arg;
 	struct usb_raw_bulk_io io;
 
+	// usb_raw_ep_write() doesn't modify the data, fill it in once.
+	for (int i = 0; i < sizeof(io.data); i++)
+		io.data[i] = (i % EP_MAX_PACKET_BULK) % 63;
+
 	while (true) {
 		assert(ep_bulk_in != -1);
 		io.inner.ep = ep_bulk_in;
 		io.inner.flags = 0;
 		io.inner.length = sizeof(io.data);
 
-		for (int i = 0; i < sizeof(io.data); i++)
-			io.data[i] = (i % EP_MAX_PACKET_BULK) % 63;
-
 		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
 		printf("bulk_in: wrote %d bytes\n", rv);
 	}
@@ -760,15 +735,15 @@ void *ep_int_in_loop(void *arg) {
 	int fd = (int)(long)arg;
 	struct usb_raw_int_io io;
 
+	for (int i = 0; i < sizeof(io.data); i++)
+		io.data[i] = (i % EP_MAX_PACKET_INT) % 63;
+
 	while (true) {
 		assert(ep_int_in != -1);
 		io.inner.ep = ep_int_in;
 		io.inner.flags = 0;
 		io.inner.length = sizeof(io.data);
 
-		for (int i = 0; i < sizeof(io.data); i++)
-			io.data[i] = (i % EP_MAX_PACKET_INT) % 63;
-
 		int rv = usb_raw_ep_write(fd, (struct usb_raw_ep_io *)&io);
 		printf("int_in: wrote %d bytes\n", rv);
 	}
@@ -776,6 +751,297 @@ void *ep_int_in_loop(void *arg) {
 	return NULL;
 }
 
+/*----------------------------------------------------------------------*/
+
+// Stress mode, enabled with RG_STRESS=1 (see README.md). Instead of the loops
+// above, each endpoint gets a thread that keeps RG_STRESS_DEPTH requests
+// queued with USB_RAW_IOCTL_EP_SUBMIT and reaps them with
+// USB_RAW_IOCTL_EP_REAP. Per-transfer logging is replaced with a summary
+// printed every RG_STRESS_INTERVAL seconds.
+
+#define STRESS_LENGTH_MAX	USB_RAW_EP_BUF_SIZE_MAX
+
+bool stress;
+bool stress_verify;
+bool stress_mapped;
+unsigned int stress_depth = 8;
+unsigned int stress_length = EP_MAX_PACKET_BULK;
+unsigned int stress_interval = 1;
+
+int stress_cpus[CPU_SETSIZE];
+int stress_cpus_num;
+
+// The data usbtest expects with pattern=1, computed once. Interrupt
+// endpoints use a prefix shorter than their maxpacket, so it fits them too.
+char stress_pattern[STRESS_LENGTH_MAX];
+
+struct stress_ep {
+	const char		*name;
+	int			*ep;
+	bool			in;
+	unsigned int		length;
+
+	int			fd;
+	pthread_t		thread;
+	bool			started;
+
+	atomic_ullong		bytes;
+	atomic_ullong		transfers;
+	atomic_ullong		errors;
+	atomic_ullong		mismatches;
+
+	// Values at the previous summary, only used by stress_report_loop().
+	unsigned long long	last_bytes;
+	unsigned long long	last_transfers;
+};
+
+struct stress_ep stress_eps[] = {
+	{ .name = "bulk_out", .ep = &ep_bulk_out, .in = false },
+	{ .name = "bulk_in", .ep = &ep_bulk_in, .in = true },
+	{ .name = "int_out", .ep = &ep_int_out, .in = false },
+	{ .name = "int_in", .ep = &ep_int_in, .in = true },
+};
+
+#define STRESS_EPS_NUM	(sizeof(stress_eps) / sizeof(stress_eps[0]))
+
+pthread_t stress_report_thread;
+
+struct usb_raw_stress_reap {
+	struct usb_raw_ep_reap		inner;
+	struct usb_raw_ep_completion	completions[USB_RAW_EP_SUBMIT_MAX];
+};
+
+unsigned int stress_env(const char *name, unsigned int def,
+			unsigned int min, unsigned int max) {
+	const char *value = getenv(name);
+	if (!value)
+		return def;
+
+	char *end;
+	unsigned long rv = strtoul(value, &end, 0);
+	if (*value == '\0' || *end != '\0' || rv < min || rv > max) {
+		printf("fail: %s must be between %u and %u\n", name, min, max);
+		exit(EXIT_FAILURE);
+	}
+	return rv;
+}
+
+void stress_parse_cpus(const char *value) {
+	while (*value) {
+		char *end;
+		long cpu = strtol(value, &end, 10);
+		if (end == value || cpu < 0 || cpu >= CPU_SETSIZE ||
+				(*end != ',' && *end != '\0')) {
+			printf("fail: RG_STRESS_CPUS must be a list of CPUs\n");
+			exit(EXIT_FAILURE);
+		}
+		if (stress_cpus_num < CPU_SETSIZE)
+			stress_cpus[stress_cpus_num++] = cpu;
+		value = (*end == ',') ? end + 1 : end;
+	}
+}
+
+void stress_init(void) {
+	if (stress_env("RG_STRESS", 0, 0, 1) == 0)
+		return;
+	stress = true;
+
+	stress_verify = stress_env("RG_STRESS_VERIFY", 0, 0, 1);
+	stress_mapped = stress_env("RG_STRESS_MAPPED", 0, 0, 1);
+	stress_depth = stress_env("RG_STRESS_DEPTH", stress_depth,
+					1, USB_RAW_EP_SUBMIT_MAX);
+	// Requests without mapped buffers are limited to a page.
+	stress_length = stress_env("RG_STRESS_LENGTH", stress_length, 1,
+					stress_mapped ? STRESS_LENGTH_MAX :
+						sysconf(_SC_PAGESIZE));
+	stress_interval = stress_env("RG_STRESS_INTERVAL", stress_interval,
+					1, 3600);
+	if (getenv("RG_STRESS_CPUS"))
+		stress_parse_cpus(getenv("RG_STRESS_CPUS"));
+
+	for (int i = 0; i < sizeof(stress_pattern); i++)
+		stress_pattern[i] = (i % EP_MAX_PACKET_BULK) % 63;
+
+	stress_eps[0].length = stress_length;
+	stress_eps[1].length = stress_length;
+	stress_eps[2].length = EP_MAX_PACKET_INT;
+	stress_eps[3].length = EP_MAX_PACKET_INT;
+
+	printf("stress: depth %u, length %u, verify %d, mapped %d, cpus %d\n",
+		stress_depth, stress_length, stress_verify, stress_mapped,
+		stress_cpus_num);
+}
+
+void *stress_ep_loop(void *arg) {
+	struct stress_ep *sep = arg;
+	int fd = sep->fd;
+	int ep = *sep->ep;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t size;
+	char *bufs;
+
+	assert(ep != -1);
+
+	// Mapped buffers must be a multiple of the page size.
+	if (stress_mapped) {
+		size = (sep->length + page_size - 1) & ~(page_size - 1);
+		bufs = usb_raw_ep_alloc_bufs(fd, ep, stress_depth, size);
+	} else {
+		size = sep->length;
+		bufs = raw_gadget_buf_alloc(stress_depth * size);
+		if (!bufs) {
+			perror("raw_gadget_buf_alloc()");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// IN data is never modified, so the buffers are only filled once.
+	if (sep->in) {
+		for (int i = 0; i < stress_depth; i++)
+			memcpy(bufs + i * size, stress_pattern, sep->length);
+	}
+
+	bool idle[USB_RAW_EP_SUBMIT_MAX];
+	unsigned int queued = 0;
+	struct usb_raw_stress_reap reap;
+
+	for (int i = 0; i < stress_depth; i++)
+		idle[i] = true;
+
+	while (true) {
+		bool halted = false;
+
+		// The slot index is used as the cookie.
+		for (int i = 0; i < stress_depth && !halted; i++) {
+			if (!idle[i])
+				continue;
+
+			struct usb_raw_ep_submit submit;
+			memset(&submit, 0, sizeof(submit));
+			submit.ep = ep;
+			submit.length = sep->length;
+			submit.cookie = i;
+			if (stress_mapped) {
+				submit.flags = USB_RAW_SUBMIT_FLAGS_MAPPED;
+				submit.buffer = i;
+			} else {
+				submit.buffer = (uintptr_t)(bufs + i * size);
+			}
+
+			if (usb_raw_ep_submit(fd, &submit) < 0) {
+				halted = true;
+				break;
+			}
+			idle[i] = false;
+			queued++;
+		}
+
+		if (queued == 0) {
+			usleep(1000);
+			continue;
+		}
+
+		reap.inner.ep = ep;
+		reap.inner.flags = 0;
+		reap.inner.count = stress_depth;
+		int rv = usb_raw_ep_reap(fd, (struct usb_raw_ep_reap *)&reap);
+
+		for (int i = 0; i < rv; i++) {
+			struct usb_raw_ep_completion *c = &reap.completions[i];
+
+			assert(c->cookie < stress_depth && !idle[c->cookie]);
+			idle[c->cookie] = true;
+			queued--;
+
+			if (c->status) {
+				atomic_fetch_add(&sep->errors, 1);
+				continue;
+			}
+			atomic_fetch_add(&sep->bytes, c->length);
+			atomic_fetch_add(&sep->transfers, 1);
+
+			if (!sep->in && stress_verify &&
+					memcmp(bufs + c->cookie * size,
+						stress_pattern, c->length))
+				atomic_fetch_add(&sep->mismatches, 1);
+		}
+
+		// Give the host time to clear the halt before resubmitting.
+		if (halted)
+			usleep(1000);
+	}
+
+	return NULL;
+}
+
+void *stress_report_loop(void *arg) {
+	struct timespec last, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &last);
+
+	while (true) {
+		sleep(stress_interval);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double elapsed = (now.tv_sec - last.tv_sec) +
+				(now.tv_nsec - last.tv_nsec) / 1e9;
+		last = now;
+
+		for (int i = 0; i < STRESS_EPS_NUM; i++) {
+			struct stress_ep *sep = &stress_eps[i];
+			if (!sep->started)
+				continue;
+
+			unsigned long long bytes = atomic_load(&sep->bytes);
+			unsigned long long transfers =
+					atomic_load(&sep->transfers);
+
+			printf("stress: %s: %.2f MB/s, %.0f transfers/s, "
+				"%llu errors, %llu mismatches\n", sep->name,
+				(bytes - sep->last_bytes) / elapsed / 1e6,
+				(transfers - sep->last_transfers) / elapsed,
+				atomic_load(&sep->errors),
+				atomic_load(&sep->mismatches));
+			sep->last_bytes = bytes;
+			sep->last_transfers = transfers;
+		}
+		fflush(stdout);
+	}
+
+	return NULL;
+}
+
+// Called once the endpoints are enabled. Endpoint threads are pinned to the
+// CPUs from RG_STRESS_CPUS in a round-robin fashion.
+void stress_start(int fd) {
+	for (int i = 0; i < STRESS_EPS_NUM; i++) {
+		struct stress_ep *sep = &stress_eps[i];
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		if (stress_cpus_num) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(stress_cpus[i % stress_cpus_num], &cpus);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+		}
+
+		sep->fd = fd;
+		sep->started = true;
+		int rv = pthread_create(&sep->thread, &attr,
+					stress_ep_loop, sep);
+		if (rv) {
+			errno = rv;
+			perror("pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+		pthread_attr_destroy(&attr);
+	}
+
+	pthread_create(&stress_report_thread, 0, stress_report_loop, NULL);
+}
+
+/*----------------------------------------------------------------------*/
+
 #define VENDOR_REQ_OUT	0x5b
 #define VENDOR_REQ_IN	0x5c
 
@@ -862,14 +1128,19 @@ bool ep0_request(int fd, struct usb_raw_control_event *event,
 			ep_int_in = usb_raw_ep_enable(fd,
 						&usb_endpoint_int_in);
 			printf("int_in: ep = #%d\n", ep_int_in);
-			pthread_create(&ep_bulk_out_thread, 0,
+			if (stress) {
+				if (!stress_eps[0].started)
+					stress_start(fd);
+			} else {
+				pthread_create(&ep_bulk_out_thread, 0,
 					ep_bulk_out_loop, (void *)(long)fd);
-			pthread_create(&ep_bulk_in_thread, 0,
+				pthread_create(&ep_bulk_in_thread, 0,
 					ep_bulk_in_loop, (void *)(long)fd);
-			pthread_create(&ep_int_out_thread, 0,
+				pthread_create(&ep_int_out_thread, 0,
 					ep_int_out_loop, (void *)(long)fd);
-			pthread_create(&ep_int_in_thread, 0,
+				pthread_create(&ep_int_in_thread, 0,
 					ep_int_in_loop, (void *)(long)fd);
+			}
 			usb_raw_vbus_draw(fd, usb_config.bMaxPower);
 			usb_raw_configure(fd);
 			io->inner.length = 0;
@@ -933,7 +1204,8 @@ void ep0_loop(int fd) {
 		event.inner.length = sizeof(event.ctrl);
 
 		usb_raw_event_fetch(fd, (struct usb_raw_event *)&event);
-		log_event((struct usb_raw_event *)&event);
+		if (!stress)
+			log_event((struct usb_raw_event *)&event);
 
 		if (event.inner.type == USB_RAW_EVENT_CONNECT) {
 			process_eps_info(fd);
@@ -950,7 +1222,8 @@ void ep0_loop(int fd) {
 
 		bool reply = ep0_request(fd, &event, &io);
 		if (!reply) {
-			printf("ep0: stalling\n");
+			if (!stress)
+				printf("ep0: stalling\n");
 			usb_raw_ep0_stall(fd);
 			continue;
 		}
@@ -961,10 +1234,12 @@ void ep0_loop(int fd) {
 		int rv = -1;
 		if (event.ctrl.bRequestType & USB_DIR_IN) {
 			rv = usb_raw_ep0_write(fd, (struct usb_raw_ep_io *)&io);
-			printf("ep0: transferred %d bytes (in)\n", rv);
+			if (!stress)
+				printf("ep0: transferred %d bytes (in)\n", rv);
 		} else {
 			rv = usb_raw_ep0_read(fd, (struct usb_raw_ep_io *)&io);
-			printf("ep0: transferred %d bytes (out)\n", rv);
+			if (!stress)
+				printf("ep0: transferred %d bytes (out)\n", rv);
 		}
 
 		if ((event.ctrl.bRequestType & USB_TYPE_MASK) ==
@@ -974,6 +1249,30 @@ void ep0_loop(int fd) {
 	}
 }
 
+// Lets Raw Gadget answer the GET_DESCRIPTOR requests that have the same reply
+// every time without forwarding them to ep0_loop(). Non-zero string indices
+// are still answered by ep0_request(), as it accepts any index.
+void load_descs(int fd) {
+	char config[USB_RAW_DESC_LENGTH_MAX];
+	char lang_ids[4] = { 4, USB_DT_STRING, 0x09, 0x04 };
+	int length;
+
+	usb_raw_desc_set(fd, USB_DT_DEVICE, 0, 0,
+				&usb_device, sizeof(usb_device));
+	usb_raw_desc_set(fd, USB_DT_DEVICE_QUALIFIER, 0, 0,
+				&usb_qualifier, sizeof(usb_qualifier));
+	length = build_config(&config[0], sizeof(config), false);
+	usb_raw_desc_set(fd, USB_DT_CONFIG, 0, 0, &config[0], length);
+	length = build_config(&config[0], sizeof(config), true);
+	usb_raw_desc_set(fd, USB_DT_OTHER_SPEED_CONFIG, 0, 0,
+				&config[0], length);
+	usb_raw_desc_set(fd, USB_DT_STRING, 0, 0,
+				&lang_ids[0], sizeof(lang_ids));
+	if (BCD_USB >= 0x0201)
+		usb_raw_desc_set(fd, USB_DT_BOS, 0, 0,
+					&usb_bos, sizeof(usb_bos));
+}
+
 int main(int argc, char **argv) {
 	const char *device = "dummy_udc.0";
 	const char *driver = "dummy_udc";
@@ -982,8 +1281,12 @@ int main(int argc, char **argv) {
 	if (argc >= 3)
 		driver = argv[2];
 
+	stress_init();
+
 	int fd = usb_raw_open();
 	usb_raw_init(fd, USB_SPEED_HIGH, driver, device);
+	if (getenv("RG_DESC_CACHE"))
+		load_descs(fd);
 	usb_raw_run(fd);
 
 	ep0_loop(fd);
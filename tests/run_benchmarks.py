@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+import json
+import math
+import re
+import subprocess
+import sys
+
+# Each benchmark is run for every value of the swept parameter. Lengths are
+# in bytes, depths are the number of scatter/gather entries or queued control
+# requests that usbtest keeps in flight.
+benchmarks = [
+	("bulk, non-queued, OUT", 1, "length", [512, 4096, 16384, 65536]),
+	("bulk, non-queued, IN", 2, "length", [512, 4096, 16384, 65536]),
+	("bulk, queued, OUT", 5, "depth", [1, 4, 16, 32]),
+	("bulk, queued, IN", 6, "depth", [1, 4, 16, 32]),
+	("control, non-queued, sanity", 9, None, [None]),
+	("control, queued", 10, "depth", [1, 4, 16, 32]),
+	("interrupt, non-queued, OUT", 25, "length", [8, 64]),
+	("interrupt, non-queued, IN", 26, "length", [8, 64]),
+]
+
+# Transfer length for benchmarks that don't sweep it, same as in run_tests.py.
+default_length = 1024
+# Throughput runs move about this many bytes each.
+throughput_bytes = 16 * 1024 * 1024
+throughput_iterations_max = 1000
+throughput_iterations_control = 100
+throughput_runs = 3
+# Latency is measured over this many single-iteration runs.
+latency_runs = 200
+
+result_re = re.compile(r"SUCCESS: (\d+)\.(\d+) secs")
+
+def run_testusb(device, test, count, repeats, length, sglen):
+	args = ("./testusb",
+		"-D", str(device),
+		"-t", str(test),
+		"-c", str(count),
+		"-s", str(length),
+		"-v", str(length),
+		"-g", str(sglen),
+		"-r", str(repeats),
+	)
+	print(" ".join(args))
+	r = subprocess.run(args, stdout=subprocess.PIPE, text=True)
+	durations = []
+	for line in r.stdout.splitlines():
+		m = result_re.search(line)
+		if m:
+			durations.append(int(m.group(1)) + int(m.group(2)) / 1e6)
+	return r.returncode, durations
+
+# Nearest-rank percentile.
+def percentile(values, p):
+	values = sorted(values)
+	rank = max(1, math.ceil(p / 100 * len(values)))
+	return values[rank - 1]
+
+def median(values):
+	return percentile(values, 50)
+
+def run_benchmark(device, benchmark, value):
+	(name, test, param, _) = benchmark
+	length = value if param == "length" else default_length
+	depth = value if param == "depth" else 1
+	control = test in (9, 10)
+
+	# Bytes moved by a single usbtest iteration; control tests are
+	# reported in iterations per second instead.
+	unit = None if control else length * depth
+	if control:
+		count = throughput_iterations_control
+	else:
+		count = max(1, min(throughput_iterations_max,
+				throughput_bytes // unit))
+
+	result = {"benchmark": name, "test": test,
+			"length": length, "depth": depth}
+	code, durations = run_testusb(device, test, count,
+				throughput_runs, length, depth)
+	if code == 0:
+		code, latencies = run_testusb(device, test, 1,
+					latency_runs, length, depth)
+	result["code"] = code
+	if code != 0:
+		print("FAILURE: %s" % (code,))
+		return result
+
+	rate = count / median(durations)
+	if control:
+		result["ops"] = rate
+	else:
+		result["throughput"] = rate * unit / 1e6
+	result["latency"] = {
+		"p50": percentile(latencies, 50) * 1e6,
+		"p90": percentile(latencies, 90) * 1e6,
+		"p99": percentile(latencies, 99) * 1e6,
+		"max": max(latencies) * 1e6,
+	}
+	print("SUCCESS: %s, p50 %.0f us, p99 %.0f us" % (
+		"%.1f ops/s" % (rate,) if control else
+			"%.2f MB/s" % (result["throughput"],),
+		result["latency"]["p50"], result["latency"]["p99"]))
+	return result
+
+def run_benchmarks(device):
+	results = []
+	for benchmark in benchmarks:
+		for value in benchmark[3]:
+			param = "" if benchmark[2] is None else \
+				", %s %d" % (benchmark[2], value)
+			print("test %d: %s%s" % (benchmark[1], benchmark[0],
+								param))
+			results.append(run_benchmark(device, benchmark, value))
+	return results
+
+def save_results(results, filename):
+	s = json.dumps(results, indent=4, sort_keys=True)
+	with open(filename, 'w+') as f:
+		f.write(s)
+		f.write("\n")
+
+if __name__ == '__main__':
+	if len(sys.argv) != 3:
+		print("Usage: %s <DEVICE> <FILE>" % (sys.argv[0],))
+		sys.exit(-1)
+	r = run_benchmarks(sys.argv[1])
+	save_results(r, sys.argv[2])
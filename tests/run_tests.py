@@ -2,10 +2,14 @@
 # SPDX-License-Identifier: Apache-2.0
 
 import errno
+import glob
 import json
 import os
+import queue
 import subprocess
 import sys
+import threading
+import time
 
 tests = [
 	("test 1: bulk, non-queued, OUT", 1, {}),
@@ -34,7 +38,7 @@ tests = [
 	("test 26: interrupt, non-queued, IN", 26, {"length": 64}),
 ]
 
-def run_test(device, test, count, **kwargs):
+def run_test(device, test, count, quiet=False, **kwargs):
 	length = kwargs.get("length", 1024)
 	vary = kwargs.get("vary", 1024)
 	sglen = kwargs.get("sglen", 32)
@@ -46,6 +50,9 @@ def run_test(device, test, count, **kwargs):
 		"-v", str(vary),
 		"-g", str(sglen),
 	)
+	if quiet:
+		r = subprocess.run(args, stdout=subprocess.DEVNULL)
+		return r.returncode
 	print(" ".join(args))
 	r = subprocess.run(args)
 	return r.returncode
@@ -59,6 +66,84 @@ def run_tests(device, count):
 		codes.append(r)
 	return codes
 
+# Runs the tests on several devices at once. Each device runs one test at a
+# time; the codes are returned in the same order as for run_tests().
+def run_tests_parallel(devices, count):
+	codes = [None] * len(tests)
+	pending = queue.Queue()
+	for i in range(len(tests)):
+		pending.put(i)
+	lock = threading.Lock()
+
+	def worker(device):
+		while True:
+			try:
+				i = pending.get_nowait()
+			except queue.Empty:
+				return
+			test = tests[i]
+			r = run_test(device, test[1], count, quiet=True,
+								**test[2])
+			with lock:
+				print("%s on %s: %s" % (test[0], device,
+					"SUCCESS" if r == 0 else
+						"FAILURE: %s" % (r,)))
+			codes[i] = r
+
+	threads = [threading.Thread(target=worker, args=(device,))
+						for device in devices]
+	for t in threads:
+		t.start()
+	for t in threads:
+		t.join()
+	return codes
+
+# Returns the device node of the device connected to the root hub of the n-th
+# Dummy HCD instance, or None if it is not enumerated yet.
+def find_dummy_device(n):
+	pattern = "/sys/devices/platform/dummy_hcd.%d/usb*/*-1" % (n,)
+	for path in glob.glob(pattern):
+		try:
+			with open(os.path.join(path, "busnum")) as f:
+				bus = int(f.read())
+			with open(os.path.join(path, "devnum")) as f:
+				dev = int(f.read())
+		except (OSError, ValueError):
+			continue
+		return "/dev/bus/usb/%03d/%03d" % (bus, dev)
+	return None
+
+# Starts ./gadget on each of the first num Dummy UDC instances, which requires
+# the dummy_hcd module loaded with num set to at least that, and waits until
+# all of them are enumerated.
+def start_dummy_gadgets(num, timeout=10):
+	gadgets = []
+	for n in range(num):
+		args = ("./gadget", "dummy_udc.%d" % (n,), "dummy_udc")
+		print(" ".join(args))
+		gadgets.append(subprocess.Popen(args,
+				stdout=subprocess.DEVNULL))
+	deadline = time.monotonic() + timeout
+	while True:
+		devices = [find_dummy_device(n) for n in range(num)]
+		if all(devices) or time.monotonic() > deadline:
+			break
+		time.sleep(0.1)
+	if not all(devices):
+		stop_gadgets(gadgets)
+		missing = [n for n in range(num) if not devices[n]]
+		print("Devices on dummy_hcd %s did not show up" % (missing,))
+		sys.exit(-1)
+	# Give usbtest a moment to bind to the new devices.
+	time.sleep(1)
+	return gadgets, devices
+
+def stop_gadgets(gadgets):
+	for g in gadgets:
+		g.kill()
+	for g in gadgets:
+		g.wait()
+
 def save_results(codes, filename):
 	results = []
 	assert len(tests) == len(codes)
@@ -72,9 +157,31 @@ def save_results(codes, filename):
 		f.write(s)
 		f.write("\n")
 
+def usage():
+	print("Usage: %s <DEVICE>[,<DEVICE>...] <FILE>" % (sys.argv[0],))
+	print("       %s --dummy <NUM> <FILE>" % (sys.argv[0],))
+	sys.exit(-1)
+
 if __name__ == '__main__':
-	if len(sys.argv) != 3:
-		print("Usage: %s <DEVICE> <FILE>" % (sys.argv[0],))
-		sys.exit(-1)
-	r = run_tests(sys.argv[1], 8)
-	save_results(r, sys.argv[2])
+	if len(sys.argv) == 4 and sys.argv[1] == "--dummy":
+		try:
+			num = int(sys.argv[2])
+		except ValueError:
+			usage()
+		if num < 1:
+			usage()
+		gadgets, devices = start_dummy_gadgets(num)
+		try:
+			r = run_tests_parallel(devices, 8)
+		finally:
+			stop_gadgets(gadgets)
+		save_results(r, sys.argv[3])
+	elif len(sys.argv) == 3:
+		devices = sys.argv[1].split(",")
+		if len(devices) == 1:
+			r = run_tests(devices[0], 8)
+		else:
+			r = run_tests_parallel(devices, 8)
+		save_results(r, sys.argv[2])
+	else:
+		usage()
@@ -65,9 +65,10 @@ int main (int argc, char **argv) {
 
 	char *device = NULL;
 	int test = -1;
+	unsigned int repeats = 1;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "D:t:c:s:v:g:h")) != EOF) {
+	while ((opt = getopt(argc, argv, "D:t:c:s:v:g:r:h")) != EOF) {
 		switch (opt) {
 		case 'D':  // Device path, e.g. /dev/bus/usb/005/003.
 			device = optarg;
@@ -93,6 +94,10 @@ int main (int argc, char **argv) {
 			if (parse_num(optarg, &param.sglen))
 				goto usage;
 			continue;
+		case 'r':  // Number of times to run the test.
+			if (parse_num(optarg, &repeats) || repeats == 0)
+				goto usage;
+			continue;
 		case 'h':
 		default:
 usage:
@@ -105,7 +110,8 @@ usage:
 				"\t-c iterations\t\tdefault 1000\n"
 				"\t-s transfer length\tdefault 1024\n"
 				"\t-v vary\t\t\tdefault 1024\n"
-				"\t-g s/g length\t\tdefault 32\n",
+				"\t-g s/g length\t\tdefault 32\n"
+				"\t-r repeats\t\tdefault 1\n",
 				argv[0]);
 			return EXIT_FAILURE;
 		}
@@ -127,22 +133,28 @@ usage:
 	}
 
 	int ifnum = 0;
-	int status = usbdev_ioctl(fd, ifnum, USBTEST_REQUEST, &param);
-
-	if (status < 0) {
-		char buf[80];
-		int err = errno;
-		if (strerror_r(errno, buf, sizeof(buf))) {
-			snprintf(buf, sizeof(buf), "error %d", err);
-			errno = err;
+
+	// The duration is measured by usbtest around the whole test and is
+	// used by run_benchmarks.py, so keep the output format stable.
+	for (unsigned int i = 0; i < repeats; i++) {
+		int status = usbdev_ioctl(fd, ifnum, USBTEST_REQUEST, &param);
+
+		if (status < 0) {
+			char buf[80];
+			int err = errno;
+			if (strerror_r(errno, buf, sizeof(buf))) {
+				snprintf(buf, sizeof(buf), "error %d", err);
+				errno = err;
+			}
+			printf("%s test %02d: FAILURE: %d (%s)\n",
+				device, test, errno, buf);
+			return errno;
 		}
-		printf("%s test %02d: FAILURE: %d (%s)\n",
-			device, test, errno, buf);
-		return errno;
-	}
 
-	printf("%s test %02d: SUCCESS: %d.%.06d secs\n", device, test,
-		(int)param.duration.tv_sec, (int)param.duration.tv_usec);
+		printf("%s test %02d: SUCCESS: %d.%.06d secs\n", device, test,
+			(int)param.duration.tv_sec,
+			(int)param.duration.tv_usec);
+	}
 
 	return EXIT_SUCCESS;
 }